@@ -1,31 +1,81 @@
 require "mkmf"
 
 have_library("stdc++")
-have_library("raw_r")
-
-
-#$CFLAGS << " -I#{File.dirname(__FILE__)}/src"
-#$CFLAGS << " -I#{File.dirname(__FILE__)}/internal"
-
-#try_link("#{File.dirname(__FILE__)}/src/libraw_cxx.cpp")
-
-=begin
-$srcs = %w{
-./lib_raw.cpp
-./internal/aahd_demosaic.cpp
-./internal/dcraw_common.cpp
-./internal/dcraw_fileio.cpp
-./internal/demosaic_packs.cpp
-./internal/dht_demosaic.cpp
-./internal/libraw_x3f.cpp
-./internal/wf_filtering.cpp
-./src/libraw_c_api.cpp
-./src/libraw_cxx.cpp
-./src/libraw_datastream.cpp
-}
-p $srcs
-=end
-
-#have_library("libraw_r")
+
+$CXXFLAGS << " -std=c++11"
+
+# --with-bundled-libraw=DIR compiles LibRaw from its source tree into the
+# extension instead of linking the system raw_r, with OpenMP when the
+# compiler has it. --with-libraw-demosaic-pack-gpl2=DIR and
+# --with-libraw-demosaic-pack-gpl3=DIR add the GPL demosaic packs,
+# --with-libraw-march=ARCH selects the SIMD level (e.g. native, haswell)
+libraw_dir = with_config("bundled-libraw")
+if libraw_dir
+	libraw_dir = File.expand_path(libraw_dir)
+	abort "#{libraw_dir}/libraw/libraw.h not found" unless File.exist?("#{libraw_dir}/libraw/libraw.h")
+
+	# the objects LibRaw's own Makefile links into the library; some
+	# sources (the demosaic algorithms) are #included by others
+	makefile = "#{libraw_dir}/Makefile.dist"
+	objects = File.exist?(makefile) ? File.read(makefile).gsub(/\\\n/, " ")[/^LIB_OBJECTS\s*=(.*)$/, 1].to_s.scan(/object\/(\w+)\.o/).flatten : []
+	objects = %w[dcraw_common dcraw_fileio demosaic_packs libraw_cxx libraw_datastream libraw_c_api] if objects.empty?
+	sources = objects.map { |name| Dir["#{libraw_dir}/{internal,src}/#{name}.cpp"].first }.compact
+
+	$INCFLAGS << " -I#{libraw_dir}"
+	$VPATH.concat(sources.map { |f| File.dirname(f) }.uniq)
+	$srcs = Dir["#{$srcdir}/*.cpp"].map { |f| File.basename(f) } + sources.map { |f| File.basename(f) }
+	# dcraw's tables narrow ints into chars, an error under C++11
+	$CXXFLAGS << " -Wno-narrowing"
+	have_library("m")
+
+	if try_compile("int main(void) { return 0; }", "-fopenmp")
+		$CFLAGS << " -fopenmp"
+		$CXXFLAGS << " -fopenmp"
+		$LDFLAGS << " -fopenmp"
+	end
+
+	%w[gpl2 gpl3].each do |pack|
+		if dir = with_config("libraw-demosaic-pack-#{pack}")
+			$defs << "-DLIBRAW_DEMOSAIC_PACK_#{pack.upcase}"
+			$INCFLAGS << " -I#{File.expand_path(dir)}"
+		end
+	end
+
+	if march = with_config("libraw-march")
+		$CFLAGS << " -march=#{march}"
+		$CXXFLAGS << " -march=#{march}"
+	end
+else
+	have_library("raw_r")
+end
+
+have_struct_member("struct stat", "st_mtim", "sys/stat.h")
+have_header("ruby/ractor.h")
+
+# LibRaw.tune_malloc
+if have_header("malloc.h")
+	have_func("mallopt", "malloc.h")
+end
+
+# tile_pyramid writes JPEG tiles when libjpeg is available, PNM otherwise
+if have_header("jpeglib.h", ["stdio.h"])
+	have_library("jpeg", "jpeg_mem_dest", ["stdio.h", "jpeglib.h"])
+end
+
+# processed_image(shared: true): memfd, or POSIX shm where it is missing
+unless have_func("memfd_create", "sys/mman.h")
+	have_library("rt", "shm_open", "sys/mman.h")
+end
+
+# save_unpacked(compress: true)
+if have_header("lz4.h")
+	have_library("lz4", "LZ4_compress_default", "lz4.h")
+end
+
+# renditions(format: :webp)
+if have_header("webp/encode.h") && have_library("webp", "WebPEncodeRGB", "webp/encode.h")
+	have_func("WebPFree", "webp/encode.h")
+end
+
 
 create_makefile("lib_raw/lib_raw")
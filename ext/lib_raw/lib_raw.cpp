@@ -1,5 +1,56 @@
 #include "lib_raw.h"
 #include "libraw/libraw.h"
+#include "ruby/thread.h"
+#ifdef HAVE_RUBY_RACTOR_H
+#include "ruby/ractor.h"
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <string>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <time.h>
+#include <errno.h>
+#ifdef HAVE_MALLOC_H
+#include <malloc.h>
+#endif
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_JPEGLIB_H
+#include <jpeglib.h>
+#endif
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+#ifdef HAVE_WEBP_ENCODE_H
+#include <webp/encode.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 
 VALUE rb_mLibRaw;
@@ -18,10 +69,18 @@ VALUE rb_cRawObject;
 
 VALUE rb_cIParam;
 VALUE rb_cImageSize;
+VALUE rb_cColorData;
 VALUE rb_cImgOther;
 VALUE rb_cOutputParam;
 VALUE rb_cMakerNote;
 VALUE rb_cLensInfo;
+VALUE rb_cMetadataIndex;
+VALUE rb_cRenderCache;
+VALUE rb_cColumn;
+VALUE rb_cProcessedImage;
+VALUE rb_cCalibration;
+VALUE rb_cResult;
+VALUE rb_cRendition;
 
 VALUE rb_eRawError;
 VALUE rb_eUnspecifiedError;
@@ -54,7 +113,20 @@ void output_param_native_resource_delete(OutputParamNativeResource * p)
 	free(p);
 }
 
-LibRaw* get_lib_raw(VALUE self)
+// immutable once the owning OutputParam is frozen, so presets can cross Ractors;
+// wrapped with a real class since hidden objects cannot be frozen
+static const rb_data_type_t output_param_native_resource_type = {
+	"LibRaw::OutputParam::NativeResource",
+	{ 0, (RUBY_DATA_FUNC)output_param_native_resource_delete, 0, },
+	0, 0,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+	RUBY_TYPED_FROZEN_SHAREABLE
+#else
+	0
+#endif
+};
+
+static LibRawNativeResource *get_lib_raw_resource(VALUE self)
 {
 	VALUE resource = rb_iv_get(self, "lib_raw_native_resource");
 	if (resource==Qnil) {
@@ -63,6 +135,12 @@ LibRaw* get_lib_raw(VALUE self)
 
 	LibRawNativeResource *p = NULL;
 	Data_Get_Struct(resource, LibRawNativeResource, p);
+	return p;
+}
+
+LibRaw* get_lib_raw(VALUE self)
+{
+	LibRawNativeResource *p = get_lib_raw_resource(self);
 	if (p) {
 		return p->libraw;
 	}
@@ -78,7 +156,7 @@ libraw_output_params_t* get_output_params(VALUE self)
 	}
 
 	OutputParamNativeResource *p = NULL;
-	Data_Get_Struct(resource, OutputParamNativeResource, p);
+	TypedData_Get_Struct(resource, OutputParamNativeResource, &output_param_native_resource_type, p);
 	if (p) {
 		return &p->params;
 	}
@@ -86,6 +164,12 @@ libraw_output_params_t* get_output_params(VALUE self)
 	return NULL;
 }
 
+libraw_output_params_t* get_mutable_output_params(VALUE self)
+{
+	rb_check_frozen(self);
+	return get_output_params(self);
+}
+
 void copy_lib_raw(VALUE dst, VALUE src)
 {
 	VALUE resource = rb_iv_get(src, "lib_raw_native_resource");
@@ -130,726 +214,6815 @@ void check_errors(int e)
 }
 
 
-// LibRaw::RawObject
+// Native Worker
 
-void apply_rawobject(VALUE self)
+int native_thread_count(void)
 {
-	LibRaw *raw = get_lib_raw(self);
-	if (raw) {
-		apply_data(self, &raw->imgdata);
+	unsigned n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
+
+// OpenMP threads per demosaic, 0 for OpenMP's default
+static std::atomic<int> demosaic_threads(0);
+
+// the OpenMP thread count is per calling thread, so it is applied on the
+// thread about to run dcraw_process; `share` of them when that many
+// decoders run side by side
+static void apply_demosaic_threads(int share)
+{
+#ifdef _OPENMP
+	int n = demosaic_threads.load();
+	if (n<=0) {
+		n = omp_get_num_procs();
 	}
+	n /= share<1 ? 1 : share;
+	omp_set_num_threads(n<1 ? 1 : n);
+#endif
 }
 
-void apply_data(VALUE self, libraw_data_t *p)
+VALUE rb_lib_raw_threads(VALUE self)
 {
-	if (p) {
-		// size
-		VALUE size = rb_iv_get(self, "@size");
-		if (size==Qnil) {
-			size = rb_class_new_instance(0, NULL, rb_cImageSize);
-			rb_iv_set(self, "@size", size);
-		}
-		apply_image_size(size, &p->sizes);
+	int n = demosaic_threads.load();
+#ifdef _OPENMP
+	if (n<=0) {
+		n = omp_get_num_procs();
+	}
+#else
+	n = 1;
+#endif
+	return INT2NUM(n);
+}
 
-		// idata
-		VALUE idata = rb_iv_get(self, "@idata");
-		if (idata==Qnil) {
-			idata = rb_class_new_instance(0, NULL, rb_cIParam);
-			rb_iv_set(self, "@idata", idata);
+// threads used inside one dcraw_process, nil for all processors; only
+// effective when LibRaw was built with OpenMP (LibRaw::OPENMP)
+VALUE rb_lib_raw_set_threads(VALUE self, VALUE threads)
+{
+	int n = RTEST(threads) ? NUM2INT(threads) : 0;
+	if (n<0) {
+		rb_raise(rb_eArgError, "threads must not be negative");
+	}
+	demosaic_threads.store(n);
+	return threads;
+}
+
+// split [0, n) into one contiguous range per thread and run f(begin, end, index)
+template <typename F>
+static void parallel_for(int n, int threads, F f)
+{
+	if (threads > n) {
+		threads = n;
+	}
+	if (threads <= 1) {
+		if (n > 0) {
+			f(0, n, 0);
 		}
-		apply_iparam(idata, &p->idata);
+		return;
+	}
 
-		// lens
-		VALUE lens = rb_iv_get(self, "@lens");
-		if (lens==Qnil) {
-			lens = rb_class_new_instance(0, NULL, rb_cLensInfo);
-			rb_iv_set(self, "@lens", lens);
+	std::vector<std::thread> workers;
+	int chunk = (n + threads - 1) / threads;
+	for (int i=0; i<threads; i++) {
+		int begin = i * chunk;
+		int end = begin + chunk < n ? begin + chunk : n;
+		if (begin < end) {
+			workers.push_back(std::thread(f, begin, end, i));
 		}
-		apply_lensinfo(lens, &p->lens);
+	}
+	for (size_t i=0; i<workers.size(); i++) {
+		workers[i].join();
+	}
+}
 
-		// TODO: params
+template <typename F>
+static void *without_gvl_func(void *data)
+{
+	(*(F *)data)();
+	return NULL;
+}
 
-		// TODO: color
-/*
-		VALUE color = rb_iv_get(self, "@color");
-		if (color==Qnil) {
-			color = rb_class_new_instance(0, NULL, rb_cColorData);
-			rb_iv_set(self, "@color", color);
-		}
-		apply_colordata(color, &p->color);
-*/
+// run f with the GVL released; f must not touch any Ruby object
+template <typename F>
+static void call_without_gvl(F f)
+{
+	rb_thread_call_without_gvl(without_gvl_func<F>, &f, RUBY_UBF_IO, NULL);
+}
 
-		// other
-		VALUE other = rb_iv_get(self, "@other");
-		if (other==Qnil) {
-			other = rb_class_new_instance(0, NULL, rb_cImgOther);
-			rb_iv_set(self, "@other", other);
-		}
-		apply_imgother(other, &p->other);
+// while a native job works on a RawObject's decoded data without the GVL
+static bool lib_raw_busy(LibRawNativeResource *p)
+{
+	return __atomic_load_n(&p->busy, __ATOMIC_ACQUIRE)!=0;
+}
 
-		// param
-		VALUE param = rb_iv_get(self, "@param");
-		if (param==Qnil) {
-			param = rb_class_new_instance(0, NULL, rb_cOutputParam);
-			rb_iv_set(self, "@param", param);
-		}
-		apply_output_param(param, &p->params);
+static void check_idle(LibRawNativeResource *p)
+{
+	if (lib_raw_busy(p)) {
+		rb_raise(rb_eRuntimeError, "RawObject is busy with a native job");
 	}
 }
 
-VALUE rb_raw_object_initialize(VALUE self)
+// the same for a job on owner's decoded data: the object counts as busy
+// from before the GVL goes until f is done, so that the methods that free
+// or replace that data refuse to run meanwhile. An exclusive job changes
+// the data itself; it needs the object idle and keeps other jobs out. The
+// marks are dropped on the native side, since the GVL may come back with
+// an interrupt raised.
+template <typename F>
+static void call_without_gvl(LibRawNativeResource *owner, F f, bool exclusive = false)
 {
-	LibRawNativeResource *p = ALLOC(LibRawNativeResource);
-	p->libraw = NULL;
-
-	try {
-		p->libraw = new LibRaw(LIBRAW_OPTIONS_NONE);
-	} catch (std::bad_alloc) {
-		rb_raise(rb_eStandardError, "alloc error");
+	bool started = false;
+	auto job = [&]() {
+		started = true;
+		f();
+		if (exclusive) {
+			__atomic_store_n(&owner->exclusive, 0, __ATOMIC_RELEASE);
+		}
+		__atomic_sub_fetch(&owner->busy, 1, __ATOMIC_RELEASE);
+	};
+	while (!started) {
+		if (exclusive) {
+			check_idle(owner);
+			__atomic_store_n(&owner->exclusive, 1, __ATOMIC_RELEASE);
+		} else if (__atomic_load_n(&owner->exclusive, __ATOMIC_ACQUIRE)) {
+			check_idle(owner);
+		}
+		__atomic_add_fetch(&owner->busy, 1, __ATOMIC_ACQUIRE);
+		// fails without running job when interrupted first
+		rb_thread_call_without_gvl2(without_gvl_func<decltype(job)>, &job, RUBY_UBF_IO, NULL);
+		if (!started) {
+			if (exclusive) {
+				__atomic_store_n(&owner->exclusive, 0, __ATOMIC_RELEASE);
+			}
+			__atomic_sub_fetch(&owner->busy, 1, __ATOMIC_RELEASE);
+			rb_thread_check_ints();
+		}
 	}
+}
 
-	VALUE resource = Data_Wrap_Struct(CLASS_OF(self), 0, lib_raw_native_resource_delete, p);
-	rb_iv_set(self, "lib_raw_native_resource", resource);
+// Memory Budget
 
-	apply_data(self, &p->libraw->imgdata);
+// process-wide admission control: decodes reserve their estimated peak
+// before they start and wait while the reservations would exceed the
+// budget. 0 is unlimited; a reservation always fits when none is held, so
+// a decode larger than the whole budget runs alone instead of never
+static std::mutex memory_budget_mutex;
+static std::condition_variable memory_budget_cond;
+static size_t memory_budget_limit = 0;
+static size_t memory_budget_used = 0;
+static double memory_budget_timeout = -1;
 
-	return self;
+static bool memory_budget_fits(size_t bytes)
+{
+	return !memory_budget_limit || !memory_budget_used || memory_budget_used + bytes <= memory_budget_limit;
 }
 
-VALUE rb_raw_object_open_file(VALUE self, VALUE filename)
+// seconds to wait for a reservation, negative for no limit
+static double memory_budget_wait(void)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	std::lock_guard<std::mutex> lock(memory_budget_mutex);
+	return memory_budget_timeout;
+}
 
-	char *name = RSTRING_PTR(rb_obj_as_string(filename));
-	int ret = libraw->open_file(name);
-	apply_rawobject(self);
-	check_errors(ret);
+// blocks up to timeout seconds (forever when negative); false when it did not fit in time
+static bool reserve_memory_native(size_t bytes, double timeout)
+{
+	std::unique_lock<std::mutex> lock(memory_budget_mutex);
+	if (timeout<0) {
+		memory_budget_cond.wait(lock, [&]() { return memory_budget_fits(bytes); });
+	} else if (!memory_budget_cond.wait_for(lock, std::chrono::duration<double>(timeout), [&]() { return memory_budget_fits(bytes); })) {
+		return false;
+	}
+	memory_budget_used += bytes;
+	return true;
+}
 
-	return Qtrue;
+static void release_memory(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(memory_budget_mutex);
+	memory_budget_used -= bytes;
+	memory_budget_cond.notify_all();
 }
 
-VALUE rb_raw_object_open_buffer(VALUE self, VALUE buff)
+// from a Ruby thread: waits with the GVL released, in short slices so that
+// the thread stays interruptible
+static bool reserve_memory(size_t bytes)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	if (reserve_memory_native(bytes, 0)) {
+		return true;
+	}
+	double timeout = memory_budget_wait();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (;;) {
+		double slice = 0.1;
+		if (0<=timeout) {
+			double left = timeout - std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			if (left<=0) {
+				return false;
+			}
+			slice = left<slice ? left : slice;
+		}
+		bool reserved = false;
+		call_without_gvl([&]() {
+			reserved = reserve_memory_native(bytes, slice);
+		});
+		if (reserved) {
+			return true;
+		}
+		rb_thread_check_ints();
+	}
+}
 
-	int ret = libraw->open_buffer(RSTRING_PTR(buff), RSTRING_LEN(buff));
-	apply_rawobject(self);
-	check_errors(ret);
+// for native workers, which cannot be interrupted and wait the full timeout
+struct MemoryReservation {
+	size_t bytes;
+	bool held;
 
-	return Qtrue;
-}
+	MemoryReservation(size_t n, double timeout) : bytes(n), held(reserve_memory_native(n, timeout)) {}
+	~MemoryReservation()
+	{
+		if (held) {
+			release_memory(bytes);
+		}
+	}
+};
 
-VALUE rb_raw_object_unpack(VALUE self)
+// peak of unpack: the 16 bit sensor buffer (four samples per pixel for
+// non-bayer data) and about a quarter more for decoder buffers
+static size_t unpack_memory_estimate(LibRaw *libraw)
 {
-	LibRaw *libraw = get_lib_raw(self);
-
-	int ret = libraw->unpack();
-	check_errors(ret);
+	libraw_image_sizes_t *sizes = &libraw->imgdata.sizes;
+	size_t samples = libraw->imgdata.idata.filters || libraw->imgdata.idata.colors==1 ? 1 : 4;
+	size_t raw = (size_t)sizes->raw_width * sizes->raw_height * samples * 2;
+	return raw + raw / 4;
+}
 
-	return Qtrue;
+// peak of dcraw_process and dcraw_make_mem_image on top of the unpacked
+// data: image[4], interpolation scratch of about the same size and a 16 bit
+// output bitmap; half_size works on a quarter of the pixels
+static size_t process_memory_estimate(int width, int height, bool half_size)
+{
+	size_t w = half_size ? (width + 1) / 2 : width;
+	size_t h = half_size ? (height + 1) / 2 : height;
+	return w * h * (8 + 8 + 6);
 }
 
-VALUE rb_raw_object_unpack_thumb(VALUE self)
+VALUE rb_lib_raw_memory_budget(VALUE self)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	size_t limit;
+	{
+		std::lock_guard<std::mutex> lock(memory_budget_mutex);
+		limit = memory_budget_limit;
+	}
+	return SIZET2NUM(limit);
+}
 
-	int ret = libraw->unpack_thumb();
-	check_errors(ret);
+// bytes, nil or 0 for no limit
+VALUE rb_lib_raw_set_memory_budget(VALUE self, VALUE bytes)
+{
+	size_t limit = RTEST(bytes) ? NUM2SIZET(bytes) : 0;
+	std::lock_guard<std::mutex> lock(memory_budget_mutex);
+	memory_budget_limit = limit;
+	memory_budget_cond.notify_all();
+	return bytes;
+}
 
-	return Qtrue;
+VALUE rb_lib_raw_memory_budget_timeout(VALUE self)
+{
+	double timeout = memory_budget_wait();
+	return timeout<0 ? Qnil : DBL2NUM(timeout);
 }
 
-VALUE rb_raw_object_recycle_datastream(VALUE self)
+// seconds a decode waits for budget before failing with UnsufficientMemory;
+// nil waits as long as it takes, 0 fails fast
+VALUE rb_lib_raw_set_memory_budget_timeout(VALUE self, VALUE seconds)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	double timeout = RTEST(seconds) ? NUM2DBL(seconds) : -1;
+	if (RTEST(seconds) && timeout<0) {
+		rb_raise(rb_eArgError, "timeout must not be negative");
+	}
+	std::lock_guard<std::mutex> lock(memory_budget_mutex);
+	memory_budget_timeout = timeout;
+	return seconds;
+}
 
-	libraw->recycle_datastream();
+// bytes currently reserved by running decodes
+VALUE rb_lib_raw_memory_reserved(VALUE self)
+{
+	size_t used;
+	{
+		std::lock_guard<std::mutex> lock(memory_budget_mutex);
+		used = memory_budget_used;
+	}
+	return SIZET2NUM(used);
+}
 
-	return Qnil;
+// Buffer Pool
+
+// process-wide cache of large pixel buffers. Blocks are mapped in 2 MiB
+// granules and kept after release, up to buffer_pool_limit bytes, so that
+// repeated same-size decodes get warm blocks back instead of a fresh
+// mapping and its page faults. A cached block is reused for requests it
+// exceeds by at most an eighth.
+static const size_t BUFFER_POOL_GRANULE = 2 * 1024 * 1024;
+static const size_t BUFFER_POOL_MIN_SIZE = 1024 * 1024;
+
+static std::mutex buffer_pool_mutex;
+static std::multimap<size_t, void *> buffer_pool_cache;
+static std::map<void *, size_t> buffer_pool_blocks;
+static size_t buffer_pool_limit = 0;
+static bool buffer_pool_huge_pages = false;
+static size_t buffer_pool_cached = 0;
+static size_t buffer_pool_in_use = 0;
+static size_t buffer_pool_high_water = 0;
+static unsigned long long buffer_pool_maps = 0;
+static unsigned long long buffer_pool_reuses = 0;
+static unsigned long long buffer_pool_reused_bytes = 0;
+
+// huge page blocks are aligned to the granule so the kernel can back them fully
+static void *buffer_pool_map(size_t capacity, bool huge_pages)
+{
+	size_t length = huge_pages ? capacity + BUFFER_POOL_GRANULE : capacity;
+	char *p = (char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p==MAP_FAILED) {
+		return NULL;
+	}
+	if (huge_pages) {
+		size_t head = (BUFFER_POOL_GRANULE - (size_t)p % BUFFER_POOL_GRANULE) % BUFFER_POOL_GRANULE;
+		if (head) {
+			munmap(p, head);
+		}
+		munmap(p + head + capacity, BUFFER_POOL_GRANULE - head);
+		p += head;
+#ifdef MADV_HUGEPAGE
+		madvise(p, capacity, MADV_HUGEPAGE);
+#endif
+	}
+	return p;
 }
 
-VALUE rb_raw_object_recycle(VALUE self)
+// evicts the smallest cached blocks until `bytes` more fit; lock held
+static void buffer_pool_shrink(size_t bytes)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	while (!buffer_pool_cache.empty() && buffer_pool_limit<buffer_pool_cached + bytes) {
+		std::multimap<size_t, void *>::iterator it = buffer_pool_cache.begin();
+		munmap(it->second, it->first);
+		buffer_pool_cached -= it->first;
+		buffer_pool_cache.erase(it);
+	}
+}
 
-	libraw->recycle();
+// NULL when out of memory; small buffers come from malloc
+void *buffer_pool_alloc(size_t size)
+{
+	if (size<BUFFER_POOL_MIN_SIZE) {
+		return malloc(size ? size : 1);
+	}
+	size_t capacity = (size + BUFFER_POOL_GRANULE - 1) / BUFFER_POOL_GRANULE * BUFFER_POOL_GRANULE;
+
+	std::unique_lock<std::mutex> lock(buffer_pool_mutex);
+	void *p = NULL;
+	std::multimap<size_t, void *>::iterator it = buffer_pool_cache.lower_bound(capacity);
+	if (it!=buffer_pool_cache.end() && it->first - capacity<=capacity / 8) {
+		capacity = it->first;
+		p = it->second;
+		buffer_pool_cache.erase(it);
+		buffer_pool_cached -= capacity;
+		buffer_pool_reuses++;
+		buffer_pool_reused_bytes += capacity;
+	} else {
+		bool huge_pages = buffer_pool_huge_pages;
+		lock.unlock();
+		p = buffer_pool_map(capacity, huge_pages);
+		lock.lock();
+		if (!p) {
+			return NULL;
+		}
+		buffer_pool_maps++;
+	}
+	buffer_pool_blocks[p] = capacity;
+	buffer_pool_in_use += capacity;
+	if (buffer_pool_high_water<buffer_pool_in_use + buffer_pool_cached) {
+		buffer_pool_high_water = buffer_pool_in_use + buffer_pool_cached;
+	}
+	return p;
+}
 
-	return Qnil;
+void buffer_pool_free(void *p)
+{
+	if (!p) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+	std::map<void *, size_t>::iterator it = buffer_pool_blocks.find(p);
+	if (it==buffer_pool_blocks.end()) {
+		free(p);
+		return;
+	}
+	size_t capacity = it->second;
+	buffer_pool_blocks.erase(it);
+	buffer_pool_in_use -= capacity;
+	if (capacity<=buffer_pool_limit) {
+		buffer_pool_shrink(capacity);
+		buffer_pool_cache.insert(std::make_pair(capacity, p));
+		buffer_pool_cached += capacity;
+	} else {
+		munmap(p, capacity);
+	}
 }
 
-VALUE rb_raw_object_dcraw_ppm_tiff_writer(VALUE self, VALUE filename)
+VALUE rb_lib_raw_buffer_pool_limit(VALUE self)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	size_t limit;
+	{
+		std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+		limit = buffer_pool_limit;
+	}
+	return SIZET2NUM(limit);
+}
 
-	const char *name = RSTRING_PTR(filename);
-	int ret = libraw->dcraw_ppm_tiff_writer(name);
-	check_errors(ret);
+// bytes of released buffers kept for reuse, 0 unmaps them on release
+VALUE rb_lib_raw_set_buffer_pool_limit(VALUE self, VALUE bytes)
+{
+	size_t limit = RTEST(bytes) ? NUM2SIZET(bytes) : 0;
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+	buffer_pool_limit = limit;
+	buffer_pool_shrink(0);
+	return bytes;
+}
 
-	return Qtrue;
+VALUE rb_lib_raw_huge_pages(VALUE self)
+{
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+	return buffer_pool_huge_pages ? Qtrue : Qfalse;
 }
 
-VALUE rb_raw_object_dcraw_thumb_writer(VALUE self, VALUE filename)
+// asks for transparent huge pages on newly mapped buffers
+VALUE rb_lib_raw_set_huge_pages(VALUE self, VALUE val)
 {
-	LibRaw *libraw = get_lib_raw(self);
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+	buffer_pool_huge_pages = RTEST(val);
+	return val;
+}
 
-	const char *name = RSTRING_PTR(filename);
-	int ret = libraw->dcraw_thumb_writer(name);
-	check_errors(ret);
+VALUE rb_lib_raw_buffer_pool_stats(VALUE self)
+{
+	size_t in_use, cached, high_water;
+	unsigned long long maps, reuses, reused_bytes;
+	{
+		std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+		in_use = buffer_pool_in_use;
+		cached = buffer_pool_cached;
+		high_water = buffer_pool_high_water;
+		maps = buffer_pool_maps;
+		reuses = buffer_pool_reuses;
+		reused_bytes = buffer_pool_reused_bytes;
+	}
 
-	return Qtrue;
+	VALUE result = rb_hash_new();
+	rb_hash_aset(result, ID2SYM(rb_intern("reserved")), SIZET2NUM(in_use + cached));
+	rb_hash_aset(result, ID2SYM(rb_intern("in_use")), SIZET2NUM(in_use));
+	rb_hash_aset(result, ID2SYM(rb_intern("cached")), SIZET2NUM(cached));
+	rb_hash_aset(result, ID2SYM(rb_intern("high_water")), SIZET2NUM(high_water));
+	rb_hash_aset(result, ID2SYM(rb_intern("maps")), ULL2NUM(maps));
+	rb_hash_aset(result, ID2SYM(rb_intern("reuses")), ULL2NUM(reuses));
+	rb_hash_aset(result, ID2SYM(rb_intern("reused_bytes")), ULL2NUM(reused_bytes));
+	return result;
 }
 
-VALUE rb_raw_object_dcraw_process(VALUE self, VALUE param)
+// unmaps every cached buffer
+VALUE rb_lib_raw_buffer_pool_trim(VALUE self)
 {
-	LibRaw *libraw = get_lib_raw(self);
-	libraw_output_params_t *params = get_output_params(param);
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex);
+	size_t limit = buffer_pool_limit;
+	buffer_pool_limit = 0;
+	buffer_pool_shrink(0);
+	buffer_pool_limit = limit;
+	return Qnil;
+}
 
-	memmove(&libraw->imgdata.params, params, sizeof(libraw_output_params_t));
+// LibRaw's own image and raw buffers come from malloc; raising glibc's mmap
+// threshold keeps them on the heap, where the next decode of the same size
+// reuses the freed chunks instead of mapping and faulting in new pages
+VALUE rb_lib_raw_tune_malloc(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
 
-	int ret = libraw->dcraw_process();
-	check_errors(ret);
+	ID kwargs[2] = { rb_intern("mmap_threshold"), rb_intern("trim_threshold") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
 
-	return Qtrue;
+#if defined(HAVE_MALLOPT) && defined(M_MMAP_THRESHOLD)
+	bool ok = true;
+	if (vals[0]!=Qundef) {
+		ok = mallopt(M_MMAP_THRESHOLD, NUM2INT(vals[0]))==1 && ok;
+	}
+	if (vals[1]!=Qundef) {
+		ok = mallopt(M_TRIM_THRESHOLD, NUM2INT(vals[1]))==1 && ok;
+	}
+	return ok ? Qtrue : Qfalse;
+#else
+	return Qfalse;
+#endif
 }
 
+// XXH64, streaming form, so that sensor rows need not be contiguous
 
-// LibRaw::IParam
+static const unsigned long long XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const unsigned long long XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const unsigned long long XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const unsigned long long XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
 
-void apply_iparam(VALUE self, libraw_iparams_t *p)
+static inline unsigned long long xxh_rotl(unsigned long long x, int r)
 {
-	if (p) {
-		rb_iv_set(self, "@make", rb_str_new2(p->make));
-		rb_iv_set(self, "@model", rb_str_new2(p->model));
-		rb_iv_set(self, "@software", rb_str_new2(p->software));
-		rb_iv_set(self, "@raw_count", INT2FIX(p->raw_count));
-		rb_iv_set(self, "@dng_version", INT2FIX(p->dng_version));
-		rb_iv_set(self, "@is_foveon", p->is_foveon ? Qtrue : Qfalse);
-		rb_iv_set(self, "@colors", INT2FIX(p->colors));
-		rb_iv_set(self, "@filters", INT2FIX(p->filters));
-		rb_iv_set(self, "@cdesc", rb_str_new2(p->cdesc));
-	}
+	return (x << r) | (x >> (64 - r));
 }
 
+static inline unsigned long long xxh_round(unsigned long long acc, unsigned long long input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
 
-// LibRaw::ImageSize
+static inline unsigned long long xxh_merge_round(unsigned long long acc, unsigned long long val)
+{
+	acc ^= xxh_round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
 
-void apply_image_size(VALUE self, libraw_image_sizes_t *p)
+static inline unsigned long long xxh_read64(const unsigned char *p)
 {
-	if (p) {
-		rb_iv_set(self, "@raw_height", INT2FIX(p->raw_height));
-		rb_iv_set(self, "@raw_width", INT2FIX(p->raw_width));
-		rb_iv_set(self, "@height", INT2FIX(p->height));
-		rb_iv_set(self, "@width", INT2FIX(p->width));
-		rb_iv_set(self, "@top_margin", INT2FIX(p->top_margin));
-		rb_iv_set(self, "@left_margin", INT2FIX(p->left_margin));
-		rb_iv_set(self, "@iheight", INT2FIX(p->iheight));
-		rb_iv_set(self, "@iwidth", INT2FIX(p->iwidth));
-		rb_iv_set(self, "@raw_pitch", INT2FIX(p->raw_pitch));
-		rb_iv_set(self, "@pixel_aspect", rb_float_new(p->pixel_aspect));
-		rb_iv_set(self, "@flip", INT2FIX(p->flip));
-	}
+	unsigned long long v;
+	memcpy(&v, p, sizeof(v));
+	return v;
 }
 
+static inline unsigned xxh_read32(const unsigned char *p)
+{
+	unsigned v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
 
-// LibRaw::ColorData
+struct XXH64State {
+	unsigned long long total;
+	unsigned long long v[4];
+	unsigned char mem[32];
+	unsigned memsize;
+	unsigned long long seed;
+
+	XXH64State(unsigned long long s=0) : total(0), memsize(0), seed(s)
+	{
+		v[0] = s + XXH_PRIME64_1 + XXH_PRIME64_2;
+		v[1] = s + XXH_PRIME64_2;
+		v[2] = s;
+		v[3] = s - XXH_PRIME64_1;
+	}
 
-void apply_colordata(VALUE self, libraw_colordata_t *p)
-{
-	if (p) {
-		// TODO
+	void update(const void *data, size_t len)
+	{
+		const unsigned char *p = (const unsigned char *)data;
+		const unsigned char *end = p + len;
+		total += len;
+
+		if (memsize + len < 32) {
+			memcpy(mem + memsize, p, len);
+			memsize += len;
+			return;
+		}
+		if (memsize) {
+			memcpy(mem + memsize, p, 32 - memsize);
+			p += 32 - memsize;
+			for (int i=0; i<4; i++) {
+				v[i] = xxh_round(v[i], xxh_read64(mem + i * 8));
+			}
+			memsize = 0;
+		}
+		while (p + 32 <= end) {
+			for (int i=0; i<4; i++) {
+				v[i] = xxh_round(v[i], xxh_read64(p + i * 8));
+			}
+			p += 32;
+		}
+		if (p < end) {
+			memcpy(mem, p, end - p);
+			memsize = end - p;
+		}
 	}
-}
 
+	unsigned long long digest() const
+	{
+		unsigned long long h;
+		if (total >= 32) {
+			h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12) + xxh_rotl(v[3], 18);
+			for (int i=0; i<4; i++) {
+				h = xxh_merge_round(h, v[i]);
+			}
+		} else {
+			h = seed + XXH_PRIME64_5;
+		}
+		h += total;
+
+		const unsigned char *p = mem;
+		const unsigned char *end = mem + memsize;
+		while (p + 8 <= end) {
+			h ^= xxh_round(0, xxh_read64(p));
+			h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+			p += 8;
+		}
+		if (p + 4 <= end) {
+			h ^= (unsigned long long)xxh_read32(p) * XXH_PRIME64_1;
+			h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+			p += 4;
+		}
+		while (p < end) {
+			h ^= (*p) * XXH_PRIME64_5;
+			h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+			p++;
+		}
 
-// LibRaw::ImgOther
+		h ^= h >> 33;
+		h *= XXH_PRIME64_2;
+		h ^= h >> 29;
+		h *= XXH_PRIME64_3;
+		h ^= h >> 32;
+		return h;
+	}
+};
 
-void apply_imgother(VALUE self, libraw_imgother_t *p)
+static int get_bins_option(VALUE opts, int def)
 {
-	if (p) {
-		rb_iv_set(self, "@iso_speed", rb_float_new(p->iso_speed));
-		rb_iv_set(self, "@shutter", rb_float_new(p->shutter));
-		rb_iv_set(self, "@aperture", rb_float_new(p->aperture));
-		rb_iv_set(self, "@focal_len", rb_float_new(p->focal_len));
-		rb_iv_set(self, "@timestamp", INT2FIX(p->timestamp));
-		rb_iv_set(self, "@shot_order", INT2FIX(p->shot_order));
-		rb_iv_set(self, "@desc", rb_str_new2(p->desc));
-		rb_iv_set(self, "@artist", rb_str_new2(p->artist));
+	ID kwargs[1] = { rb_intern("bins") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
 
-		// TODO: parsed_gps
+	int bins = vals[0]==Qundef ? def : NUM2INT(vals[0]);
+	if (bins<1 || 65536<bins) {
+		rb_raise(rb_eArgError, "bins must be between 1 and 65536");
+	}
+
+	return bins;
+}
+
+
+// Range Datastream
+
+static VALUE range_datastream_fetch_call(VALUE args)
+{
+	VALUE *argv = (VALUE *)args;
+	VALUE data = rb_funcall(argv[0], rb_intern("call"), 2, argv[1], argv[2]);
+	StringValue(data);
+	return data;
+}
+
+// LibRaw datastream over a Ruby callable (offset, length) -> String.
+// Fetched bytes are cached in fixed blocks; adjacent missing blocks are
+// fetched with one call and sequential reads grow a read-ahead window.
+// Methods run with the GVL held, exceptions are kept until LibRaw returns.
+class RangeDatastream : public LibRaw_abstract_datastream
+{
+public:
+	RangeDatastream(VALUE reader, INT64 total, size_t block_size, size_t cache_size)
+		: reader(reader), state(0), requests(0), fetched(0), total(total), pos(0),
+		  block_size(block_size), cache_size(cache_size), cached(0), next_offset(-1), readahead(0) {}
+
+	VALUE reader;
+	int state;
+	unsigned long long requests;
+	unsigned long long fetched;
+
+	virtual int valid() { return state==0; }
+
+	virtual int read(void *ptr, size_t size, size_t nmemb)
+	{
+		if (!size || pos>=total) {
+			return 0;
+		}
+		size_t want = size * nmemb;
+		if ((INT64)want>total - pos) {
+			want = total - pos;
+		}
+		size_t got = copy_out((unsigned char *)ptr, pos, want);
+		pos += got;
+		return got / size;
+	}
+
+	virtual int seek(INT64 offset, int whence)
+	{
+		INT64 base = whence==SEEK_CUR ? pos : whence==SEEK_END ? total : 0;
+		INT64 target = base + offset;
+		pos = target<0 ? 0 : target>total ? total : target;
+		return 0;
+	}
+
+	virtual INT64 tell() { return pos; }
+	virtual INT64 size() { return total; }
+
+	virtual int get_char()
+	{
+		unsigned char c;
+		return read(&c, 1, 1)==1 ? c : -1;
+	}
+
+	virtual char *gets(char *str, int sz)
+	{
+		if (sz<1 || pos>=total) {
+			return NULL;
+		}
+		int n = 0;
+		while (n<sz - 1) {
+			int c = get_char();
+			if (c<0) {
+				break;
+			}
+			str[n++] = c;
+			if (c=='\n') {
+				break;
+			}
+		}
+		str[n] = 0;
+		return n ? str : NULL;
+	}
+
+	// same token rules as LibRaw_buffer_datastream::scanf_one
+	virtual int scanf_one(const char *fmt, void *val)
+	{
+		if (pos>=total) {
+			return 0;
+		}
+		char buf[32];
+		size_t n = copy_out((unsigned char *)buf, pos, total - pos<31 ? total - pos : 31);
+		buf[n] = 0;
+		int ret = sscanf(buf, fmt, val);
+		if (ret>0) {
+			size_t i = 0;
+			while (pos<total) {
+				pos++;
+				i++;
+				if (n<=i || !buf[i] || buf[i]==' ' || buf[i]=='\t' || buf[i]=='\n' || 24<i) {
+					break;
+				}
+			}
+		}
+		return ret;
+	}
+
+	virtual int eof() { return pos>=total; }
+	virtual void *make_jas_stream() { return NULL; }
+
+private:
+	INT64 total;
+	INT64 pos;
+	size_t block_size;
+	size_t cache_size;
+	size_t cached;
+	INT64 next_offset;
+	INT64 readahead;
+	std::map<INT64, std::pair<std::string, std::list<INT64>::iterator> > blocks;
+	std::list<INT64> lru;
+
+	size_t copy_out(unsigned char *dst, INT64 offset, size_t length)
+	{
+		bool sequential = offset==next_offset;
+		next_offset = offset + length;
+		if (!fill(offset / block_size, (offset + length - 1) / block_size, sequential)) {
+			return 0;
+		}
+
+		size_t done = 0;
+		while (done<length) {
+			INT64 at = offset + done;
+			std::map<INT64, std::pair<std::string, std::list<INT64>::iterator> >::iterator it = blocks.find(at / block_size);
+			if (it==blocks.end()) {
+				break;
+			}
+			const std::string &data = it->second.first;
+			size_t skip = at % block_size;
+			if (data.size()<=skip) {
+				break;
+			}
+			size_t n = data.size() - skip<length - done ? data.size() - skip : length - done;
+			memcpy(dst + done, data.data() + skip, n);
+			done += n;
+			lru.splice(lru.begin(), lru, it->second.second);
+		}
+		trim();
+
+		return done;
+	}
+
+	// make blocks [first, last] resident, one fetch per run of missing blocks
+	bool fill(INT64 first, INT64 last, bool sequential)
+	{
+		INT64 last_block = (total - 1) / block_size;
+		INT64 block = first;
+		while (block<=last) {
+			if (blocks.count(block)) {
+				block++;
+				continue;
+			}
+			INT64 run_end = block;
+			while (run_end<last && !blocks.count(run_end + 1)) {
+				run_end++;
+			}
+			if (run_end==last) {
+				readahead = !sequential ? 0 : readahead ? (readahead * 2<16 ? readahead * 2 : 16) : 1;
+				INT64 ahead = last + readahead<last_block ? last + readahead : last_block;
+				while (run_end<ahead && !blocks.count(run_end + 1)) {
+					run_end++;
+				}
+			}
+			if (!fetch(block, run_end)) {
+				return false;
+			}
+			block = run_end + 1;
+		}
+		return true;
+	}
+
+	bool fetch(INT64 first, INT64 last)
+	{
+		if (state) {
+			return false;
+		}
+		INT64 offset = first * block_size;
+		INT64 length = (last - first + 1) * block_size;
+		if (length>total - offset) {
+			length = total - offset;
+		}
+
+		VALUE args[3] = { reader, LL2NUM(offset), LL2NUM(length) };
+		VALUE data = rb_protect(range_datastream_fetch_call, (VALUE)args, &state);
+		if (state) {
+			return false;
+		}
+		requests++;
+		size_t size = RSTRING_LEN(data);
+		fetched += size;
+		for (INT64 block=first; block<=last; block++) {
+			size_t skip = (block - first) * block_size;
+			if (size<=skip) {
+				break;
+			}
+			size_t n = size - skip<block_size ? size - skip : block_size;
+			insert(block, std::string(RSTRING_PTR(data) + skip, n));
+		}
+		RB_GC_GUARD(data);
+		return true;
+	}
+
+	void insert(INT64 block, const std::string &data)
+	{
+		lru.push_front(block);
+		blocks[block] = std::make_pair(data, lru.begin());
+		cached += data.size();
+	}
+
+	// evicted only after a read, so one large read may exceed the cache for a moment
+	void trim()
+	{
+		while (cached>cache_size && !lru.empty()) {
+			INT64 victim = lru.back();
+			std::map<INT64, std::pair<std::string, std::list<INT64>::iterator> >::iterator it = blocks.find(victim);
+			cached -= it->second.first.size();
+			blocks.erase(it);
+			lru.pop_back();
+		}
+	}
+};
+
+static void range_datastream_mark(RangeDatastream *p)
+{
+	rb_gc_mark(p->reader);
+}
+
+static void range_datastream_delete(RangeDatastream *p)
+{
+	delete p;
+}
+
+static RangeDatastream *get_range_datastream(VALUE self)
+{
+	VALUE resource = rb_iv_get(self, "range_datastream_native_resource");
+	if (resource==Qnil) {
+		return NULL;
+	}
+
+	RangeDatastream *p = NULL;
+	Data_Get_Struct(resource, RangeDatastream, p);
+	return p;
+}
+
+// re-raise an exception the range reader raised while LibRaw was reading
+static void check_range_datastream(VALUE self)
+{
+	RangeDatastream *stream = get_range_datastream(self);
+	if (stream && stream->state) {
+		int state = stream->state;
+		stream->state = 0;
+		rb_jump_tag(state);
+	}
+}
+
+
+// LibRaw Internals
+
+// reaches protected LibRaw state through member pointers, which is legal
+// on plain LibRaw objects (no downcast of the instance itself)
+class LibRawInternals : public LibRaw
+{
+public:
+	// LibRaw 0.17 keeps the thumbnail offset out of imgdata
+	static INT64 thumbnail_offset(LibRaw *libraw)
+	{
+		libraw_internal_data_t LibRaw::*internal = &LibRawInternals::libraw_internal_data;
+		return (libraw->*internal).internal_data.toffset;
+	}
+
+	// unpack leaves the live output params matching rawdata.ioparams;
+	// is_fuji_rotated and plan_params read them before dcraw_process
+	static void restore_output_params(LibRaw *libraw)
+	{
+		libraw_internal_data_t LibRaw::*internal = &LibRawInternals::libraw_internal_data;
+		(libraw->*internal).internal_output_params = libraw->imgdata.rawdata.ioparams;
+	}
+};
+
+
+// LibRaw::RawObject
+
+// for the methods that free or replace the decoded data
+static LibRaw *get_idle_lib_raw(VALUE self)
+{
+	LibRawNativeResource *p = get_lib_raw_resource(self);
+	check_idle(p);
+	return p->libraw;
+}
+
+// reserve_memory before changing self's decoded data: the wait releases
+// the GVL, so a native job may have started on it in the meantime
+static bool reserve_memory_idle(VALUE self, size_t bytes)
+{
+	if (!reserve_memory(bytes)) {
+		return false;
+	}
+	LibRawNativeResource *p = get_lib_raw_resource(self);
+	if (lib_raw_busy(p)) {
+		release_memory(bytes);
+		check_idle(p);
+	}
+	return true;
+}
+
+void apply_rawobject(VALUE self)
+{
+	LibRaw *raw = get_lib_raw(self);
+	if (raw) {
+		apply_data(self, &raw->imgdata);
+	}
+}
+
+void apply_data(VALUE self, libraw_data_t *p)
+{
+	if (p) {
+		// size
+		VALUE size = rb_iv_get(self, "@size");
+		if (size==Qnil) {
+			size = rb_class_new_instance(0, NULL, rb_cImageSize);
+			rb_iv_set(self, "@size", size);
+		}
+		apply_image_size(size, &p->sizes);
+
+		// idata
+		VALUE idata = rb_iv_get(self, "@idata");
+		if (idata==Qnil) {
+			idata = rb_class_new_instance(0, NULL, rb_cIParam);
+			rb_iv_set(self, "@idata", idata);
+		}
+		apply_iparam(idata, &p->idata);
+
+		// lens
+		VALUE lens = rb_iv_get(self, "@lens");
+		if (lens==Qnil) {
+			lens = rb_class_new_instance(0, NULL, rb_cLensInfo);
+			rb_iv_set(self, "@lens", lens);
+		}
+		apply_lensinfo(lens, &p->lens);
+
+		// TODO: params
+
+		// color
+		VALUE color = rb_iv_get(self, "@color");
+		if (color==Qnil) {
+			color = rb_class_new_instance(0, NULL, rb_cColorData);
+			rb_iv_set(self, "@color", color);
+		}
+		apply_colordata(color, &p->color);
+
+		// other
+		VALUE other = rb_iv_get(self, "@other");
+		if (other==Qnil) {
+			other = rb_class_new_instance(0, NULL, rb_cImgOther);
+			rb_iv_set(self, "@other", other);
+		}
+		apply_imgother(other, &p->other);
+
+		// param
+		VALUE param = rb_iv_get(self, "@param");
+		if (param==Qnil) {
+			param = rb_class_new_instance(0, NULL, rb_cOutputParam);
+			rb_iv_set(self, "@param", param);
+		}
+		apply_output_param(param, &p->params);
+	}
+}
+
+VALUE rb_raw_object_initialize(VALUE self)
+{
+	LibRawNativeResource *p = ALLOC(LibRawNativeResource);
+	p->libraw = NULL;
+	p->busy = 0;
+	p->exclusive = 0;
+
+	try {
+		p->libraw = new LibRaw(LIBRAW_OPTIONS_NONE);
+	} catch (std::bad_alloc) {
+		rb_raise(rb_eStandardError, "alloc error");
+	}
+
+	VALUE resource = Data_Wrap_Struct(0, 0, lib_raw_native_resource_delete, p);
+	rb_iv_set(self, "lib_raw_native_resource", resource);
+
+	apply_data(self, &p->libraw->imgdata);
+
+	return self;
+}
+
+// exception: false makes a call return a LibRaw::Result instead of raising
+static bool raise_on_error(VALUE opts)
+{
+	if (opts==Qnil) {
+		return true;
+	}
+	ID kwargs[1] = { rb_intern("exception") };
+	VALUE vals[1] = { Qundef };
+	rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	return vals[0]==Qundef || RTEST(vals[0]);
+}
+
+VALUE new_result(VALUE path, int code, unsigned warnings)
+{
+	return rb_struct_new(rb_cResult, path, INT2FIX(code), rb_str_new2(libraw_strerror(code)), UINT2NUM(warnings));
+}
+
+static VALUE finish_call(VALUE self, int ret, bool raise)
+{
+	if (raise) {
+		check_errors(ret);
+		return Qtrue;
+	}
+	return new_result(Qnil, ret, get_lib_raw(self)->imgdata.process_warnings);
+}
+
+// for callers that are themselves given keywords, which rb_scan_args in
+// rb_raw_object_open_file would otherwise pick up
+static int open_file(VALUE self, VALUE filename)
+{
+	LibRaw *libraw = get_idle_lib_raw(self);
+
+	VALUE path = rb_str_new_frozen(rb_obj_as_string(filename));
+	int ret = libraw->open_file(RSTRING_PTR(path));
+	rb_iv_set(self, "source_path", path);
+	rb_iv_set(self, "source_buffer", Qnil);
+	rb_iv_set(self, "range_datastream_native_resource", Qnil);
+	apply_rawobject(self);
+
+	return ret;
+}
+
+VALUE rb_raw_object_open_file(int argc, VALUE *argv, VALUE self)
+{
+	VALUE filename = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &filename, &opts);
+	bool raise = raise_on_error(opts);
+
+	return finish_call(self, open_file(self, filename), raise);
+}
+
+VALUE rb_raw_object_open_buffer(int argc, VALUE *argv, VALUE self)
+{
+	VALUE buff = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &buff, &opts);
+	bool raise = raise_on_error(opts);
+
+	LibRaw *libraw = get_idle_lib_raw(self);
+
+	// LibRaw reads from the buffer until recycle, so keep it alive and unchanged
+	VALUE source = rb_str_new_frozen(buff);
+	int ret = libraw->open_buffer(RSTRING_PTR(source), RSTRING_LEN(source));
+	rb_iv_set(self, "source_path", Qnil);
+	rb_iv_set(self, "source_buffer", source);
+	rb_iv_set(self, "range_datastream_native_resource", Qnil);
+	apply_rawobject(self);
+
+	return finish_call(self, ret, raise);
+}
+
+// reader.call(offset, length) must return the bytes at [offset, offset + length)
+VALUE rb_raw_object_open_range(int argc, VALUE *argv, VALUE self)
+{
+	VALUE reader = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &reader, &opts);
+
+	ID kwargs[3] = { rb_intern("size"), rb_intern("block_size"), rb_intern("cache_size") };
+	VALUE vals[3] = { Qundef, Qundef, Qundef };
+	rb_get_kwargs(opts, kwargs, 1, 2, vals);
+
+	INT64 size = NUM2LL(vals[0]);
+	long block_size = vals[1]!=Qundef ? NUM2LONG(vals[1]) : 64 * 1024;
+	long cache_size = vals[2]!=Qundef ? NUM2LONG(vals[2]) : 16 * 1024 * 1024;
+	if (size<0 || block_size<1 || cache_size<0) {
+		rb_raise(rb_eArgError, "size, block_size and cache_size must be positive");
+	}
+	if (!rb_respond_to(reader, rb_intern("call"))) {
+		rb_raise(rb_eTypeError, "reader must respond to call(offset, length)");
+	}
+
+	LibRaw *libraw = get_idle_lib_raw(self);
+
+	RangeDatastream *stream = new RangeDatastream(reader, size, block_size, cache_size);
+	VALUE resource = Data_Wrap_Struct(0, range_datastream_mark, range_datastream_delete, stream);
+	rb_iv_set(self, "range_datastream_native_resource", resource);
+	rb_iv_set(self, "source_path", Qnil);
+	rb_iv_set(self, "source_buffer", Qnil);
+
+	int ret = libraw->open_datastream(stream);
+	apply_rawobject(self);
+	check_range_datastream(self);
+	check_errors(ret);
+
+	return Qtrue;
+}
+
+VALUE rb_raw_object_range_stats(VALUE self)
+{
+	RangeDatastream *stream = get_range_datastream(self);
+	if (!stream) {
+		return Qnil;
+	}
+
+	VALUE result = rb_hash_new();
+	rb_hash_aset(result, ID2SYM(rb_intern("requests")), ULL2NUM(stream->requests));
+	rb_hash_aset(result, ID2SYM(rb_intern("bytes")), ULL2NUM(stream->fetched));
+	return result;
+}
+
+// low_memory: intermediates are freed as soon as the next stage has
+// consumed them, so the object cannot go back to an earlier stage
+
+// the unpacked sensor data, once dcraw_process has copied it into image[4]
+static void free_rawdata(LibRaw *libraw)
+{
+	libraw_rawdata_t *raw = &libraw->imgdata.rawdata;
+	if (raw->raw_alloc) {
+		libraw->free(raw->raw_alloc);
+	}
+	if (raw->ph1_cblack) {
+		libraw->free(raw->ph1_cblack);
+	}
+	if (raw->ph1_rblack) {
+		libraw->free(raw->ph1_rblack);
+	}
+	raw->raw_alloc = NULL;
+	raw->raw_image = NULL;
+	raw->color3_image = NULL;
+	raw->color4_image = NULL;
+	raw->ph1_cblack = NULL;
+	raw->ph1_rblack = NULL;
+}
+
+// progress stages after RAW2_IMAGE only work on image[4]; frees the raw
+// data in the middle of dcraw_process instead of after it
+static int free_rawdata_callback(void *data, enum LibRaw_progress stage, int iteration, int expected)
+{
+	LibRaw *libraw = (LibRaw *)data;
+	if (LIBRAW_PROGRESS_RAW2_IMAGE<stage && stage<LIBRAW_PROGRESS_THUMB_LOAD && libraw->imgdata.image && libraw->imgdata.rawdata.raw_alloc) {
+		free_rawdata(libraw);
+	}
+	return 0;
+}
+
+// the 4 channel working image, once the output has been copied out of it
+static void free_image(LibRaw *libraw)
+{
+	libraw->free(libraw->imgdata.image);
+	libraw->imgdata.image = NULL;
+}
+
+static bool low_memory_option(VALUE val)
+{
+	return val!=Qundef && RTEST(val);
+}
+
+VALUE rb_raw_object_unpack(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	ID kwargs[2] = { rb_intern("low_memory"), rb_intern("exception") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
+	bool raise = vals[1]==Qundef || RTEST(vals[1]);
+
+	LibRaw *libraw = get_idle_lib_raw(self);
+
+	int ret = LIBRAW_UNSUFFICIENT_MEMORY;
+	size_t estimate = unpack_memory_estimate(libraw);
+	if (reserve_memory_idle(self, estimate)) {
+		ret = libraw->unpack();
+		release_memory(estimate);
+	}
+	rb_iv_set(self, "calibration", Qnil);
+	check_range_datastream(self);
+
+	// nothing after unpack reads the source except unpack_thumb
+	if (ret==LIBRAW_SUCCESS && low_memory_option(vals[0])) {
+		libraw->recycle_datastream();
+		rb_iv_set(self, "source_buffer", Qnil);
+		rb_iv_set(self, "range_datastream_native_resource", Qnil);
+	}
+
+	return finish_call(self, ret, raise);
+}
+
+VALUE rb_raw_object_unpack_thumb(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+	bool raise = raise_on_error(opts);
+
+	LibRaw *libraw = get_lib_raw(self);
+
+	int ret = libraw->unpack_thumb();
+	check_range_datastream(self);
+
+	return finish_call(self, ret, raise);
+}
+
+// bytes the memory budget reserves for unpack and for dcraw_process with param
+VALUE rb_raw_object_memory_estimate(int argc, VALUE *argv, VALUE self)
+{
+	VALUE param = Qnil;
+	rb_scan_args(argc, argv, "01", &param);
+
+	LibRaw *libraw = get_lib_raw(self);
+	bool half_size = param!=Qnil ? get_output_params(param)->half_size : libraw->imgdata.params.half_size;
+	libraw_image_sizes_t *sizes = libraw->imgdata.progress_flags & LIBRAW_PROGRESS_LOAD_RAW ? &libraw->imgdata.rawdata.sizes : &libraw->imgdata.sizes;
+
+	VALUE result = rb_hash_new();
+	rb_hash_aset(result, ID2SYM(rb_intern("unpack")), SIZET2NUM(unpack_memory_estimate(libraw)));
+	rb_hash_aset(result, ID2SYM(rb_intern("process")), SIZET2NUM(process_memory_estimate(sizes->width, sizes->height, half_size)));
+	return result;
+}
+
+// LibRaw::Warning bits collected by the last call
+VALUE rb_raw_object_warnings(VALUE self)
+{
+	LibRaw *libraw = get_lib_raw(self);
+
+	return UINT2NUM(libraw->imgdata.process_warnings);
+}
+
+// [offset, length, format, width, height] of the embedded thumbnail in the
+// original file, for serving it with sendfile; nil when there is none.
+// format is LibRaw::ThumbnailFormat::UNKNOWN until unpack_thumb reads it.
+// A JPEG thumbnail is served without the EXIF block unpack_thumb may add.
+VALUE rb_raw_object_thumbnail_location(VALUE self)
+{
+	LibRaw *libraw = get_lib_raw(self);
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_IDENTIFY)) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
+
+	libraw_thumbnail_t *thumbnail = &libraw->imgdata.thumbnail;
+	INT64 offset = LibRawInternals::thumbnail_offset(libraw);
+	if (offset<=0 || thumbnail->tlength==0) {
+		return Qnil;
+	}
+
+	// reject locations past the end of the source when its size is known
+	INT64 source_size = -1;
+	VALUE source_path = rb_iv_get(self, "source_path");
+	VALUE source_buffer = rb_iv_get(self, "source_buffer");
+	if (RTEST(source_buffer)) {
+		source_size = RSTRING_LEN(source_buffer);
+	} else if (RTEST(source_path)) {
+		struct stat st;
+		if (stat(RSTRING_PTR(source_path), &st)==0) {
+			source_size = st.st_size;
+		}
+	}
+	if (0<=source_size && source_size<offset + (INT64)thumbnail->tlength) {
+		return Qnil;
+	}
+
+	VALUE result = rb_ary_new2(5);
+	rb_ary_push(result, LL2NUM(offset));
+	rb_ary_push(result, UINT2NUM(thumbnail->tlength));
+	rb_ary_push(result, INT2FIX(thumbnail->tformat));
+	rb_ary_push(result, INT2FIX(thumbnail->twidth));
+	rb_ary_push(result, INT2FIX(thumbnail->theight));
+	return result;
+}
+
+VALUE rb_raw_object_recycle_datastream(VALUE self)
+{
+	LibRaw *libraw = get_lib_raw(self);
+
+	libraw->recycle_datastream();
+
+	return Qnil;
+}
+
+VALUE rb_raw_object_recycle(VALUE self)
+{
+	LibRaw *libraw = get_idle_lib_raw(self);
+
+	libraw->recycle();
+
+	return Qnil;
+}
+
+VALUE rb_raw_object_dcraw_ppm_tiff_writer(VALUE self, VALUE filename)
+{
+	LibRaw *libraw = get_lib_raw(self);
+
+	const char *name = RSTRING_PTR(filename);
+	int ret = libraw->dcraw_ppm_tiff_writer(name);
+	check_errors(ret);
+
+	return Qtrue;
+}
+
+VALUE rb_raw_object_dcraw_thumb_writer(VALUE self, VALUE filename)
+{
+	LibRaw *libraw = get_lib_raw(self);
+
+	const char *name = RSTRING_PTR(filename);
+	int ret = libraw->dcraw_thumb_writer(name);
+	check_errors(ret);
+
+	return Qtrue;
+}
+
+// target_size: [width, height] of the final output, either may be nil.
+// Picks the cheapest pipeline whose output still covers it: half_size
+// when half the resolution is enough (no interpolation at all), PPG in
+// place of the slower algorithms below full size, whose extra detail is
+// lost to the downscale anyway. Adjusts libraw's params, not the caller's.
+// Targets are negative when not given; returns the scale. No Ruby calls.
+static double plan_params(LibRaw *libraw, double target_width, double target_height, int *out_width, int *out_height)
+{
+	libraw_output_params_t *params = &libraw->imgdata.params;
+	libraw_image_sizes_t *sizes = &libraw->imgdata.rawdata.sizes;
+	int width = sizes->width;
+	int height = sizes->height;
+	if (~params->cropbox[2] && ~params->cropbox[3]) {
+		width = params->cropbox[2]<(unsigned)width ? params->cropbox[2] : width;
+		height = params->cropbox[3]<(unsigned)height ? params->cropbox[3] : height;
+	}
+	int flip = params->user_flip>=0 ? params->user_flip : sizes->flip;
+	if (flip & 4) {
+		int t = width;
+		width = height;
+		height = t;
+	}
+
+	double scale = 0;
+	if (0<=target_width && 0<width) {
+		scale = target_width / width;
+	}
+	if (0<=target_height && 0<height) {
+		double s = target_height / height;
+		scale = scale<s ? s : scale;
+	}
+
+	// fuji rotated sensors are not halved the same way; without a scale
+	// (no sizes yet) the params are left as they are
+	bool halvable = libraw->imgdata.rawdata.iparams.filters && !libraw->is_fuji_rotated();
+	if (0<scale && scale<=0.5 && halvable) {
+		params->half_size = 1;
+	} else if (0<scale && scale<1 && !params->half_size && (params->user_qual<0 || params->user_qual==1 || 2<params->user_qual)) {
+		params->user_qual = 2;
+	}
+
+	int shrink = params->half_size ? 1 : 0;
+	*out_width = (width + shrink) >> shrink;
+	*out_height = (height + shrink) >> shrink;
+	return scale;
+}
+
+static void get_target_size(VALUE target_size, double *width, double *height)
+{
+	Check_Type(target_size, T_ARRAY);
+	if (RARRAY_LEN(target_size)!=2) {
+		rb_raise(rb_eArgError, "target_size must be [width, height]");
+	}
+	VALUE w = rb_ary_entry(target_size, 0);
+	VALUE h = rb_ary_entry(target_size, 1);
+	if (w==Qnil && h==Qnil) {
+		rb_raise(rb_eArgError, "target_size needs a width or a height");
+	}
+	*width = w!=Qnil ? NUM2DBL(w) : -1;
+	*height = h!=Qnil ? NUM2DBL(h) : -1;
+	// also rejects NaN
+	if ((w!=Qnil && !(0<*width)) || (h!=Qnil && !(0<*height))) {
+		rb_raise(rb_eArgError, "target_size must be positive");
+	}
+}
+
+static VALUE plan_process(LibRaw *libraw, VALUE target_size)
+{
+	double target_width, target_height;
+	get_target_size(target_size, &target_width, &target_height);
+
+	int width, height;
+	double scale = plan_params(libraw, target_width, target_height, &width, &height);
+
+	libraw_output_params_t *params = &libraw->imgdata.params;
+	VALUE plan = rb_hash_new();
+	rb_hash_aset(plan, ID2SYM(rb_intern("scale")), DBL2NUM(scale));
+	rb_hash_aset(plan, ID2SYM(rb_intern("half_size")), params->half_size ? Qtrue : Qfalse);
+	rb_hash_aset(plan, ID2SYM(rb_intern("quality")), INT2NUM(params->user_qual<0 ? 3 : params->user_qual));
+	rb_hash_aset(plan, ID2SYM(rb_intern("output_size")), rb_ary_new3(2, INT2NUM(width), INT2NUM(height)));
+	return rb_obj_freeze(plan);
+}
+
+VALUE rb_raw_object_dcraw_process(int argc, VALUE *argv, VALUE self)
+{
+	VALUE param = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &param, &opts);
+
+	ID kwargs[4] = { rb_intern("calibration"), rb_intern("target_size"), rb_intern("low_memory"), rb_intern("exception") };
+	VALUE vals[4] = { Qundef, Qundef, Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 4, vals);
+	}
+	if (vals[0]!=Qundef && vals[0]!=Qnil) {
+		rb_raw_object_calibrate(self, vals[0]);
+	}
+	bool low_memory = low_memory_option(vals[2]);
+	bool raise = vals[3]==Qundef || RTEST(vals[3]);
+
+	LibRaw *libraw = get_idle_lib_raw(self);
+	libraw_output_params_t *params = get_output_params(param);
+
+	memmove(&libraw->imgdata.params, params, sizeof(libraw_output_params_t));
+	VALUE plan = vals[1]!=Qundef && vals[1]!=Qnil ? plan_process(libraw, vals[1]) : Qnil;
+	rb_iv_set(self, "@process_plan", plan);
+
+	int ret = LIBRAW_UNSUFFICIENT_MEMORY;
+	libraw_image_sizes_t *sizes = &libraw->imgdata.rawdata.sizes;
+	size_t estimate = process_memory_estimate(sizes->width, sizes->height, libraw->imgdata.params.half_size);
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_LOAD_RAW)) {
+		// never unpacked, or the raw data went with low_memory
+		ret = LIBRAW_OUT_OF_ORDER_CALL;
+	} else if (reserve_memory_idle(self, estimate)) {
+		if (low_memory) {
+			libraw->set_progress_handler(free_rawdata_callback, libraw);
+		}
+		apply_demosaic_threads(1);
+		ret = libraw->dcraw_process();
+		libraw->set_progress_handler(NULL, NULL);
+		release_memory(estimate);
+	}
+	if (ret==LIBRAW_SUCCESS && low_memory) {
+		free_rawdata(libraw);
+	}
+	// the callback may have freed the raw data before a failing stage
+	if (low_memory && !libraw->imgdata.rawdata.raw_alloc) {
+		libraw->imgdata.progress_flags &= ~LIBRAW_PROGRESS_LOAD_RAW;
+	}
+
+	return finish_call(self, ret, raise);
+}
+
+static LibRaw *get_processed_lib_raw(VALUE self)
+{
+	LibRaw *libraw = get_lib_raw(self);
+	if (!libraw->imgdata.image) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
+	return libraw;
+}
+
+VALUE rb_raw_object_processed_image(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	ID kwargs[3] = { rb_intern("format"), rb_intern("low_memory"), rb_intern("shared") };
+	VALUE vals[3] = { Qundef, Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 3, vals);
+	}
+	ID format = vals[0]!=Qundef ? SYM2ID(rb_to_symbol(vals[0])) : rb_intern("bitmap");
+	bool low_memory = low_memory_option(vals[1]);
+	bool shared = vals[2]!=Qundef && RTEST(vals[2]);
+	LibRawNativeResource *owner = get_lib_raw_resource(self);
+	if (low_memory) {
+		check_idle(owner);
+	}
+
+	if (format==rb_intern("float32_linear") || format==rb_intern("float16_linear")) {
+		LibRaw *libraw = get_processed_lib_raw(self);
+		ProcessedImageNativeResource *p = linear_processed_image(owner, format==rb_intern("float16_linear"), shared);
+		if (!p) {
+			check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+		}
+		// another thread may have started on the image while this one
+		// copied it without the GVL
+		VALUE image = wrap_processed_image(p);
+		if (low_memory) {
+			check_idle(owner);
+			free_image(libraw);
+		}
+		return image;
+	}
+	if (format!=rb_intern("bitmap")) {
+		rb_raise(rb_eArgError, "unsupported format :%s", rb_id2name(format));
+	}
+
+	LibRaw *libraw = get_processed_lib_raw(self);
+
+	// rendered into a pooled buffer rather than one LibRaw mallocs per call
+	int width = 0, height = 0, colors = 0, bps = 0;
+	libraw->get_mem_image_format(&width, &height, &colors, &bps);
+	ProcessedImageNativeResource *p = shared ? alloc_shared_processed_image(width, height, colors, bps, PROCESSED_IMAGE_UNSIGNED) : alloc_processed_image(width, height, colors, bps);
+	if (!p) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+	int ret = libraw->copy_mem_image(p->data, width * colors * (bps / 8), 0);
+	if (ret!=LIBRAW_SUCCESS) {
+		processed_image_native_resource_delete(p);
+		check_errors(ret);
+	}
+	if (low_memory) {
+		free_image(libraw);
+	}
+
+	return wrap_processed_image(p);
+}
+
+// x, y, w, h are in the oriented output frame of the full image
+VALUE rb_raw_object_process_region(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h, VALUE param)
+{
+	LibRaw *libraw = get_idle_lib_raw(self);
+	libraw_output_params_t *params = get_output_params(param);
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_LOAD_RAW)) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
+
+	libraw_image_sizes_t *sizes = &libraw->imgdata.rawdata.sizes;
+	unsigned filters = libraw->imgdata.rawdata.iparams.filters;
+	int flip = params->user_flip>=0 ? params->user_flip : sizes->flip;
+	int sensor_width = sizes->width;
+	int sensor_height = sizes->height;
+	int out_width = flip & 4 ? sensor_height : sensor_width;
+	int out_height = flip & 4 ? sensor_width : sensor_height;
+
+	int rx = NUM2INT(x), ry = NUM2INT(y), rw = NUM2INT(w), rh = NUM2INT(h);
+	if (rx<0 || ry<0 || rw<1 || rh<1 || out_width<rx+rw || out_height<ry+rh) {
+		rb_raise(rb_eArgError, "region %dx%d+%d+%d is outside of %dx%d", rw, rh, rx, ry, out_width, out_height);
+	}
+
+	// region in sensor coordinates
+	int r0, c0, r1, c1;
+	flip_point(flip, sensor_width, sensor_height, ry, rx, &r0, &c0);
+	flip_point(flip, sensor_width, sensor_height, ry + rh - 1, rx + rw - 1, &r1, &c1);
+	int sx = c0<c1 ? c0 : c1;
+	int sy = r0<r1 ? r0 : r1;
+	int sx1 = (c0<c1 ? c1 : c0) + 1;
+	int sy1 = (r0<r1 ? r1 : r0) + 1;
+
+	// decode window: region plus the margin demosaicing reads, kept on the CFA period
+	const int margin = 16;
+	int align = filters==9 ? 6 : (filters && filters<1000) ? 16 : filters ? 8 : 1;
+	int wx = sx - margin > 0 ? (sx - margin) / align * align : 0;
+	int wy = sy - margin > 0 ? (sy - margin) / align * align : 0;
+	int wx1 = sx1 + margin < sensor_width ? sx1 + margin : sensor_width;
+	int wy1 = sy1 + margin < sensor_height ? sy1 + margin : sensor_height;
+	if (libraw->is_fuji_rotated()) {
+		// rotated fuji sensors do not map onto a sensor rectangle; decode it all
+		wx = wy = 0;
+		wx1 = sensor_width;
+		wy1 = sensor_height;
+	}
+
+	memmove(&libraw->imgdata.params, params, sizeof(libraw_output_params_t));
+	libraw->imgdata.params.user_flip = 0;
+	if (!libraw->is_fuji_rotated()) {
+		libraw->imgdata.params.cropbox[0] = wx;
+		libraw->imgdata.params.cropbox[1] = wy;
+		libraw->imgdata.params.cropbox[2] = wx1 - wx;
+		libraw->imgdata.params.cropbox[3] = wy1 - wy;
+	}
+
+	int ret = LIBRAW_UNSUFFICIENT_MEMORY;
+	size_t estimate = process_memory_estimate(wx1 - wx, wy1 - wy, params->half_size);
+	if (reserve_memory_idle(self, estimate)) {
+		apply_demosaic_threads(1);
+		ret = libraw->dcraw_process();
+		release_memory(estimate);
+	}
+	check_errors(ret);
+
+	libraw_processed_image_t *image = libraw->dcraw_make_mem_image(&ret);
+	check_errors(ret);
+	if (!image) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+
+	// half_size and friends shrink the window by 2
+	int shrink = image->width * 2 <= wx1 - wx + 1 ? 1 : 0;
+	int ex = (sx - wx) >> shrink;
+	int ey = (sy - wy) >> shrink;
+	int ew = (sx1 - sx) >> shrink;
+	int eh = (sy1 - sy) >> shrink;
+	ew = ew<1 ? 1 : ew;
+	eh = eh<1 ? 1 : eh;
+	ew = ex + ew <= image->width ? ew : image->width - ex;
+	eh = ey + eh <= image->height ? eh : image->height - ey;
+
+	ProcessedImageNativeResource *p = NULL;
+	if (0<ew && 0<eh) {
+		p = copy_bitmap_region(image->data, image->width, image->colors, image->bits, ex, ey, ew, eh, flip);
+	}
+	LibRaw::dcraw_clear_mem(image);
+	if (!p) {
+		check_errors(0<ew && 0<eh ? LIBRAW_UNSUFFICIENT_MEMORY : LIBRAW_BAD_CROP);
+	}
+
+	return wrap_processed_image(p);
+}
+
+// the embedded thumbnail, nil when there is none or it cannot be read
+static VALUE thumbnail_preview(VALUE self, LibRaw *libraw)
+{
+	int ret = libraw->unpack_thumb();
+	check_range_datastream(self);
+	if (ret!=LIBRAW_SUCCESS) {
+		return Qnil;
+	}
+	libraw_processed_image_t *thumb = libraw->dcraw_make_mem_thumb(&ret);
+	if (!thumb) {
+		return Qnil;
+	}
+	return new_processed_image(thumb);
+}
+
+// yields (image, stage): first a quick preview, then the full render of
+// param, from one open and at most one unpack. preview: :auto (the
+// embedded thumbnail, else :half_size), :thumbnail, :half_size (half
+// size without interpolation) or false. Returns the full image.
+VALUE rb_raw_object_render_progressive(int argc, VALUE *argv, VALUE self)
+{
+	VALUE param = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &param, &opts);
+	rb_need_block();
+
+	ID kwargs[1] = { rb_intern("preview") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	ID preview = vals[0]==Qundef ? rb_intern("auto") : RTEST(vals[0]) ? SYM2ID(rb_to_symbol(vals[0])) : 0;
+	if (preview && preview!=rb_intern("auto") && preview!=rb_intern("thumbnail") && preview!=rb_intern("half_size")) {
+		rb_raise(rb_eArgError, "unsupported preview :%s", rb_id2name(preview));
+	}
+
+	LibRaw *libraw = get_lib_raw(self);
+	libraw_output_params_t *params = get_output_params(param);
+
+	// the thumbnail comes before unpack, so it shows while the raw data loads
+	if (preview==rb_intern("auto") || preview==rb_intern("thumbnail")) {
+		VALUE image = thumbnail_preview(self, libraw);
+		if (image!=Qnil) {
+			rb_yield_values(2, image, ID2SYM(rb_intern("thumbnail")));
+			preview = 0;
+		} else if (preview==rb_intern("auto")) {
+			preview = rb_intern("half_size");
+		}
+	}
+
+	// through method calls: the keywords given to this call must not reach them
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_LOAD_RAW)) {
+		rb_funcall(self, rb_intern("unpack"), 0);
+	}
+
+	// a half size render is already as quick as the preview
+	if (preview==rb_intern("half_size") && !params->half_size) {
+		VALUE quick = rb_obj_dup(param);
+		libraw_output_params_t *quick_params = get_mutable_output_params(quick);
+		quick_params->half_size = 1;
+		quick_params->user_qual = 0;
+		quick_params->med_passes = 0;
+		quick_params->fbdd_noiserd = 0;
+		rb_funcall(self, rb_intern("dcraw_process"), 1, quick);
+		rb_yield_values(2, rb_funcall(self, rb_intern("processed_image"), 0), ID2SYM(rb_intern("half_size")));
+	}
+
+	rb_funcall(self, rb_intern("dcraw_process"), 1, param);
+	VALUE image = rb_funcall(self, rb_intern("processed_image"), 0);
+	rb_yield_values(2, image, ID2SYM(rb_intern("full")));
+
+	return image;
+}
+
+// 0 when unknown
+static size_t available_memory(void)
+{
+#ifdef _SC_AVPHYS_PAGES
+	long pages = sysconf(_SC_AVPHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+	if (0<pages && 0<page_size) {
+		return (size_t)pages * page_size;
+	}
+#endif
+	return 0;
+}
+
+// bayer/x-trans raw_image is only read by dcraw_process; phase one
+// compressed, sraw and foveon data is corrected in place and is not
+static bool rawdata_is_shareable(LibRaw *libraw)
+{
+	libraw_rawdata_t *raw = &libraw->imgdata.rawdata;
+	return raw->raw_image && !raw->color3_image && !raw->color4_image && !raw->ph1_cblack && !raw->ph1_rblack;
+}
+
+static size_t rawdata_size(LibRaw *libraw)
+{
+	libraw_image_sizes_t *sizes = &libraw->imgdata.rawdata.sizes;
+	return (size_t)sizes->raw_pitch * sizes->raw_height;
+}
+
+// gives an opened worker its own copy of the owner's shareable raw data.
+// A failing dcraw_process recycles the worker, which frees the copy, so
+// the owner's buffer is never handed out. No Ruby calls.
+static int adopt_rawdata(LibRaw *worker, LibRaw *owner)
+{
+	libraw_rawdata_t *raw = &owner->imgdata.rawdata;
+	// plain malloc: LibRaw::malloc throws, and its memmgr frees these as well
+	void *copy = ::malloc(rawdata_size(owner));
+	if (!copy) {
+		return LIBRAW_UNSUFFICIENT_MEMORY;
+	}
+	memcpy(copy, raw->raw_alloc, rawdata_size(owner));
+	worker->imgdata.rawdata = *raw;
+	worker->imgdata.rawdata.raw_alloc = copy;
+	worker->imgdata.rawdata.raw_image = (ushort *)((char *)copy + ((char *)raw->raw_image - (char *)raw->raw_alloc));
+	worker->imgdata.progress_flags |= LIBRAW_PROGRESS_LOAD_RAW;
+	return LIBRAW_SUCCESS;
+}
+
+static void free_frames(libraw_processed_image_t **images, int count)
+{
+	for (int i=0; i<count; i++) {
+		if (images[i]) {
+			LibRaw::dcraw_clear_mem(images[i]);
+			images[i] = NULL;
+		}
+	}
+}
+
+VALUE rb_raw_object_process_variants(int argc, VALUE *argv, VALUE self)
+{
+	VALUE list = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &list, &opts);
+	Check_Type(list, T_ARRAY);
+
+	ID kwargs[1] = { rb_intern("threads") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	int threads = vals[0]!=Qundef ? NUM2INT(vals[0]) : native_thread_count();
+
+	LibRawNativeResource *owner = get_lib_raw_resource(self);
+	LibRaw *libraw = owner->libraw;
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_LOAD_RAW)) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
+
+	size_t count = RARRAY_LEN(list);
+	std::vector<libraw_output_params_t> params(count);
+	for (size_t i=0; i<count; i++) {
+		params[i] = *get_output_params(rb_ary_entry(list, i));
+	}
+
+	VALUE source_path = rb_iv_get(self, "source_path");
+	VALUE source_buffer = rb_iv_get(self, "source_buffer");
+	std::string path = RTEST(source_path) ? RSTRING_PTR(source_path) : "";
+	const char *buffer = RTEST(source_buffer) ? RSTRING_PTR(source_buffer) : NULL;
+	size_t buffer_size = RTEST(source_buffer) ? RSTRING_LEN(source_buffer) : 0;
+
+	// every worker holds its own raw copy and image buffers, so stay within free memory
+	if ((size_t)threads>count) {
+		threads = count;
+	}
+	libraw_image_sizes_t *sizes = &libraw->imgdata.rawdata.sizes;
+	size_t available = available_memory();
+	size_t estimate = rawdata_size(libraw) + process_memory_estimate(sizes->width, sizes->height, false);
+	if (available && estimate && available / estimate<(size_t)threads) {
+		threads = available / estimate;
+	}
+	bool parallel = 1<threads && rawdata_is_shareable(libraw) && (!path.empty() || buffer);
+	double timeout = memory_budget_wait();
+
+	std::vector<libraw_processed_image_t *> images(count, (libraw_processed_image_t *)NULL);
+	std::vector<int> errors(count, LIBRAW_UNSUFFICIENT_MEMORY);
+
+	if (!parallel) {
+		// processes self in place, one variant after the other
+		call_without_gvl(owner, [&]() {
+			for (size_t i=0; i<count; i++) {
+				MemoryReservation reservation(process_memory_estimate(sizes->width, sizes->height, params[i].half_size), timeout);
+				int ret = LIBRAW_UNSUFFICIENT_MEMORY;
+				if (reservation.held) {
+					memmove(&libraw->imgdata.params, &params[i], sizeof(libraw_output_params_t));
+					apply_demosaic_threads(1);
+					ret = libraw->dcraw_process();
+					if (ret==LIBRAW_SUCCESS) {
+						images[i] = libraw->dcraw_make_mem_image(&ret);
+					}
+				}
+				errors[i] = ret;
+				if (ret!=LIBRAW_SUCCESS) {
+					break;
+				}
+			}
+		}, true);
+	} else {
+		call_without_gvl(owner, [&]() {
+			std::atomic<size_t> next(0);
+			parallel_for(threads, threads, [&](int begin, int end, int t) {
+				LibRaw *worker = NULL;
+				try {
+					worker = new LibRaw(LIBRAW_OPTIONS_NONE);
+				} catch (std::bad_alloc&) {
+					return;
+				}
+
+				apply_demosaic_threads(threads);
+				MemoryReservation copy_reservation(rawdata_size(libraw), timeout);
+
+				// the worker parses the file again but adopts a copy of the
+				// unpacked data instead of decoding it; again after a failure
+				// recycled it
+				for (size_t i=next++; copy_reservation.held && i<count; i=next++) {
+					int ret = LIBRAW_SUCCESS;
+					if (!(worker->imgdata.progress_flags & LIBRAW_PROGRESS_LOAD_RAW)) {
+						ret = buffer ? worker->open_buffer((void *)buffer, buffer_size) : worker->open_file(path.c_str());
+						if (ret==LIBRAW_SUCCESS) {
+							ret = adopt_rawdata(worker, libraw);
+						}
+					}
+					if (ret==LIBRAW_SUCCESS) {
+						MemoryReservation reservation(process_memory_estimate(sizes->width, sizes->height, params[i].half_size), timeout);
+						if (!reservation.held) {
+							continue;
+						}
+						memmove(&worker->imgdata.params, &params[i], sizeof(libraw_output_params_t));
+						ret = worker->dcraw_process();
+						if (ret==LIBRAW_SUCCESS) {
+							images[i] = worker->dcraw_make_mem_image(&ret);
+						}
+					}
+					errors[i] = ret;
+				}
+
+				delete worker;
+			});
+		});
+	}
+
+	VALUE result = rb_ary_new2(count);
+	int error = LIBRAW_SUCCESS;
+	for (size_t i=0; i<count; i++) {
+		if (images[i]) {
+			rb_ary_push(result, new_processed_image(images[i]));
+		} else if (error==LIBRAW_SUCCESS) {
+			error = errors[i]!=LIBRAW_SUCCESS ? errors[i] : LIBRAW_UNSUFFICIENT_MEMORY;
+		}
+	}
+	check_errors(error);
+
+	return result;
+}
+
+// read-only view of a whole raw file, shared by the per-frame decoders
+struct FrameSource {
+	const void *data;
+	size_t size;
+	void *map;
+	size_t map_size;
+};
+
+static void map_frame_source(const char *path, FrameSource *source)
+{
+	memset(source, 0, sizeof(*source));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd<0) {
+		rb_sys_fail(path);
+	}
+	struct stat st;
+	if (fstat(fd, &st)!=0 || st.st_size==0) {
+		int e = st.st_size==0 ? EINVAL : errno;
+		close(fd);
+		rb_syserr_fail(e, path);
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	int e = errno;
+	close(fd);
+	if (map==MAP_FAILED) {
+		rb_syserr_fail(e, path);
+	}
+	source->data = map;
+	source->size = st.st_size;
+	source->map = map;
+	source->map_size = st.st_size;
+}
+
+static void unmap_frame_source(FrameSource *source)
+{
+	if (source->map) {
+		munmap(source->map, source->map_size);
+		source->map = NULL;
+	}
+}
+
+// threads for decoding frames of the given size, capped by free memory
+static int frame_threads(int threads, int frames, LibRaw *libraw)
+{
+	libraw_image_sizes_t *sizes = &libraw->imgdata.sizes;
+	size_t estimate = unpack_memory_estimate(libraw) + process_memory_estimate(sizes->width, sizes->height, false);
+	size_t available = available_memory();
+	if (available && estimate && available / estimate<(size_t)threads) {
+		threads = available / estimate;
+	}
+	threads = frames<threads ? frames : threads;
+	return threads<1 ? 1 : threads;
+}
+
+// decode shots [first, first + count): every thread opens its own LibRaw on
+// the shared bytes with shot_select set, then unpacks and processes
+static int decode_frames(const FrameSource &source, const libraw_output_params_t &params, int first, int count, int threads, libraw_processed_image_t **images)
+{
+	memset(images, 0, count * sizeof(*images));
+	std::vector<int> errors(count, LIBRAW_UNSUFFICIENT_MEMORY);
+	double timeout = memory_budget_wait();
+
+	call_without_gvl([&]() {
+		std::atomic<int> next(0);
+		parallel_for(threads, threads, [&](int begin, int end, int t) {
+			LibRaw *libraw = NULL;
+			try {
+				libraw = new LibRaw(LIBRAW_OPTIONS_NONE);
+			} catch (std::bad_alloc&) {
+				return;
+			}
+
+			// every frame is rendered once, so its raw data can go as soon as it is consumed
+			libraw->set_progress_handler(free_rawdata_callback, libraw);
+			apply_demosaic_threads(threads);
+
+			for (int i=next++; i<count; i=next++) {
+				memmove(&libraw->imgdata.params, &params, sizeof(libraw_output_params_t));
+				libraw->imgdata.params.shot_select = first + i;
+				int ret = libraw->open_buffer((void *)source.data, source.size);
+				if (ret==LIBRAW_SUCCESS) {
+					libraw_image_sizes_t *sizes = &libraw->imgdata.sizes;
+					MemoryReservation reservation(unpack_memory_estimate(libraw) + process_memory_estimate(sizes->width, sizes->height, params.half_size), timeout);
+					ret = reservation.held ? libraw->unpack() : LIBRAW_UNSUFFICIENT_MEMORY;
+					if (ret==LIBRAW_SUCCESS) {
+						ret = libraw->dcraw_process();
+					}
+					if (ret==LIBRAW_SUCCESS) {
+						images[i] = libraw->dcraw_make_mem_image(&ret);
+					}
+				}
+				errors[i] = ret;
+				libraw->recycle();
+			}
+
+			delete libraw;
+		});
+	});
+
+	for (int i=0; i<count; i++) {
+		if (!images[i]) {
+			return errors[i]!=LIBRAW_SUCCESS ? errors[i] : LIBRAW_UNSUFFICIENT_MEMORY;
+		}
+	}
+	return LIBRAW_SUCCESS;
+}
+
+struct EachFrameArgs {
+	VALUE self;
+	// keeps an open_buffer source alive should the block reopen self
+	VALUE source_buffer;
+	FrameSource source;
+	libraw_output_params_t params;
+	int frames;
+	int threads;
+	libraw_processed_image_t **images;
+};
+
+static VALUE each_frame_body(VALUE data)
+{
+	EachFrameArgs *args = (EachFrameArgs *)data;
+
+	// one batch per round keeps at most `threads` decoded frames alive
+	for (int first=0; first<args->frames; first+=args->threads) {
+		int count = args->frames - first<args->threads ? args->frames - first : args->threads;
+		int ret = decode_frames(args->source, args->params, first, count, args->threads, args->images);
+		if (ret!=LIBRAW_SUCCESS) {
+			free_frames(args->images, args->threads);
+			check_errors(ret);
+		}
+
+		VALUE batch = rb_ary_new2(count);
+		for (int i=0; i<count; i++) {
+			rb_ary_push(batch, new_processed_image(args->images[i]));
+			args->images[i] = NULL;
+		}
+		for (int i=0; i<count; i++) {
+			rb_yield_values(2, rb_ary_entry(batch, i), INT2FIX(first + i));
+		}
+	}
+
+	return args->self;
+}
+
+static VALUE each_frame_ensure(VALUE data)
+{
+	EachFrameArgs *args = (EachFrameArgs *)data;
+	free_frames(args->images, args->threads);
+	xfree(args->images);
+	unmap_frame_source(&args->source);
+	return Qnil;
+}
+
+// yields (image, index) for every shot of a multi-shot raw, decoding up to
+// `threads` shots at once from one shared view of the source
+VALUE rb_raw_object_each_frame(int argc, VALUE *argv, VALUE self)
+{
+	RETURN_ENUMERATOR(self, argc, argv);
+
+	VALUE param = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &param, &opts);
+
+	ID kwargs[1] = { rb_intern("threads") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	int threads = vals[0]!=Qundef ? NUM2INT(vals[0]) : native_thread_count();
+
+	LibRaw *libraw = get_lib_raw(self);
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_IDENTIFY)) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
+
+	EachFrameArgs args;
+	args.self = self;
+	args.source_buffer = Qnil;
+	args.params = *get_output_params(param);
+	args.frames = libraw->imgdata.idata.raw_count ? libraw->imgdata.idata.raw_count : 1;
+	args.threads = frame_threads(threads, args.frames, libraw);
+
+	VALUE source_path = rb_iv_get(self, "source_path");
+	VALUE source_buffer = rb_iv_get(self, "source_buffer");
+	if (RTEST(source_buffer)) {
+		args.source_buffer = source_buffer;
+		memset(&args.source, 0, sizeof(args.source));
+		args.source.data = RSTRING_PTR(source_buffer);
+		args.source.size = RSTRING_LEN(source_buffer);
+	} else if (RTEST(source_path)) {
+		map_frame_source(RSTRING_PTR(source_path), &args.source);
+	} else {
+		rb_raise(rb_eRuntimeError, "each_frame needs a raw opened with open_file or open_buffer");
+	}
+	args.images = ZALLOC_N(libraw_processed_image_t *, args.threads);
+
+	return rb_ensure(each_frame_body, (VALUE)&args, each_frame_ensure, (VALUE)&args);
+}
+
+static libraw_rawdata_t *get_unpacked_rawdata(LibRaw *libraw)
+{
+	libraw_rawdata_t *raw = &libraw->imgdata.rawdata;
+	if (!raw->raw_image && !raw->color4_image && !raw->color3_image) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
+	return raw;
+}
+
+// samples per visible pixel of the unpacked buffer
+static int rawdata_samples_per_pixel(libraw_rawdata_t *raw)
+{
+	return raw->raw_image ? 1 : raw->color4_image ? 4 : 3;
+}
+
+// first sample of a visible sensor row
+static const unsigned short *rawdata_row(libraw_rawdata_t *raw, int row)
+{
+	size_t pitch = raw->sizes.raw_pitch / 2;
+	size_t offset = (size_t)(row + raw->sizes.top_margin) * pitch;
+	size_t left = raw->sizes.left_margin;
+	if (raw->raw_image) {
+		return raw->raw_image + offset + left;
+	} else if (raw->color4_image) {
+		return raw->color4_image[0] + offset + left * 4;
+	}
+	return raw->color3_image[0] + offset + left * 3;
+}
+
+static VALUE histogram_to_array(std::vector<unsigned long long> &hist, int channels, int bins)
+{
+	VALUE result = rb_ary_new2(channels);
+	for (int c=0; c<channels; c++) {
+		VALUE channel = rb_ary_new2(bins);
+		for (int i=0; i<bins; i++) {
+			rb_ary_push(channel, ULL2NUM(hist[c * bins + i]));
+		}
+		rb_ary_push(result, channel);
+	}
+	return result;
+}
+
+VALUE rb_raw_object_raw_histogram(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+	int bins = get_bins_option(opts, 256);
+
+	LibRaw *libraw = get_lib_raw(self);
+	libraw_rawdata_t *raw = get_unpacked_rawdata(libraw);
+
+	int top = raw->sizes.top_margin;
+	int left = raw->sizes.left_margin;
+	int height = raw->sizes.height;
+	int width = raw->sizes.width;
+	int pitch = raw->sizes.raw_pitch / 2;
+	unsigned filters = raw->iparams.filters;
+
+	int channels = raw->color3_image ? 3 : 4;
+	if (raw->raw_image && !filters) {
+		channels = 1;
+	}
+	int cdesc = strlen(raw->iparams.cdesc);
+	if (0<cdesc && cdesc<channels) {
+		channels = cdesc;
+	}
+
+	// CFA color of each visible pixel repeats every 2 or 8 rows (bayer) or 6 (x-trans)
+	unsigned char cfa[24][24];
+	for (int row=0; row<24; row++) {
+		for (int col=0; col<24; col++) {
+			int c = filters ? libraw->COLOR(row, col) : 0;
+			cfa[row][col] = c<channels ? c : 0;
+		}
+	}
+
+	// raw value -> bin, normalized against black/maximum per channel
+	std::vector<unsigned short> lut(4 * 65536);
+	for (int c=0; c<4; c++) {
+		unsigned black = raw->color.black + raw->color.cblack[c];
+		unsigned range = raw->color.maximum > black ? raw->color.maximum - black : 1;
+		for (unsigned v=0; v<65536; v++) {
+			unsigned long long x = v > black ? v - black : 0;
+			unsigned long long bin = x * bins / range;
+			lut[c * 65536 + v] = bin < (unsigned)bins ? bin : bins - 1;
+		}
+	}
+
+	int threads = native_thread_count();
+	std::vector<std::vector<unsigned long long> > local(threads, std::vector<unsigned long long>(4 * bins, 0));
+
+	call_without_gvl(get_lib_raw_resource(self), [&]() {
+		parallel_for(height, threads, [&](int begin, int end, int t) {
+			unsigned long long *h = &local[t][0];
+			const unsigned short *l = &lut[0];
+			for (int row=begin; row<end; row++) {
+				if (raw->raw_image) {
+					const unsigned short *src = raw->raw_image + (size_t)(row + top) * pitch + left;
+					const unsigned char *colors = cfa[row % 24];
+					for (int col=0; col<width; col++) {
+						int c = colors[col % 24];
+						h[c * bins + l[c * 65536 + src[col]]]++;
+					}
+				} else if (raw->color4_image) {
+					const unsigned short (*src)[4] = raw->color4_image + (size_t)(row + top) * (pitch / 4) + left;
+					for (int col=0; col<width; col++) {
+						for (int c=0; c<channels; c++) {
+							h[c * bins + l[c * 65536 + src[col][c]]]++;
+						}
+					}
+				} else {
+					const unsigned short (*src)[3] = raw->color3_image + (size_t)(row + top) * (pitch / 3) + left;
+					for (int col=0; col<width; col++) {
+						for (int c=0; c<channels; c++) {
+							h[c * bins + l[c * 65536 + src[col][c]]]++;
+						}
+					}
+				}
+			}
+		});
+	});
+
+	std::vector<unsigned long long> hist(4 * bins, 0);
+	for (int t=0; t<threads; t++) {
+		for (int i=0; i<4*bins; i++) {
+			hist[i] += local[t][i];
+		}
+	}
+
+	return histogram_to_array(hist, channels, bins);
+}
+
+// output value of every 16-bit image value per channel, as copy_mem_image
+// maps it: runs copy_mem_image over a 256x256 probe holding each value once,
+// so the gamma curve and white point stay LibRaw's own. Swaps imgdata.image,
+// so the caller must hold the owner exclusively.
+static int output_lut(LibRaw *libraw, int colors, int bits, std::vector<unsigned short> &lut)
+{
+	std::vector<unsigned short> probe((size_t)65536 * 4);
+	for (unsigned v=0; v<65536; v++) {
+		for (int c=0; c<4; c++) {
+			probe[v * 4 + c] = v;
+		}
+	}
+	std::vector<unsigned char> out((size_t)65536 * colors * (bits / 8));
+	lut.resize((size_t)colors * 65536);
+
+	libraw_data_t *raw = &libraw->imgdata;
+	ushort (*image)[4] = raw->image;
+	libraw_image_sizes_t sizes = raw->sizes;
+	int user_flip = raw->params.user_flip;
+	raw->image = (ushort (*)[4])&probe[0];
+	raw->sizes.width = raw->sizes.iwidth = 256;
+	raw->sizes.height = raw->sizes.iheight = 256;
+	raw->sizes.flip = 0;
+	raw->params.user_flip = 0;
+	int ret = libraw->copy_mem_image(&out[0], 256 * colors * (bits / 8), 0);
+	raw->image = image;
+	raw->sizes = sizes;
+	raw->params.user_flip = user_flip;
+	if (ret!=LIBRAW_SUCCESS) {
+		return ret;
+	}
+
+	const unsigned short *wide = (const unsigned short *)&out[0];
+	for (unsigned v=0; v<65536; v++) {
+		for (int c=0; c<colors; c++) {
+			lut[c * 65536 + v] = bits==16 ? wide[v * colors + c] : out[v * colors + c];
+		}
+	}
+	return LIBRAW_SUCCESS;
+}
+
+// full histogram per channel of the processed output as processed_image
+// renders it (gamma curve and output_bps applied), over 1<<bits levels;
+// counted straight from imgdata.image, orientation does not change it
+static int output_histogram(LibRawNativeResource *owner, int *channels, int *levels, std::vector<unsigned long long> &hist)
+{
+	LibRaw *libraw = owner->libraw;
+	int width = 0, height = 0, colors = 0, bits = 0;
+	libraw->get_mem_image_format(&width, &height, &colors, &bits);
+	*channels = colors;
+	*levels = 1 << bits;
+	int threads = native_thread_count();
+	int rows = libraw->imgdata.sizes.iheight;
+	int cols = libraw->imgdata.sizes.iwidth;
+	int ret = LIBRAW_SUCCESS;
+
+	call_without_gvl(owner, [&]() {
+		try {
+			std::vector<unsigned short> lut;
+			ret = output_lut(libraw, colors, bits, lut);
+			if (ret!=LIBRAW_SUCCESS) {
+				return;
+			}
+			std::vector<std::vector<unsigned> > local(threads, std::vector<unsigned>((size_t)colors * *levels, 0));
+			hist.assign((size_t)colors * *levels, 0);
+			const ushort (*image)[4] = libraw->imgdata.image;
+			parallel_for(rows, threads, [&](int begin, int end, int t) {
+				unsigned *h = &local[t][0];
+				const unsigned short *l = &lut[0];
+				int stride = *levels;
+				for (size_t i=(size_t)begin * cols; i<(size_t)end * cols; i++) {
+					for (int c=0; c<colors; c++) {
+						h[c * stride + l[c * 65536 + image[i][c]]]++;
+					}
+				}
+			});
+			for (int t=0; t<threads; t++) {
+				for (size_t i=0; i<local[t].size(); i++) {
+					hist[i] += local[t][i];
+				}
+			}
+		} catch (std::bad_alloc&) {
+			ret = LIBRAW_UNSUFFICIENT_MEMORY;
+		}
+	}, true);
+
+	return ret;
+}
+
+VALUE rb_raw_object_image_histogram(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+	int bins = get_bins_option(opts, 256);
+
+	get_processed_lib_raw(self);
+	int channels, levels;
+	std::vector<unsigned long long> full;
+	check_errors(output_histogram(get_lib_raw_resource(self), &channels, &levels, full));
+
+	std::vector<unsigned long long> hist(channels * bins, 0);
+	for (int c=0; c<channels; c++) {
+		for (int v=0; v<levels; v++) {
+			hist[c * bins + (unsigned long long)v * bins / levels] += full[(size_t)c * levels + v];
+		}
+	}
+
+	return histogram_to_array(hist, channels, bins);
+}
+
+VALUE rb_raw_object_stats(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	ID kwargs[1] = { rb_intern("percentiles") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	VALUE percentiles = vals[0];
+	if (percentiles==Qundef) {
+		percentiles = rb_ary_new3(5, INT2FIX(1), INT2FIX(5), INT2FIX(50), INT2FIX(95), INT2FIX(99));
+	}
+	percentiles = rb_Array(percentiles);
+
+	get_processed_lib_raw(self);
+	int channels, levels;
+	std::vector<unsigned long long> hist;
+	check_errors(output_histogram(get_lib_raw_resource(self), &channels, &levels, hist));
+
+	VALUE result = rb_ary_new2(channels);
+	for (int c=0; c<channels; c++) {
+		unsigned long long *h = &hist[(size_t)c * levels];
+		unsigned long long count = 0;
+		double sum = 0;
+		int min = -1, max = -1;
+		for (int v=0; v<levels; v++) {
+			if (h[v]) {
+				if (min<0) {
+					min = v;
+				}
+				max = v;
+				count += h[v];
+				sum += (double)v * h[v];
+			}
+		}
+
+		VALUE pvals = rb_hash_new();
+		for (long i=0; i<RARRAY_LEN(percentiles); i++) {
+			VALUE pct = RARRAY_AREF(percentiles, i);
+			double target = RFLOAT_VALUE(rb_Float(pct)) / 100.0 * count;
+			unsigned long long cum = 0;
+			int v = 0;
+			for (; v<levels - 1; v++) {
+				cum += h[v];
+				if (target<=cum && cum) {
+					break;
+				}
+			}
+			rb_hash_aset(pvals, pct, INT2FIX(v));
+		}
+
+		VALUE stat = rb_hash_new();
+		rb_hash_aset(stat, ID2SYM(rb_intern("min")), INT2FIX(min<0 ? 0 : min));
+		rb_hash_aset(stat, ID2SYM(rb_intern("max")), INT2FIX(max<0 ? 0 : max));
+		rb_hash_aset(stat, ID2SYM(rb_intern("mean")), rb_float_new(count ? sum / count : 0.0));
+		rb_hash_aset(stat, ID2SYM(rb_intern("percentiles")), pvals);
+		rb_hash_aset(stat, ID2SYM(rb_intern("clipped")), rb_float_new(count ? (double)h[levels - 1] / count : 0.0));
+		rb_ary_push(result, stat);
+	}
+
+	return result;
+}
+
+VALUE rb_raw_object_content_digest(VALUE self)
+{
+	LibRaw *libraw = get_lib_raw(self);
+	libraw_rawdata_t *raw = get_unpacked_rawdata(libraw);
+
+	const int stripe_rows = 64;
+	int height = raw->sizes.height;
+	size_t row_bytes = (size_t)raw->sizes.width * rawdata_samples_per_pixel(raw) * sizeof(unsigned short);
+	int stripes = (height + stripe_rows - 1) / stripe_rows;
+	std::vector<unsigned long long> digests(stripes);
+
+	unsigned long long result = 0;
+	call_without_gvl(get_lib_raw_resource(self), [&]() {
+		// stripes are fixed size so the digest does not depend on the thread count
+		parallel_for(stripes, native_thread_count(), [&](int begin, int end, int t) {
+			for (int s=begin; s<end; s++) {
+				XXH64State state;
+				int last = (s + 1) * stripe_rows < height ? (s + 1) * stripe_rows : height;
+				for (int row=s*stripe_rows; row<last; row++) {
+					state.update(rawdata_row(raw, row), row_bytes);
+				}
+				digests[s] = state.digest();
+			}
+		});
+
+		unsigned long long header[3] = { raw->sizes.width, raw->sizes.height, (unsigned long long)rawdata_samples_per_pixel(raw) };
+		XXH64State state;
+		state.update(header, sizeof(header));
+		state.update(&digests[0], digests.size() * sizeof(unsigned long long));
+		result = state.digest();
+	});
+
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", result);
+	return rb_str_new2(hex);
+}
+
+VALUE rb_raw_object_perceptual_hash(VALUE self)
+{
+	LibRaw *libraw = get_lib_raw(self);
+	libraw_rawdata_t *raw = get_unpacked_rawdata(libraw);
+
+	// dHash: 9x8 grid of mean levels, one bit per horizontal gradient
+	const int gw = 9, gh = 8;
+	int height = raw->sizes.height;
+	int width = raw->sizes.width;
+	int spp = rawdata_samples_per_pixel(raw);
+	unsigned black = raw->color.black;
+	int threads = native_thread_count();
+	std::vector<std::vector<double> > local(threads, std::vector<double>(gw * gh, 0));
+	std::vector<int> cell_col(width);
+	for (int col=0; col<width; col++) {
+		cell_col[col] = (long long)col * gw / width;
+	}
+
+	unsigned long long hash = 0;
+	call_without_gvl(get_lib_raw_resource(self), [&]() {
+		parallel_for(height, threads, [&](int begin, int end, int t) {
+			double *cells = &local[t][0];
+			for (int row=begin; row<end; row++) {
+				const unsigned short *src = rawdata_row(raw, row);
+				double *line = cells + (long long)row * gh / height * gw;
+				for (int col=0; col<width; col++) {
+					unsigned v = 0;
+					for (int c=0; c<spp; c++) {
+						v += src[col * spp + c];
+					}
+					line[cell_col[col]] += v > black * spp ? v - black * spp : 0;
+				}
+			}
+		});
+
+		std::vector<double> cells(gw * gh, 0);
+		for (int t=0; t<threads; t++) {
+			for (int i=0; i<gw*gh; i++) {
+				cells[i] += local[t][i];
+			}
+		}
+		// cells differ slightly in pixel count, so compare means
+		std::vector<double> counts(gw * gh, 0);
+		for (int y=0; y<gh; y++) {
+			int rows = ((long long)(y + 1) * height + gh - 1) / gh - ((long long)y * height + gh - 1) / gh;
+			for (int x=0; x<gw; x++) {
+				int cols = ((long long)(x + 1) * width + gw - 1) / gw - ((long long)x * width + gw - 1) / gw;
+				counts[y * gw + x] = (double)rows * cols;
+			}
+		}
+		for (int y=0; y<gh; y++) {
+			for (int x=0; x<gw-1; x++) {
+				int i = y * gw + x;
+				double left = counts[i] ? cells[i] / counts[i] : 0;
+				double right = counts[i + 1] ? cells[i + 1] / counts[i + 1] : 0;
+				hash = (hash << 1) | (left < right ? 1 : 0);
+			}
+		}
+	});
+
+	return ULL2NUM(hash);
+}
+
+
+// LibRaw::IParam
+
+void apply_iparam(VALUE self, libraw_iparams_t *p)
+{
+	if (p) {
+		rb_iv_set(self, "@make", rb_str_new2(p->make));
+		rb_iv_set(self, "@model", rb_str_new2(p->model));
+		rb_iv_set(self, "@software", rb_str_new2(p->software));
+		rb_iv_set(self, "@raw_count", INT2FIX(p->raw_count));
+		rb_iv_set(self, "@dng_version", INT2FIX(p->dng_version));
+		rb_iv_set(self, "@is_foveon", p->is_foveon ? Qtrue : Qfalse);
+		rb_iv_set(self, "@colors", INT2FIX(p->colors));
+		rb_iv_set(self, "@filters", INT2FIX(p->filters));
+		rb_iv_set(self, "@cdesc", rb_str_new2(p->cdesc));
+	}
+}
+
+
+// LibRaw::ImageSize
+
+void apply_image_size(VALUE self, libraw_image_sizes_t *p)
+{
+	if (p) {
+		rb_iv_set(self, "@raw_height", INT2FIX(p->raw_height));
+		rb_iv_set(self, "@raw_width", INT2FIX(p->raw_width));
+		rb_iv_set(self, "@height", INT2FIX(p->height));
+		rb_iv_set(self, "@width", INT2FIX(p->width));
+		rb_iv_set(self, "@top_margin", INT2FIX(p->top_margin));
+		rb_iv_set(self, "@left_margin", INT2FIX(p->left_margin));
+		rb_iv_set(self, "@iheight", INT2FIX(p->iheight));
+		rb_iv_set(self, "@iwidth", INT2FIX(p->iwidth));
+		rb_iv_set(self, "@raw_pitch", INT2FIX(p->raw_pitch));
+		rb_iv_set(self, "@pixel_aspect", rb_float_new(p->pixel_aspect));
+		rb_iv_set(self, "@flip", INT2FIX(p->flip));
+	}
+}
+
+
+// LibRaw::ColorData
+
+static VALUE float_array(const float *values, int count)
+{
+	VALUE result = rb_ary_new2(count);
+	for (int i=0; i<count; i++) {
+		rb_ary_push(result, rb_float_new(values[i]));
+	}
+	return result;
+}
+
+static VALUE float_matrix(const float *values, int rows, int cols)
+{
+	VALUE result = rb_ary_new2(rows);
+	for (int i=0; i<rows; i++) {
+		rb_ary_push(result, float_array(values + i * cols, cols));
+	}
+	return result;
+}
+
+void apply_colordata(VALUE self, libraw_colordata_t *p)
+{
+	if (p) {
+		rb_iv_set(self, "@black", UINT2NUM(p->black));
+		VALUE cblack = rb_ary_new2(4);
+		for (int i=0; i<4; i++) {
+			rb_ary_push(cblack, UINT2NUM(p->cblack[i]));
+		}
+		rb_iv_set(self, "@cblack", cblack);
+		rb_iv_set(self, "@data_maximum", UINT2NUM(p->data_maximum));
+		rb_iv_set(self, "@maximum", UINT2NUM(p->maximum));
+		rb_iv_set(self, "@cam_mul", float_array(p->cam_mul, 4));
+		rb_iv_set(self, "@pre_mul", float_array(p->pre_mul, 4));
+		rb_iv_set(self, "@cmatrix", float_matrix(&p->cmatrix[0][0], 3, 4));
+		rb_iv_set(self, "@rgb_cam", float_matrix(&p->rgb_cam[0][0], 3, 4));
+		rb_iv_set(self, "@cam_xyz", float_matrix(&p->cam_xyz[0][0], 4, 3));
+		rb_iv_set(self, "@flash_used", rb_float_new(p->flash_used));
+		rb_iv_set(self, "@canon_ev", rb_float_new(p->canon_ev));
+		rb_iv_set(self, "@model2", rb_str_new2(p->model2));
+		rb_iv_set(self, "@baseline_exposure", rb_float_new(p->baseline_exposure));
+	}
+}
+
+
+// LibRaw::ImgOther
+
+void apply_imgother(VALUE self, libraw_imgother_t *p)
+{
+	if (p) {
+		rb_iv_set(self, "@iso_speed", rb_float_new(p->iso_speed));
+		rb_iv_set(self, "@shutter", rb_float_new(p->shutter));
+		rb_iv_set(self, "@aperture", rb_float_new(p->aperture));
+		rb_iv_set(self, "@focal_len", rb_float_new(p->focal_len));
+		rb_iv_set(self, "@timestamp", INT2FIX(p->timestamp));
+		rb_iv_set(self, "@shot_order", INT2FIX(p->shot_order));
+		rb_iv_set(self, "@desc", rb_str_new2(p->desc));
+		rb_iv_set(self, "@artist", rb_str_new2(p->artist));
+
+		// TODO: parsed_gps
 	}
 }
 
 
 // LibRaw::OutputParam
 
-VALUE rb_output_param_initialize(VALUE self)
-{
-	OutputParamNativeResource *p = ALLOC(OutputParamNativeResource);
+VALUE rb_output_param_initialize(VALUE self)
+{
+	OutputParamNativeResource *p = ALLOC(OutputParamNativeResource);
+
+
+	memset(&p->params, 0, sizeof(libraw_output_params_t));
+
+	double aber[4] = {1,1,1,1};
+	double gamm[6] = { 0.45,4.5,0,0,0,0 };
+	unsigned greybox[4] =  { 0, 0, UINT_MAX, UINT_MAX };
+	unsigned cropbox[4] =  { 0, 0, UINT_MAX, UINT_MAX };
+
+	memmove(&p->params.aber,&aber,sizeof(aber));
+	memmove(&p->params.gamm,&gamm,sizeof(gamm));
+	memmove(&p->params.greybox,&greybox,sizeof(greybox));
+	memmove(&p->params.cropbox,&cropbox,sizeof(cropbox));
+
+	p->params.bright=1;
+	p->params.use_camera_matrix=1;
+	p->params.user_flip=-1;
+	p->params.user_black=-1;
+	p->params.user_cblack[0]=p->params.user_cblack[1]=p->params.user_cblack[2]=p->params.user_cblack[3]=-1000001;
+	p->params.user_sat=-1;
+	p->params.user_qual=-1;
+	p->params.output_color=1;
+	p->params.output_bps=8;
+	p->params.use_fuji_rotate=1;
+	p->params.exp_shift = 1.0; 
+	p->params.auto_bright_thr = LIBRAW_DEFAULT_AUTO_BRIGHTNESS_THRESHOLD;
+	p->params.adjust_maximum_thr= LIBRAW_DEFAULT_ADJUST_MAXIMUM_THRESHOLD;
+	p->params.use_rawspeed = 1; 
+	p->params.no_auto_scale = 0; 
+	p->params.no_interpolation = 0; 
+	p->params.sraw_ycc = 0; 
+	p->params.force_foveon_x3f = 0; 
+	p->params.x3f_flags = LIBRAW_DP2Q_INTERPOLATERG|LIBRAW_DP2Q_INTERPOLATEAF;
+	p->params.sony_arw2_options = 0; 
+	p->params.sony_arw2_posterization_thr = 0; 
+	p->params.green_matching = 0; 
+	p->params.coolscan_nef_gamma = 1.0f;
+
+
+	VALUE resource = TypedData_Wrap_Struct(rb_cObject, &output_param_native_resource_type, p);
+	rb_iv_set(self, "output_param_native_resource", resource);
+
+	apply_output_param(self, &p->params);
+
+	return self;
+}
+
+VALUE rb_output_param_initialize_copy(VALUE self, VALUE orig)
+{
+	rb_call_super(1, &orig);
+
+	// dup/clone must not share the native params with the original
+	OutputParamNativeResource *p = ALLOC(OutputParamNativeResource);
+	memmove(&p->params, get_output_params(orig), sizeof(libraw_output_params_t));
+
+	VALUE resource = TypedData_Wrap_Struct(rb_cObject, &output_param_native_resource_type, p);
+	rb_iv_set(self, "output_param_native_resource", resource);
+
+	return self;
+}
+
+static void output_param_key_value(std::string &key, double v)
+{
+	// -0.0 and 0.0 are the same setting, and every NaN is the same NaN
+	if (v==0) {
+		v = 0;
+	} else if (v!=v) {
+		v = NAN;
+	}
+	key.append((const char *)&v, sizeof(v));
+}
+
+static void output_param_key_string(std::string &key, const char *s)
+{
+	key.push_back(s ? 1 : 0);
+	if (s) {
+		key.append(s, strlen(s) + 1);
+	}
+}
+
+// the params field by field in declaration order, each number widened to a
+// double (exact for int, unsigned and float), so == and hash skip padding
+// and compare the profile paths by content rather than by pointer
+static std::string output_param_key(const libraw_output_params_t *p)
+{
+	std::string key;
+	for (int i=0; i<4; i++) {
+		output_param_key_value(key, p->greybox[i]);
+		output_param_key_value(key, p->cropbox[i]);
+		output_param_key_value(key, p->aber[i]);
+		output_param_key_value(key, p->user_mul[i]);
+		output_param_key_value(key, p->user_cblack[i]);
+		output_param_key_value(key, p->wf_deband_treshold[i]);
+	}
+	for (int i=0; i<6; i++) {
+		output_param_key_value(key, p->gamm[i]);
+	}
+	output_param_key_value(key, p->shot_select);
+	output_param_key_value(key, p->bright);
+	output_param_key_value(key, p->threshold);
+	output_param_key_value(key, p->half_size);
+	output_param_key_value(key, p->four_color_rgb);
+	output_param_key_value(key, p->highlight);
+	output_param_key_value(key, p->use_auto_wb);
+	output_param_key_value(key, p->use_camera_wb);
+	output_param_key_value(key, p->use_camera_matrix);
+	output_param_key_value(key, p->output_color);
+	output_param_key_string(key, p->output_profile);
+	output_param_key_string(key, p->camera_profile);
+	output_param_key_string(key, p->bad_pixels);
+	output_param_key_string(key, p->dark_frame);
+	output_param_key_value(key, p->output_bps);
+	output_param_key_value(key, p->output_tiff);
+	output_param_key_value(key, p->user_flip);
+	output_param_key_value(key, p->user_qual);
+	output_param_key_value(key, p->user_black);
+	output_param_key_value(key, p->user_sat);
+	output_param_key_value(key, p->med_passes);
+	output_param_key_value(key, p->auto_bright_thr);
+	output_param_key_value(key, p->adjust_maximum_thr);
+	output_param_key_value(key, p->no_auto_bright);
+	output_param_key_value(key, p->use_fuji_rotate);
+	output_param_key_value(key, p->green_matching);
+
+	// DCB parameters
+	output_param_key_value(key, p->dcb_iterations);
+	output_param_key_value(key, p->dcb_enhance_fl);
+	output_param_key_value(key, p->fbdd_noiserd);
+
+	// VCD parameters
+	output_param_key_value(key, p->eeci_refine);
+	output_param_key_value(key, p->es_med_passes);
+
+	// AMaZE
+	output_param_key_value(key, p->ca_correc);
+	output_param_key_value(key, p->cared);
+	output_param_key_value(key, p->cablue);
+	output_param_key_value(key, p->cfaline);
+	output_param_key_value(key, p->linenoise);
+	output_param_key_value(key, p->cfa_clean);
+	output_param_key_value(key, p->lclean);
+	output_param_key_value(key, p->cclean);
+	output_param_key_value(key, p->cfa_green);
+	output_param_key_value(key, p->green_thresh);
+	output_param_key_value(key, p->exp_correc);
+	output_param_key_value(key, p->exp_shift);
+	output_param_key_value(key, p->exp_preser);
+
+	output_param_key_value(key, p->wf_debanding);
+	output_param_key_value(key, p->use_rawspeed);
+	output_param_key_value(key, p->no_auto_scale);
+	output_param_key_value(key, p->no_interpolation);
+	output_param_key_value(key, p->sraw_ycc);
+	output_param_key_value(key, p->force_foveon_x3f);
+	output_param_key_value(key, p->x3f_flags);
+	output_param_key_value(key, p->sony_arw2_options);
+	output_param_key_value(key, p->sony_arw2_posterization_thr);
+	output_param_key_value(key, p->coolscan_nef_gamma);
+	return key;
+}
+
+VALUE rb_output_param_equal(VALUE self, VALUE other)
+{
+	if (self==other) {
+		return Qtrue;
+	}
+	if (!rb_obj_is_kind_of(other, rb_cOutputParam)) {
+		return Qfalse;
+	}
+
+	return output_param_key(get_output_params(self))==output_param_key(get_output_params(other)) ? Qtrue : Qfalse;
+}
+
+VALUE rb_output_param_hash(VALUE self)
+{
+	std::string key = output_param_key(get_output_params(self));
+	return ST2FIX(rb_memhash(key.data(), key.size()));
+}
+
+static int output_param_apply_option(VALUE key, VALUE val, VALUE self)
+{
+	VALUE name = rb_sym2str(rb_to_symbol(key));
+	ID id = rb_intern_str(name);
+	ID setter = rb_intern_str(rb_str_plus(name, rb_str_new2("=")));
+
+	if (id==rb_intern("greybox") || id==rb_intern("cropbox") || id==rb_intern("gamma") || id==rb_intern("whitebalance")) {
+		// these take positional values
+		val = rb_Array(val);
+		rb_funcallv(self, id, RARRAY_LENINT(val), RARRAY_CONST_PTR(val));
+	} else if (rb_respond_to(self, setter)) {
+		rb_funcall(self, setter, 1, val);
+	} else {
+		rb_raise(rb_eArgError, "unknown output param: %s", RSTRING_PTR(name));
+	}
+
+	return ST_CONTINUE;
+}
+
+static std::mutex preset_registry_mutex;
+
+VALUE rb_output_param_s_preset(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE name, opts;
+	rb_scan_args(argc, argv, "1:", &name, &opts);
+	name = rb_to_symbol(name);
+
+	if (opts==Qnil) {
+		VALUE presets = rb_ivar_get(klass, rb_intern("presets"));
+		if (presets==Qnil) {
+			rb_raise(rb_eKeyError, "unknown preset: %s", rb_id2name(SYM2ID(name)));
+		}
+		VALUE preset = rb_hash_lookup2(presets, name, Qundef);
+		if (preset==Qundef) {
+			rb_raise(rb_eKeyError, "unknown preset: %s", rb_id2name(SYM2ID(name)));
+		}
+		return preset;
+	}
+
+	VALUE preset = rb_class_new_instance(0, NULL, klass);
+	rb_hash_foreach(opts, output_param_apply_option, preset);
+	rb_iv_set(preset, "@name", name);
+#ifdef HAVE_RUBY_RACTOR_H
+	rb_ractor_make_shareable(preset);
+#else
+	rb_obj_freeze(preset);
+#endif
+
+	// the registry is a frozen, shareable Hash replaced on each
+	// registration, so any Ractor can look presets up. Ractors register in
+	// parallel, so the swap retries until no one replaced the registry
+	// between the read and the write; the lock only covers that compare
+	// and store, never an allocation, so it cannot block a GC barrier
+	ID id = rb_intern("presets");
+	for (;;) {
+		VALUE current = rb_ivar_get(klass, id);
+		VALUE presets = current==Qnil ? rb_hash_new() : rb_hash_dup(current);
+		rb_hash_aset(presets, name, preset);
+		rb_obj_freeze(presets);
+#ifdef HAVE_RUBY_RACTOR_H
+		rb_ractor_make_shareable(presets);
+#endif
+		std::lock_guard<std::mutex> lock(preset_registry_mutex);
+		if (rb_ivar_get(klass, id)==current) {
+			rb_ivar_set(klass, id, presets);
+			break;
+		}
+	}
+
+	return preset;
+}
+
+void apply_output_param(VALUE self, libraw_output_params_t *p)
+{
+	if (p) {
+		// TODO: greybox
+		// TODO: cropbox
+		// TODO: aber
+		// TODO: gamm
+		// TODO: user_mul
+		rb_iv_set(self, "@shot_select", INT2FIX(p->shot_select));
+		rb_iv_set(self, "@bright", rb_float_new(p->bright));
+		rb_iv_set(self, "@threshold", rb_float_new(p->threshold));
+		rb_iv_set(self, "@half_size", INT2FIX(p->half_size));
+		rb_iv_set(self, "@four_color_rgb", INT2FIX(p->four_color_rgb));
+		rb_iv_set(self, "@highlight", INT2FIX(p->highlight));
+		rb_iv_set(self, "@use_auto_wb", p->use_auto_wb ? Qtrue : Qfalse);
+		rb_iv_set(self, "@use_camera_wb", p->use_camera_wb ? Qtrue : Qfalse);
+		rb_iv_set(self, "@use_camera_matrix", p->use_camera_matrix ? Qtrue : Qfalse);
+		rb_iv_set(self, "@output_color", INT2FIX(p->output_color));
+		// TODO: output_profile
+		// TODO: camera_profile
+		// TODO: bad_pixels
+		// TODO: dark_frame
+		rb_iv_set(self, "@output_bps", INT2FIX(p->output_bps));
+		rb_iv_set(self, "@output_tiff", INT2FIX(p->output_tiff));
+		rb_iv_set(self, "@user_flip", INT2FIX(p->user_flip));
+		rb_iv_set(self, "@user_qual", INT2FIX(p->user_qual));
+		rb_iv_set(self, "@user_black", INT2FIX(p->user_black));
+		// TODO: user_cblack
+		rb_iv_set(self, "@user_sat", INT2FIX(p->user_sat));
+		rb_iv_set(self, "@med_passes", INT2FIX(p->med_passes));
+		rb_iv_set(self, "@auto_bright_thr", rb_float_new(p->auto_bright_thr));
+		rb_iv_set(self, "@adjust_maximum_thr", rb_float_new(p->adjust_maximum_thr));
+		rb_iv_set(self, "@no_auto_bright", p->no_auto_bright ? Qtrue : Qfalse);
+		rb_iv_set(self, "@use_fuji_rotate", p->use_fuji_rotate ? Qtrue : Qfalse);
+		rb_iv_set(self, "@green_matching", INT2FIX(p->green_matching));
+
+		// DCB parameters
+		rb_iv_set(self, "@dcb_iterations", INT2FIX(p->dcb_iterations));
+		rb_iv_set(self, "@dcb_enhance_fl", INT2FIX(p->dcb_enhance_fl));
+		rb_iv_set(self, "@fbdd_noiserd", INT2FIX(p->fbdd_noiserd));
+
+		// VCD parameters
+		rb_iv_set(self, "@eeci_refine", INT2FIX(p->eeci_refine));
+		rb_iv_set(self, "@es_med_passes", INT2FIX(p->es_med_passes));
+
+		// AMaZE
+		rb_iv_set(self, "@ca_correc", INT2FIX(p->ca_correc));
+		rb_iv_set(self, "@cared", rb_float_new(p->cared));
+		rb_iv_set(self, "@cablue", rb_float_new(p->cablue));
+		rb_iv_set(self, "@cfaline", INT2FIX(p->cfaline));
+		rb_iv_set(self, "@linenoise", rb_float_new(p->linenoise));
+		rb_iv_set(self, "@cfa_clean", INT2FIX(p->cfa_clean));
+		rb_iv_set(self, "@lclean", rb_float_new(p->lclean));
+		rb_iv_set(self, "@cclean", rb_float_new(p->cclean));
+		rb_iv_set(self, "@cfa_green", INT2FIX(p->cfa_green));
+		rb_iv_set(self, "@green_thresh", rb_float_new(p->green_thresh));
+		rb_iv_set(self, "@exp_correc", INT2FIX(p->exp_correc));
+		rb_iv_set(self, "@exp_shift", rb_float_new(p->exp_shift));
+		rb_iv_set(self, "@exp_preser", rb_float_new(p->exp_preser));
+
+		// WF debanding
+		rb_iv_set(self, "@wf_debanding", INT2FIX(p->wf_debanding));
+		// TODO: wf_deband_treshold
+
+		// Raw speed
+		rb_iv_set(self, "@use_rawspeed", p->use_rawspeed ? Qtrue : Qfalse);
+
+		// Disable Auto-scale
+		rb_iv_set(self, "@no_auto_scale", p->no_auto_scale ? Qtrue : Qfalse);
+
+		// Disable intepolation
+		rb_iv_set(self, "@no_interpolation", p->no_interpolation ? Qtrue : Qfalse);
+
+		// Disable sRAW YCC to RGB conversion
+		rb_iv_set(self, "@sraw_ycc", INT2FIX(p->sraw_ycc));
+
+		// Force use x3f data decoding either if demosaic pack GPL2 enabled
+		rb_iv_set(self, "@force_foveon_x3f", INT2FIX(p->force_foveon_x3f));
+		rb_iv_set(self, "@x3f_flags", INT2FIX(p->x3f_flags));
+
+		// Sony ARW2 digging mode
+		rb_iv_set(self, "@sony_arw2_options", INT2FIX(p->sony_arw2_options));
+		rb_iv_set(self, "@sony_arw2_posterization_thr", INT2FIX(p->sony_arw2_posterization_thr));
+
+		// Nikon Coolscan
+		rb_iv_set(self, "@coolscan_nef_gamma", rb_float_new(p->coolscan_nef_gamma));
+	}
+}
+
+VALUE rb_output_param_greybox(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->greybox[0] = NUM2LONG(x);
+	params->greybox[1] = NUM2LONG(y);
+	params->greybox[2] = NUM2LONG(w);
+	params->greybox[3] = NUM2LONG(h);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_cropbox(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->cropbox[0]= NUM2LONG(x);
+	params->cropbox[1]= NUM2LONG(y);
+	params->cropbox[2]= NUM2LONG(w);
+	params->cropbox[3]= NUM2LONG(h);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_gamma(VALUE self, VALUE pwr, VALUE ts)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->gamm[0] = RFLOAT_VALUE(rb_Float(pwr));
+	params->gamm[1] = RFLOAT_VALUE(rb_Float(ts));
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_whitebalance(VALUE self, VALUE r, VALUE g, VALUE b, VALUE g2)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->user_mul[0] = RFLOAT_VALUE(rb_Float(r));
+	params->user_mul[1] = RFLOAT_VALUE(rb_Float(g));
+	params->user_mul[2] = RFLOAT_VALUE(rb_Float(b));
+	params->user_mul[3] = RFLOAT_VALUE(rb_Float(g2));
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_bright(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->bright = RFLOAT_VALUE(rb_Float(val));
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_threshold(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->threshold = RFLOAT_VALUE(rb_Float(val));
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_half_size(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->half_size = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_four_color_rgb(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->four_color_rgb = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_highlight(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->highlight = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_use_auto_wb(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->use_auto_wb = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_use_camera_wb(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->use_camera_wb = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_use_camera_matrix(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->use_camera_matrix = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_output_color(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->output_color = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_output_bps(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->output_bps = NUM2LONG(val)==16 ? 16 : 8;
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_output_tiff(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->output_tiff = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_flip(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->user_flip = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_quality(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->user_qual = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_black(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->user_black = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_saturation(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->user_sat = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_median_filter_passes(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->user_sat = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_no_auto_bright(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->no_auto_bright = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_use_fuji_rotate(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->use_fuji_rotate = !(val==Qnil || val==Qfalse);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_fbdd_noiserd(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->fbdd_noiserd = NUM2LONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+VALUE rb_output_param_set_shot_select(VALUE self, VALUE val)
+{
+	libraw_output_params_t *params = get_mutable_output_params(self);
+
+	params->shot_select = NUM2ULONG(val);
+
+	apply_output_param(self, params);
+
+	return self;
+}
+
+
+// LibRaw::MakerNote
+
+void apply_makernote(VALUE self, libraw_makernotes_lens_t *p)
+{
+	if (p) {
+		rb_iv_set(self, "@lens_id", INT2FIX(p->LensID));
+		rb_iv_set(self, "@lens", rb_str_new2(p->Lens));
+		rb_iv_set(self, "@lens_format", INT2FIX(p->LensFormat));
+		rb_iv_set(self, "@lens_mount", INT2FIX(p->LensMount));
+		rb_iv_set(self, "@cam_id", INT2FIX(p->CamID));
+		rb_iv_set(self, "@camera_format", INT2FIX(p->CameraFormat));
+		rb_iv_set(self, "@camera_mount", INT2FIX(p->CameraMount));
+		rb_iv_set(self, "@body", rb_str_new2(p->body));
+		rb_iv_set(self, "@focal_type", INT2FIX(p->FocalType));
+		rb_iv_set(self, "@lens_features_pre", rb_str_new2(p->LensFeatures_pre));
+		rb_iv_set(self, "@lens_features_suf", rb_str_new2(p->LensFeatures_suf));
+		rb_iv_set(self, "@min_focal", rb_float_new(p->MinFocal));
+		rb_iv_set(self, "@max_focal", rb_float_new(p->MaxFocal));
+		rb_iv_set(self, "@max_ap_4_min_focal", rb_float_new(p->MaxAp4MinFocal));
+		rb_iv_set(self, "@max_ap_4_max_focal", rb_float_new(p->MaxAp4MaxFocal));
+		rb_iv_set(self, "@min_ap_4_min_focal", rb_float_new(p->MinAp4MinFocal));
+		rb_iv_set(self, "@min_ap_4_max_focal", rb_float_new(p->MinAp4MaxFocal));
+		rb_iv_set(self, "@max_ap", rb_float_new(p->MaxAp));
+		rb_iv_set(self, "@min_ap", rb_float_new(p->MinAp));
+		rb_iv_set(self, "@cur_focal", rb_float_new(p->CurFocal));
+		rb_iv_set(self, "@cur_ap", rb_float_new(p->CurAp));
+		rb_iv_set(self, "@max_ap_4_cur_focal", rb_float_new(p->MaxAp4CurFocal));
+		rb_iv_set(self, "@min_ap_4_cur_focal", rb_float_new(p->MinAp4CurFocal));
+		rb_iv_set(self, "@lens_f_stops", rb_float_new(p->LensFStops));
+		rb_iv_set(self, "@teleconverter_id", INT2FIX(p->TeleconverterID));
+		rb_iv_set(self, "@teleconverter", rb_str_new2(p->Teleconverter));
+		rb_iv_set(self, "@adapter_id", INT2FIX(p->AdapterID));
+		rb_iv_set(self, "@adapter", rb_str_new2(p->Adapter));
+		rb_iv_set(self, "@attachment_id", INT2FIX(p->AttachmentID));
+		rb_iv_set(self, "@attachment", rb_str_new2(p->Attachment));
+		rb_iv_set(self, "@canon_focal_units", INT2FIX(p->CanonFocalUnits));
+		rb_iv_set(self, "@focal_length_in_35mm_format", rb_float_new(p->FocalLengthIn35mmFormat));
+	}
+}
+
+
+// LibRaw::LensInfo
+
+void apply_lensinfo(VALUE self, libraw_lensinfo_t *p)
+{
+	if (p) {
+		rb_iv_set(self, "@min_focal", rb_float_new(p->MinFocal));
+		rb_iv_set(self, "@max_focal", rb_float_new(p->MaxFocal));
+		rb_iv_set(self, "@max_ap_4_min_focal", rb_float_new(p->MaxAp4MinFocal));
+		rb_iv_set(self, "@max_ap_4_max_focal", rb_float_new(p->MaxAp4MaxFocal));
+		rb_iv_set(self, "@exif_max_ap", rb_float_new(p->EXIF_MaxAp));
+		rb_iv_set(self, "@lens_make", rb_str_new2(p->LensMake));
+		rb_iv_set(self, "@lens", rb_str_new2(p->Lens));
+		rb_iv_set(self, "@focal_length_in_35mm_format", INT2FIX(p->FocalLengthIn35mmFormat));
+		// TODO: nikon
+		// TODO: dng
+
+		// makernotes
+		VALUE makernotes = rb_iv_get(self, "@makernotes");
+		if (makernotes==Qnil) {
+			makernotes = rb_class_new_instance(0, NULL, rb_cMakerNote);
+			rb_iv_set(self, "@makernotes", makernotes);
+		}
+		apply_makernote(makernotes, &p->makernotes);
+	}
+}
+
+
+// LibRaw::ProcessedImage
+
+void processed_image_native_resource_delete(ProcessedImageNativeResource * p)
+{
+	release_processed_image(p);
+	free(p);
+}
+
+void release_processed_image(ProcessedImageNativeResource *p)
+{
+	switch (p->storage) {
+	case PROCESSED_IMAGE_LIBRAW:
+		LibRaw::dcraw_clear_mem((libraw_processed_image_t *)p->base);
+		break;
+	case PROCESSED_IMAGE_MALLOC:
+		buffer_pool_free(p->base);
+		break;
+	case PROCESSED_IMAGE_SHARED:
+		munmap(p->base, p->map_size);
+		if (0<=p->fd) {
+			close(p->fd);
+		}
+		break;
+	default:
+		break;
+	}
+	p->storage = PROCESSED_IMAGE_NONE;
+	p->base = NULL;
+	p->data = NULL;
+	p->data_size = 0;
+	p->map_size = 0;
+	p->fd = -1;
+}
+
+ProcessedImageNativeResource* get_processed_image(VALUE self)
+{
+	VALUE resource = rb_iv_get(self, "processed_image_native_resource");
+	if (resource==Qnil) {
+		return NULL;
+	}
+
+	ProcessedImageNativeResource *p = NULL;
+	Data_Get_Struct(resource, ProcessedImageNativeResource, p);
+
+	return p;
+}
+
+VALUE wrap_processed_image(ProcessedImageNativeResource *p)
+{
+	VALUE self = rb_obj_alloc(rb_cProcessedImage);
+	VALUE resource = Data_Wrap_Struct(0, 0, processed_image_native_resource_delete, p);
+	rb_iv_set(self, "processed_image_native_resource", resource);
+
+	apply_processed_image(self, p);
+
+	return self;
+}
+
+// NULL when out of memory
+ProcessedImageNativeResource *alloc_processed_image(int width, int height, int colors, int bits)
+{
+	ProcessedImageNativeResource *p = ALLOC(ProcessedImageNativeResource);
+	p->type = LIBRAW_IMAGE_BITMAP;
+	p->width = width;
+	p->height = height;
+	p->colors = colors;
+	p->bits = bits;
+	p->sample_format = PROCESSED_IMAGE_UNSIGNED;
+	p->data_size = (size_t)width * height * colors * (bits / 8);
+	p->storage = PROCESSED_IMAGE_MALLOC;
+	p->base = buffer_pool_alloc(p->data_size);
+	p->data = (unsigned char *)p->base;
+	p->map_size = 0;
+	p->fd = -1;
+	if (!p->base) {
+		xfree(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+// Shared images live in an anonymous memfd (POSIX shm where there is no
+// memfd_create): one page of SharedImageHeader, then the samples. The fd
+// can be passed to another process (UNIXSocket#send_io, fork), which maps
+// it with ProcessedImage.open_shared without copying.
+
+#define SHARED_IMAGE_MAGIC "LRSHIMG1"
+#define SHARED_IMAGE_DATA_OFFSET 4096
+
+struct SharedImageHeader {
+	char magic[8];
+	int type;
+	int width;
+	int height;
+	int colors;
+	int bits;
+	int sample_format;
+	unsigned long long data_offset;
+	unsigned long long data_size;
+};
+
+// -1 with errno set on failure
+static int shared_memory_fd(size_t size)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int fd = memfd_create("lib_raw", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+	static std::atomic<unsigned> sequence(0);
+	char name[64];
+	snprintf(name, sizeof(name), "/lib_raw.%d.%u", (int)getpid(), sequence++);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (0<=fd) {
+		shm_unlink(name);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	if (fd<0) {
+		return -1;
+	}
+	if (ftruncate(fd, size)!=0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+	// receivers can rely on the size
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+	return fd;
+}
+
+// raises on failure
+ProcessedImageNativeResource *alloc_shared_processed_image(int width, int height, int colors, int bits, enum ProcessedImageSampleFormat sample_format)
+{
+	size_t data_size = (size_t)width * height * colors * (bits / 8);
+	size_t map_size = SHARED_IMAGE_DATA_OFFSET + data_size;
+	int fd = shared_memory_fd(map_size);
+	if (fd<0) {
+		rb_sys_fail("shared processed image");
+	}
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map==MAP_FAILED) {
+		int e = errno;
+		close(fd);
+		rb_syserr_fail(e, "shared processed image");
+	}
+
+	SharedImageHeader *header = (SharedImageHeader *)map;
+	memcpy(header->magic, SHARED_IMAGE_MAGIC, sizeof(header->magic));
+	header->type = LIBRAW_IMAGE_BITMAP;
+	header->width = width;
+	header->height = height;
+	header->colors = colors;
+	header->bits = bits;
+	header->sample_format = sample_format;
+	header->data_offset = SHARED_IMAGE_DATA_OFFSET;
+	header->data_size = data_size;
+
+	ProcessedImageNativeResource *p = ALLOC(ProcessedImageNativeResource);
+	p->type = LIBRAW_IMAGE_BITMAP;
+	p->width = width;
+	p->height = height;
+	p->colors = colors;
+	p->bits = bits;
+	p->sample_format = sample_format;
+	p->data_size = data_size;
+	p->storage = PROCESSED_IMAGE_SHARED;
+	p->base = map;
+	p->data = (unsigned char *)map + SHARED_IMAGE_DATA_OFFSET;
+	p->map_size = map_size;
+	p->fd = fd;
+
+	return p;
+}
+
+// maps a shared image copy-on-write: changes (apply_color) stay in this
+// process. The fd (Integer or IO) is not kept and may be closed afterwards.
+VALUE rb_processed_image_s_open_shared(VALUE klass, VALUE fd)
+{
+	int n = rb_respond_to(fd, rb_intern("fileno")) ? NUM2INT(rb_funcall(fd, rb_intern("fileno"), 0)) : NUM2INT(fd);
+
+	struct stat st;
+	if (fstat(n, &st)!=0) {
+		rb_sys_fail("open_shared");
+	}
+	size_t map_size = st.st_size;
+	if (map_size<sizeof(SharedImageHeader)) {
+		rb_raise(rb_eArgError, "not a shared processed image");
+	}
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, n, 0);
+	if (map==MAP_FAILED) {
+		rb_sys_fail("open_shared");
+	}
+
+	SharedImageHeader *header = (SharedImageHeader *)map;
+	size_t sample_size = 0<header->bits && header->bits%8==0 ? header->bits / 8 : 0;
+	bool valid = memcmp(header->magic, SHARED_IMAGE_MAGIC, sizeof(header->magic))==0
+		&& 0<header->width && 0<header->height && 0<header->colors && sample_size
+		&& header->data_size==(unsigned long long)header->width * header->height * header->colors * sample_size
+		&& header->data_offset<=map_size && header->data_size<=map_size - header->data_offset;
+	if (!valid) {
+		munmap(map, map_size);
+		rb_raise(rb_eArgError, "not a shared processed image");
+	}
+
+	ProcessedImageNativeResource *p = ALLOC(ProcessedImageNativeResource);
+	p->type = header->type;
+	p->width = header->width;
+	p->height = header->height;
+	p->colors = header->colors;
+	p->bits = header->bits;
+	p->sample_format = header->sample_format==PROCESSED_IMAGE_FLOAT ? PROCESSED_IMAGE_FLOAT : PROCESSED_IMAGE_UNSIGNED;
+	p->data_size = header->data_size;
+	p->storage = PROCESSED_IMAGE_SHARED;
+	p->base = map;
+	p->data = (unsigned char *)map + header->data_offset;
+	p->map_size = map_size;
+	p->fd = -1;
+
+	return wrap_processed_image(p);
+}
+
+// fd, size and layout of an image made with processed_image(shared: true),
+// nil for any other; the fd stays owned by the image
+VALUE rb_processed_image_descriptor(VALUE self)
+{
+	ProcessedImageNativeResource *p = get_processed_image(self);
+	if (!p || p->storage!=PROCESSED_IMAGE_SHARED || p->fd<0) {
+		return Qnil;
+	}
+
+	VALUE descriptor = rb_hash_new();
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("fd")), INT2NUM(p->fd));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("size")), SIZET2NUM(p->map_size));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("offset")), SIZET2NUM(p->data - (unsigned char *)p->base));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("data_size")), SIZET2NUM(p->data_size));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("width")), INT2NUM(p->width));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("height")), INT2NUM(p->height));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("colors")), INT2NUM(p->colors));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("bits")), INT2NUM(p->bits));
+	rb_hash_aset(descriptor, ID2SYM(rb_intern("format")), rb_iv_get(self, "@format"));
+	return descriptor;
+}
+
+// takes ownership of a LibRaw allocated image
+VALUE new_processed_image(libraw_processed_image_t *image)
+{
+	ProcessedImageNativeResource *p = ALLOC(ProcessedImageNativeResource);
+	p->type = image->type;
+	p->width = image->width;
+	p->height = image->height;
+	p->colors = image->colors;
+	p->bits = image->bits;
+	p->sample_format = PROCESSED_IMAGE_UNSIGNED;
+	p->data_size = image->data_size;
+	p->storage = PROCESSED_IMAGE_LIBRAW;
+	p->base = image;
+	p->data = image->data;
+	p->map_size = 0;
+	p->fd = -1;
+
+	return wrap_processed_image(p);
+}
+
+void apply_processed_image(VALUE self, ProcessedImageNativeResource *p)
+{
+	if (p) {
+		rb_iv_set(self, "@type", INT2FIX(p->type));
+		const char *format = p->type==LIBRAW_IMAGE_JPEG ? "jpeg" : p->sample_format!=PROCESSED_IMAGE_FLOAT ? "bitmap" : p->bits==32 ? "float32_linear" : "float16_linear";
+		rb_iv_set(self, "@format", ID2SYM(rb_intern(format)));
+		rb_iv_set(self, "@width", INT2FIX(p->width));
+		rb_iv_set(self, "@height", INT2FIX(p->height));
+		rb_iv_set(self, "@colors", INT2FIX(p->colors));
+		rb_iv_set(self, "@bits", INT2FIX(p->bits));
+		rb_iv_set(self, "@data_size", SIZET2NUM(p->data_size));
+	}
+}
+
+VALUE rb_processed_image_data(VALUE self)
+{
+	ProcessedImageNativeResource *p = get_processed_image(self);
+
+	return rb_str_new((const char *)p->data, p->data_size);
+}
+
+// pixel values are taken as stored, normalized to 0..1 (they are gamma
+// encoded unless the image was processed with gamma [1, 1])
+struct ColorPipeline {
+	bool has_matrix;
+	float columns[3][4];
+	std::vector<unsigned short> curve;
+	int cube;
+	std::vector<float> cube_data;
+};
+
+static void parse_color_matrix(VALUE matrix, ColorPipeline *pipeline)
+{
+	Check_Type(matrix, T_ARRAY);
+	if (RARRAY_LEN(matrix)!=3) {
+		rb_raise(rb_eArgError, "matrix must be 3x3");
+	}
+	for (int row=0; row<3; row++) {
+		VALUE values = rb_ary_entry(matrix, row);
+		Check_Type(values, T_ARRAY);
+		if (RARRAY_LEN(values)!=3) {
+			rb_raise(rb_eArgError, "matrix must be 3x3");
+		}
+		for (int col=0; col<3; col++) {
+			pipeline->columns[col][row] = NUM2DBL(rb_ary_entry(values, col));
+		}
+	}
+	for (int col=0; col<3; col++) {
+		pipeline->columns[col][3] = 0;
+	}
+	pipeline->has_matrix = true;
+}
+
+// a flat Array of 0..1 values is a tone curve; an Array of n^3 [r, g, b]
+// triples is a 3D LUT with red changing fastest, as in .cube files
+static void parse_color_lut(VALUE lut, int maxval, ColorPipeline *pipeline)
+{
+	Check_Type(lut, T_ARRAY);
+	long length = RARRAY_LEN(lut);
+	if (length<2) {
+		rb_raise(rb_eArgError, "lut needs at least 2 entries");
+	}
+
+	if (!RB_TYPE_P(rb_ary_entry(lut, 0), T_ARRAY)) {
+		std::vector<float> points(length);
+		for (long i=0; i<length; i++) {
+			points[i] = NUM2DBL(rb_ary_entry(lut, i));
+		}
+		pipeline->curve.resize(maxval + 1);
+		for (int v=0; v<=maxval; v++) {
+			float x = (float)v / maxval * (length - 1);
+			long i = (long)x<length - 1 ? (long)x : length - 2;
+			float f = x - i;
+			float y = (points[i] * (1 - f) + points[i + 1] * f) * maxval + 0.5f;
+			pipeline->curve[v] = y<0 ? 0 : maxval<y ? maxval : (unsigned short)y;
+		}
+		return;
+	}
+
+	int n = (int)round(cbrt((double)length));
+	if (n<2 || (long)n * n * n!=length) {
+		rb_raise(rb_eArgError, "3D lut needs n^3 entries");
+	}
+	pipeline->cube = n;
+	pipeline->cube_data.resize(length * 3);
+	for (long i=0; i<length; i++) {
+		VALUE rgb = rb_ary_entry(lut, i);
+		Check_Type(rgb, T_ARRAY);
+		if (RARRAY_LEN(rgb)!=3) {
+			rb_raise(rb_eArgError, "3D lut entries must be [r, g, b]");
+		}
+		for (int c=0; c<3; c++) {
+			pipeline->cube_data[i * 3 + c] = NUM2DBL(rb_ary_entry(rgb, c));
+		}
+	}
+}
+
+// trilinear lookup, v in 0..1
+static inline void sample_cube(const ColorPipeline &pipeline, const float v[3], float out[3])
+{
+	int n = pipeline.cube;
+	int i[3];
+	float t[3];
+	for (int c=0; c<3; c++) {
+		float x = (v[c]<0 ? 0 : 1<v[c] ? 1 : v[c]) * (n - 1);
+		i[c] = (int)x<n - 1 ? (int)x : n - 2;
+		t[c] = x - i[c];
+	}
+
+	const float *data = &pipeline.cube_data[0];
+	for (int c=0; c<3; c++) {
+		float acc = 0;
+		for (int corner=0; corner<8; corner++) {
+			int dr = corner & 1, dg = (corner>>1) & 1, db = (corner>>2) & 1;
+			float w = (dr ? t[0] : 1 - t[0]) * (dg ? t[1] : 1 - t[1]) * (db ? t[2] : 1 - t[2]);
+			size_t index = ((size_t)(i[2] + db) * n + (i[1] + dg)) * n + (i[0] + dr);
+			acc += w * data[index * 3 + c];
+		}
+		out[c] = acc;
+	}
+}
+
+template <typename T>
+static void apply_color_pipeline(T *data, int width, int height, int colors, int maxval, const ColorPipeline &pipeline)
+{
+	parallel_for(height, native_thread_count(), [&](int begin, int end, int t) {
+		float limit = (float)maxval;
+		for (int row=begin; row<end; row++) {
+			T *pixel = data + (size_t)row * width * colors;
+			for (int col=0; col<width; col++, pixel+=colors) {
+				int v[4] = { pixel[0], colors>1 ? pixel[1] : 0, colors>2 ? pixel[2] : 0, 0 };
+
+				if (pipeline.has_matrix) {
+#if defined(__SSE2__)
+					__m128 acc = _mm_mul_ps(_mm_loadu_ps(pipeline.columns[0]), _mm_set1_ps((float)v[0]));
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(pipeline.columns[1]), _mm_set1_ps((float)v[1])));
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(pipeline.columns[2]), _mm_set1_ps((float)v[2])));
+					acc = _mm_min_ps(_mm_max_ps(acc, _mm_setzero_ps()), _mm_set1_ps(limit));
+					_mm_storeu_si128((__m128i *)v, _mm_cvtps_epi32(acc));
+#elif defined(__ARM_NEON)
+					float32x4_t acc = vmulq_n_f32(vld1q_f32(pipeline.columns[0]), (float)v[0]);
+					acc = vmlaq_n_f32(acc, vld1q_f32(pipeline.columns[1]), (float)v[1]);
+					acc = vmlaq_n_f32(acc, vld1q_f32(pipeline.columns[2]), (float)v[2]);
+					acc = vminq_f32(vmaxq_f32(acc, vdupq_n_f32(0)), vdupq_n_f32(limit));
+					vst1q_s32(v, vcvtq_s32_f32(vaddq_f32(acc, vdupq_n_f32(0.5f))));
+#else
+					float out[3];
+					for (int c=0; c<3; c++) {
+						out[c] = pipeline.columns[0][c] * v[0] + pipeline.columns[1][c] * v[1] + pipeline.columns[2][c] * v[2];
+					}
+					for (int c=0; c<3; c++) {
+						v[c] = out[c]<0 ? 0 : limit<out[c] ? maxval : (int)(out[c] + 0.5f);
+					}
+#endif
+				}
+
+				if (!pipeline.curve.empty()) {
+					for (int c=0; c<colors; c++) {
+						v[c] = pipeline.curve[v[c]];
+					}
+				}
+
+				if (pipeline.cube) {
+					float in[3] = { v[0] / limit, v[1] / limit, v[2] / limit };
+					float out[3];
+					sample_cube(pipeline, in, out);
+					for (int c=0; c<3; c++) {
+						float x = out[c] * limit + 0.5f;
+						v[c] = x<0 ? 0 : limit<x ? maxval : (int)x;
+					}
+				}
+
+				for (int c=0; c<colors && c<3; c++) {
+					pixel[c] = v[c];
+				}
+			}
+		}
+	});
+}
+
+// in place: matrix, then the lut (tone curve or 3D)
+VALUE rb_processed_image_apply_color(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	ID kwargs[2] = { rb_intern("matrix"), rb_intern("lut") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
+
+	rb_check_frozen(self);
+	ProcessedImageNativeResource *p = get_processed_image(self);
+	if (!p || p->type!=LIBRAW_IMAGE_BITMAP || p->sample_format!=PROCESSED_IMAGE_UNSIGNED || (p->bits!=8 && p->bits!=16)) {
+		rb_raise(rb_eRuntimeError, "apply_color needs an 8 or 16 bit bitmap");
+	}
+	int maxval = (1<<p->bits) - 1;
+
+	ColorPipeline pipeline;
+	pipeline.has_matrix = false;
+	pipeline.cube = 0;
+	if (vals[0]!=Qundef && vals[0]!=Qnil) {
+		parse_color_matrix(vals[0], &pipeline);
+	}
+	if (vals[1]!=Qundef && vals[1]!=Qnil) {
+		parse_color_lut(vals[1], maxval, &pipeline);
+	}
+	if ((pipeline.has_matrix || pipeline.cube) && p->colors!=3) {
+		rb_raise(rb_eArgError, "matrix and 3D lut need a 3 channel image");
+	}
+
+	call_without_gvl([&]() {
+		if (p->bits==16) {
+			apply_color_pipeline((unsigned short *)p->data, p->width, p->height, p->colors, maxval, pipeline);
+		} else {
+			apply_color_pipeline(p->data, p->width, p->height, p->colors, maxval, pipeline);
+		}
+	});
+
+	return self;
+}
+
+// dcraw flip: 4 = transpose, 2 = flip rows, 1 = flip columns (applied in that order)
+void flip_point(int flip, int width, int height, int row, int col, int *srow, int *scol)
+{
+	if (flip & 4) {
+		int t = row;
+		row = col;
+		col = t;
+	}
+	if (flip & 2) {
+		row = height - 1 - row;
+	}
+	if (flip & 1) {
+		col = width - 1 - col;
+	}
+	*srow = row;
+	*scol = col;
+}
+
+// copy a w x h window of a bitmap and orient it, with the GVL released
+ProcessedImageNativeResource *copy_bitmap_region(const unsigned char *src, int src_width, int colors, int bits, int x, int y, int w, int h, int flip)
+{
+	int out_width = flip & 4 ? h : w;
+	int out_height = flip & 4 ? w : h;
+	ProcessedImageNativeResource *p = alloc_processed_image(out_width, out_height, colors, bits);
+	if (!p) {
+		return NULL;
+	}
+	size_t pixel = (size_t)colors * (bits / 8);
+	unsigned char *dst = p->data;
+
+	call_without_gvl([&]() {
+		parallel_for(out_height, native_thread_count(), [&](int begin, int end, int t) {
+			for (int row=begin; row<end; row++) {
+				unsigned char *out = dst + (size_t)row * out_width * pixel;
+				if (!flip) {
+					memcpy(out, src + ((size_t)(y + row) * src_width + x) * pixel, out_width * pixel);
+					continue;
+				}
+				for (int col=0; col<out_width; col++) {
+					int srow, scol;
+					flip_point(flip, w, h, row, col, &srow, &scol);
+					memcpy(out + col * pixel, src + ((size_t)(y + srow) * src_width + x + scol) * pixel, pixel);
+				}
+			}
+		});
+	});
+
+	return p;
+}
+
+// IEEE half, round to nearest even; inputs here are finite
+static inline unsigned short float_to_half(float f)
+{
+	unsigned x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned sign = (x>>16) & 0x8000;
+	int exp = (int)((x>>23) & 0xff) - 127 + 15;
+	unsigned mant = x & 0x7fffff;
+	if (31<=exp) {
+		return sign | 0x7c00;
+	}
+	if (exp<=0) {
+		if (exp<-10) {
+			return sign;
+		}
+		mant |= 0x800000;
+		unsigned shift = 14 - exp;
+		unsigned half = mant>>shift;
+		unsigned rest = mant & ((1u<<shift) - 1);
+		unsigned middle = 1u<<(shift - 1);
+		if (middle<rest || (rest==middle && (half & 1))) {
+			half++;
+		}
+		return sign | half;
+	}
+	unsigned half = sign | (exp<<10) | (mant>>13);
+	unsigned rest = mant & 0x1fff;
+	if (0x1000<rest || (rest==0x1000 && (half & 1))) {
+		half++;
+	}
+	return half;
+}
+
+// oriented size and sample count of the linear image
+static void linear_image_format(LibRaw *libraw, int *out_width, int *out_height, int *colors)
+{
+	libraw_image_sizes_t *sizes = &libraw->imgdata.sizes;
+	int flip = libraw->imgdata.params.user_flip>=0 ? libraw->imgdata.params.user_flip : sizes->flip;
+	int c = libraw->imgdata.idata.colors;
+	*colors = c<1 ? 1 : 4<c ? 4 : c;
+	*out_width = flip & 4 ? sizes->iheight : sizes->iwidth;
+	*out_height = flip & 4 ? sizes->iwidth : sizes->iheight;
+}
+
+// native threads only, callable without the GVL
+static void fill_linear_image(LibRaw *libraw, bool half, unsigned char *dst)
+{
+	libraw_image_sizes_t *sizes = &libraw->imgdata.sizes;
+	int flip = libraw->imgdata.params.user_flip>=0 ? libraw->imgdata.params.user_flip : sizes->flip;
+	int width = sizes->iwidth;
+	int height = sizes->iheight;
+	int out_width, out_height, colors;
+	linear_image_format(libraw, &out_width, &out_height, &colors);
+	const unsigned short (*image)[4] = libraw->imgdata.image;
+
+	parallel_for(out_height, native_thread_count(), [&](int begin, int end, int t) {
+		const float scale = 1.0f / 65535;
+		float buffer[4];
+		for (int row=begin; row<end; row++) {
+			for (int col=0; col<out_width; col++) {
+				int srow, scol;
+				flip_point(flip, width, height, row, col, &srow, &scol);
+				const unsigned short *src = image[(size_t)srow * width + scol];
+#if defined(__SSE2__)
+				__m128i wide = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)src), _mm_setzero_si128());
+				_mm_storeu_ps(buffer, _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(scale)));
+#elif defined(__ARM_NEON)
+				vst1q_f32(buffer, vmulq_n_f32(vcvtq_f32_u32(vmovl_u16(vld1_u16(src))), scale));
+#else
+				for (int c=0; c<4; c++) {
+					buffer[c] = src[c] * scale;
+				}
+#endif
+				size_t offset = ((size_t)row * out_width + col) * colors;
+				if (half) {
+					unsigned short *out = (unsigned short *)dst + offset;
+					for (int c=0; c<colors; c++) {
+						out[c] = float_to_half(buffer[c]);
+					}
+				} else {
+					memcpy((float *)dst + offset, buffer, colors * sizeof(float));
+				}
+			}
+		}
+	});
+}
+
+// scene-linear copy of LibRaw's 16 bit working image (white balance and
+// output matrix applied, no gamma or auto-bright), oriented like
+// dcraw_make_mem_image; 1.0 is the 16 bit full scale
+ProcessedImageNativeResource *linear_processed_image(LibRawNativeResource *owner, bool half, bool shared)
+{
+	LibRaw *libraw = owner->libraw;
+	int out_width, out_height, colors;
+	linear_image_format(libraw, &out_width, &out_height, &colors);
+
+	ProcessedImageNativeResource *p = shared ? alloc_shared_processed_image(out_width, out_height, colors, half ? 16 : 32, PROCESSED_IMAGE_FLOAT) : alloc_processed_image(out_width, out_height, colors, half ? 16 : 32);
+	if (!p) {
+		return NULL;
+	}
+	p->sample_format = PROCESSED_IMAGE_FLOAT;
+
+	call_without_gvl(owner, [&]() {
+		fill_linear_image(libraw, half, p->data);
+	});
+
+	return p;
+}
+
+
+// LibRaw::RawObject#tile_pyramid
+
+#ifdef HAVE_JPEGLIB_H
+struct JpegErrorManager {
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+};
+
+static void jpeg_error_longjmp(j_common_ptr cinfo)
+{
+	JpegErrorManager *err = (JpegErrorManager *)cinfo->err;
+	longjmp(err->jump, 1);
+}
+
+// plain C locals only: this function longjmps out of libjpeg on errors
+static bool encode_jpeg(const unsigned char *pixels, int width, int height, int colors, int quality, std::string *out)
+{
+	struct jpeg_compress_struct cinfo;
+	JpegErrorManager jerr;
+	unsigned char *mem = NULL;
+	unsigned long mem_size = 0;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpeg_error_longjmp;
+	if (setjmp(jerr.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		free(mem);
+		return false;
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &mem, &mem_size);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = colors;
+	cinfo.in_color_space = colors==1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		JSAMPROW row = (JSAMPROW)(pixels + (size_t)cinfo.next_scanline * width * colors);
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	out->assign((const char *)mem, mem_size);
+	free(mem);
+	return true;
+}
+#endif
+
+static bool encode_pnm(const unsigned char *pixels, int width, int height, int colors, std::string *out)
+{
+	char header[64];
+	int n = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", colors==1 ? 5 : 6, width, height);
+	out->assign(header, n);
+	out->append((const char *)pixels, (size_t)width * height * colors);
+	return true;
+}
+
+struct PyramidLevel {
+	int width;
+	int height;
+	std::vector<unsigned char> pixels;
+};
+
+// 2x2 box filter; odd edges reuse the last row/column
+static void downsample_level(const PyramidLevel &src, PyramidLevel &dst, int colors)
+{
+	dst.width = (src.width + 1) / 2;
+	dst.height = (src.height + 1) / 2;
+	dst.pixels.resize((size_t)dst.width * dst.height * colors);
+
+	parallel_for(dst.height, native_thread_count(), [&](int begin, int end, int t) {
+		for (int row=begin; row<end; row++) {
+			const unsigned char *r0 = &src.pixels[(size_t)(row * 2) * src.width * colors];
+			const unsigned char *r1 = row * 2 + 1<src.height ? r0 + (size_t)src.width * colors : r0;
+			unsigned char *out = &dst.pixels[(size_t)row * dst.width * colors];
+			for (int col=0; col<dst.width; col++) {
+				int c0 = col * 2 * colors;
+				int c1 = col * 2 + 1<src.width ? c0 + colors : c0;
+				for (int c=0; c<colors; c++) {
+					out[col * colors + c] = (r0[c0 + c] + r0[c1 + c] + r1[c0 + c] + r1[c1 + c] + 2) >> 2;
+				}
+			}
+		}
+	});
+}
+
+struct PyramidTile {
+	int level;
+	int col;
+	int row;
+	std::string name;
+	std::string data;
+};
+
+static void tar_octal(char *field, size_t size, unsigned long long value)
+{
+	snprintf(field, size, "%0*llo", (int)size - 1, value);
+}
+
+static std::string tar_header(const std::string &name, size_t size, time_t mtime)
+{
+	char block[512];
+	memset(block, 0, sizeof(block));
+	strncpy(block, name.c_str(), 100);
+	tar_octal(block + 100, 8, 0644);
+	tar_octal(block + 108, 8, 0);
+	tar_octal(block + 116, 8, 0);
+	tar_octal(block + 124, 12, size);
+	tar_octal(block + 136, 12, mtime);
+	block[156] = '0';
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	memset(block + 148, ' ', 8);
+	unsigned sum = 0;
+	for (int i=0; i<512; i++) {
+		sum += (unsigned char)block[i];
+	}
+	snprintf(block + 148, 8, "%06o", sum);
+
+	return std::string(block, sizeof(block));
+}
+
+static void write_tar_entry(VALUE io, const std::string &name, const std::string &data, time_t mtime)
+{
+	std::string entry = tar_header(name, data.size(), mtime);
+	entry.append(data);
+	entry.append((512 - data.size() % 512) % 512, '\0');
+	rb_funcall(io, rb_intern("write"), 1, rb_str_new(entry.data(), entry.size()));
+}
+
+static void make_directory(const std::string &path)
+{
+	if (mkdir(path.c_str(), 0755)!=0 && errno!=EEXIST) {
+		rb_sys_fail(path.c_str());
+	}
+}
+
+VALUE rb_raw_object_tile_pyramid(int argc, VALUE *argv, VALUE self)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	ID kwargs[6] = { rb_intern("io_or_dir"), rb_intern("tile_size"), rb_intern("format"), rb_intern("overlap"), rb_intern("quality"), rb_intern("name") };
+	VALUE vals[6] = { Qundef, Qundef, Qundef, Qundef, Qundef, Qundef };
+	rb_get_kwargs(opts, kwargs, 1, 5, vals);
+
+	VALUE target = vals[0];
+	int tile_size = vals[1]!=Qundef ? NUM2INT(vals[1]) : 256;
+	ID format = vals[2]!=Qundef ? SYM2ID(rb_to_symbol(vals[2])) : rb_intern("jpeg");
+	int overlap = vals[3]!=Qundef ? NUM2INT(vals[3]) : 0;
+	int quality = vals[4]!=Qundef ? NUM2INT(vals[4]) : 90;
+	std::string name = vals[5]!=Qundef ? StringValueCStr(vals[5]) : "image";
+
+	if (100<name.size() + 48) {
+		rb_raise(rb_eArgError, "name is too long");
+	}
+	if (tile_size<1 || overlap<0 || tile_size<=overlap) {
+		rb_raise(rb_eArgError, "invalid tile_size %d / overlap %d", tile_size, overlap);
+	}
+	if (quality<1 || 100<quality) {
+		rb_raise(rb_eArgError, "quality must be in 1..100");
+	}
+
+	bool jpeg = format==rb_intern("jpeg") || format==rb_intern("jpg");
+	if (!jpeg && format!=rb_intern("pnm")) {
+		rb_raise(rb_eArgError, "unsupported tile format :%s", rb_id2name(format));
+	}
+#ifndef HAVE_JPEGLIB_H
+	if (jpeg) {
+		rb_raise(rb_eNotImpError, "lib_raw was built without libjpeg; use format: :pnm");
+	}
+#endif
+
+	bool to_io = rb_respond_to(target, rb_intern("write"));
+	std::string dir;
+	if (!to_io) {
+		dir = StringValueCStr(target);
+	}
+
+	LibRaw *libraw = get_processed_lib_raw(self);
+	int ret = LIBRAW_SUCCESS;
+	libraw_processed_image_t *image = libraw->dcraw_make_mem_image(&ret);
+	check_errors(ret);
+	if (!image) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+	if (image->type!=LIBRAW_IMAGE_BITMAP || (image->colors!=1 && image->colors!=3)) {
+		LibRaw::dcraw_clear_mem(image);
+		rb_raise(rb_eRuntimeError, "tile_pyramid needs a 1 or 3 channel bitmap");
+	}
+
+	// DeepZoom levels: the last one is full size, level 0 is 1x1
+	int colors = image->colors;
+	int width = image->width;
+	int height = image->height;
+	int levels = 1;
+	while ((1<<(levels - 1))<width || (1<<(levels - 1))<height) {
+		levels++;
+	}
+
+	std::vector<PyramidLevel> pyramid;
+	std::vector<PyramidTile> tiles;
+	bool allocated = true;
+	call_without_gvl([&]() {
+		try {
+			pyramid.resize(levels);
+			PyramidLevel &top = pyramid[levels - 1];
+			top.width = width;
+			top.height = height;
+			top.pixels.resize((size_t)width * height * colors);
+			size_t count = (size_t)width * height * colors;
+			if (image->bits==16) {
+				const unsigned short *src = (const unsigned short *)image->data;
+				for (size_t i=0; i<count; i++) {
+					top.pixels[i] = src[i] >> 8;
+				}
+			} else {
+				memcpy(&top.pixels[0], image->data, count);
+			}
+		} catch (std::bad_alloc&) {
+			allocated = false;
+		}
+	});
+	LibRaw::dcraw_clear_mem(image);
+	if (!allocated) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+
+	const char *extension = jpeg ? "jpg" : (colors==1 ? "pgm" : "ppm");
+	call_without_gvl([&]() {
+		try {
+			for (int level=levels - 2; 0<=level; level--) {
+				downsample_level(pyramid[level + 1], pyramid[level], colors);
+			}
+			for (int level=0; level<levels; level++) {
+				int cols = (pyramid[level].width + tile_size - 1) / tile_size;
+				int rows = (pyramid[level].height + tile_size - 1) / tile_size;
+				for (int row=0; row<rows; row++) {
+					for (int col=0; col<cols; col++) {
+						PyramidTile tile;
+						tile.level = level;
+						tile.col = col;
+						tile.row = row;
+						tile.name = name + "_files/" + std::to_string(level) + "/" + std::to_string(col) + "_" + std::to_string(row) + "." + extension;
+						tiles.push_back(tile);
+					}
+				}
+			}
+		} catch (std::bad_alloc&) {
+			allocated = false;
+		}
+	});
+	if (!allocated) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+
+	if (!to_io) {
+		make_directory(dir);
+		make_directory(dir + "/" + name + "_files");
+		for (int level=0; level<levels; level++) {
+			make_directory(dir + "/" + name + "_files/" + std::to_string(level));
+		}
+	}
+
+	// tiles are cut, encoded and (for directories) written on native threads
+	std::atomic<int> failed_errno(0);
+	std::atomic<bool> failed_encode(false);
+	call_without_gvl([&]() {
+		std::atomic<size_t> next(0);
+		int threads = native_thread_count();
+		parallel_for(threads, threads, [&](int begin, int end, int t) {
+			std::vector<unsigned char> buffer;
+			for (size_t i=next++; i<tiles.size(); i=next++) {
+				PyramidTile &tile = tiles[i];
+				const PyramidLevel &level = pyramid[tile.level];
+				int x0 = tile.col * tile_size - (tile.col ? overlap : 0);
+				int y0 = tile.row * tile_size - (tile.row ? overlap : 0);
+				int x1 = (tile.col + 1) * tile_size + overlap;
+				int y1 = (tile.row + 1) * tile_size + overlap;
+				x1 = x1<level.width ? x1 : level.width;
+				y1 = y1<level.height ? y1 : level.height;
+				int w = x1 - x0;
+				int h = y1 - y0;
+
+				bool ok = false;
+				try {
+					buffer.resize((size_t)w * h * colors);
+					for (int row=0; row<h; row++) {
+						memcpy(&buffer[(size_t)row * w * colors], &level.pixels[((size_t)(y0 + row) * level.width + x0) * colors], (size_t)w * colors);
+					}
+#ifdef HAVE_JPEGLIB_H
+					ok = jpeg ? encode_jpeg(&buffer[0], w, h, colors, quality, &tile.data) : encode_pnm(&buffer[0], w, h, colors, &tile.data);
+#else
+					ok = encode_pnm(&buffer[0], w, h, colors, &tile.data);
+#endif
+				} catch (std::bad_alloc&) {
+					ok = false;
+				}
+				if (!ok) {
+					failed_encode = true;
+					continue;
+				}
+
+				if (!to_io) {
+					std::string path = dir + "/" + tile.name;
+					FILE *f = fopen(path.c_str(), "wb");
+					if (!f || fwrite(tile.data.data(), 1, tile.data.size(), f)!=tile.data.size()) {
+						failed_errno = errno ? errno : EIO;
+					}
+					if (f && fclose(f)!=0) {
+						failed_errno = errno;
+					}
+					std::string().swap(tile.data);
+				}
+			}
+		});
+	});
+	if (failed_encode) {
+		rb_raise(rb_eRuntimeError, "failed to encode pyramid tiles");
+	}
+	if (failed_errno) {
+		rb_syserr_fail(failed_errno, dir.c_str());
+	}
+
+	char dzi[512];
+	snprintf(dzi, sizeof(dzi),
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"%s\" Overlap=\"%d\" TileSize=\"%d\">\n"
+		"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+		"</Image>\n", extension, overlap, tile_size, width, height);
+
+	if (to_io) {
+		time_t now = time(NULL);
+		write_tar_entry(target, name + ".dzi", dzi, now);
+		for (size_t i=0; i<tiles.size(); i++) {
+			write_tar_entry(target, tiles[i].name, tiles[i].data, now);
+			std::string().swap(tiles[i].data);
+		}
+		std::string end(1024, '\0');
+		rb_funcall(target, rb_intern("write"), 1, rb_str_new(end.data(), end.size()));
+	} else {
+		std::string path = dir + "/" + name + ".dzi";
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f) {
+			rb_sys_fail(path.c_str());
+		}
+		size_t len = strlen(dzi);
+		bool written = fwrite(dzi, 1, len, f)==len;
+		if (fclose(f)!=0 || !written) {
+			rb_sys_fail(path.c_str());
+		}
+	}
+
+	VALUE result = rb_hash_new();
+	rb_hash_aset(result, ID2SYM(rb_intern("width")), INT2NUM(width));
+	rb_hash_aset(result, ID2SYM(rb_intern("height")), INT2NUM(height));
+	rb_hash_aset(result, ID2SYM(rb_intern("levels")), INT2NUM(levels));
+	rb_hash_aset(result, ID2SYM(rb_intern("tiles")), SIZET2NUM(tiles.size()));
+	return result;
+}
+
+
+// LibRaw::RawObject#renditions
+
+#ifdef HAVE_WEBP_ENCODE_H
+static bool encode_webp(const unsigned char *pixels, int width, int height, int colors, int quality, std::string *out)
+{
+	// libwebp takes RGB only
+	std::vector<unsigned char> rgb;
+	if (colors==1) {
+		rgb.resize((size_t)width * height * 3);
+		for (size_t i=0; i<(size_t)width * height; i++) {
+			rgb[i * 3] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = pixels[i];
+		}
+		pixels = &rgb[0];
+	}
+
+	uint8_t *mem = NULL;
+	size_t size = WebPEncodeRGB(pixels, width, height, width * 3, (float)quality, &mem);
+	if (!size) {
+		return false;
+	}
+	out->assign((const char *)mem, size);
+#ifdef HAVE_WEBPFREE
+	WebPFree(mem);
+#else
+	free(mem);
+#endif
+	return true;
+}
+#endif
+
+// per output pixel of one axis: the source span it covers, weighted by
+// coverage so that non-integer ratios still average the whole area
+struct AreaTaps {
+	std::vector<int> first;
+	std::vector<int> count;
+	std::vector<int> offset;
+	std::vector<float> weights;
+};
+
+static void area_taps(int src_size, int dst_size, AreaTaps &taps)
+{
+	double scale = (double)src_size / dst_size;
+	taps.first.resize(dst_size);
+	taps.count.resize(dst_size);
+	taps.offset.resize(dst_size);
+	taps.weights.clear();
+	for (int i=0; i<dst_size; i++) {
+		double x0 = i * scale;
+		double x1 = (i + 1) * scale;
+		int first = (int)x0;
+		int last = (int)ceil(x1);
+		last = last<src_size ? last : src_size;
+		taps.first[i] = first;
+		taps.count[i] = last - first;
+		taps.offset[i] = taps.weights.size();
+		for (int j=first; j<last; j++) {
+			double w = (j + 1<x1 ? j + 1 : x1) - (x0<j ? j : x0);
+			taps.weights.push_back((float)(w / scale));
+		}
+	}
+}
+
+// box filter with fractional edges: one output row at a time, the source
+// rows it covers summed first, then the columns. Downscaling only.
+static void resize_area(const PyramidLevel &src, PyramidLevel &dst, int colors)
+{
+	AreaTaps cols, rows;
+	area_taps(src.width, dst.width, cols);
+	area_taps(src.height, dst.height, rows);
+	dst.pixels.resize((size_t)dst.width * dst.height * colors);
+
+	parallel_for(dst.height, native_thread_count(), [&](int begin, int end, int t) {
+		std::vector<float> line((size_t)src.width * colors);
+		for (int row=begin; row<end; row++) {
+			std::fill(line.begin(), line.end(), 0.0f);
+			for (int k=0; k<rows.count[row]; k++) {
+				float w = rows.weights[rows.offset[row] + k];
+				const unsigned char *in = &src.pixels[(size_t)(rows.first[row] + k) * src.width * colors];
+				for (size_t i=0; i<line.size(); i++) {
+					line[i] += in[i] * w;
+				}
+			}
+			unsigned char *out = &dst.pixels[(size_t)row * dst.width * colors];
+			for (int col=0; col<dst.width; col++) {
+				for (int c=0; c<colors; c++) {
+					float sum = 0;
+					for (int k=0; k<cols.count[col]; k++) {
+						sum += line[(size_t)(cols.first[col] + k) * colors + c] * cols.weights[cols.offset[col] + k];
+					}
+					int v = (int)(sum + 0.5f);
+					out[col * colors + c] = v<255 ? v : 255;
+				}
+			}
+		}
+	});
+}
+
+enum RenditionFormat {
+	RENDITION_JPEG,
+	RENDITION_WEBP,
+	RENDITION_PNM
+};
+
+struct Rendition {
+	int size;
+	int format;
+	int quality;
+	int level;
+	std::string data;
+};
+
+static void get_rendition(VALUE spec, Rendition *r)
+{
+	Check_Type(spec, T_HASH);
+	VALUE size = rb_hash_aref(spec, ID2SYM(rb_intern("size")));
+	VALUE format = rb_hash_aref(spec, ID2SYM(rb_intern("format")));
+	VALUE quality = rb_hash_aref(spec, ID2SYM(rb_intern("quality")));
+
+	r->size = size!=Qnil ? NUM2INT(size) : 0;
+	r->quality = quality!=Qnil ? NUM2INT(quality) : 90;
+	if (size!=Qnil && r->size<1) {
+		rb_raise(rb_eArgError, "size must be positive");
+	}
+	if (r->quality<1 || 100<r->quality) {
+		rb_raise(rb_eArgError, "quality must be in 1..100");
+	}
+
+	ID id = format!=Qnil ? SYM2ID(rb_to_symbol(format)) : rb_intern("jpeg");
+	if (id==rb_intern("jpeg") || id==rb_intern("jpg")) {
+		r->format = RENDITION_JPEG;
+#ifndef HAVE_JPEGLIB_H
+		rb_raise(rb_eNotImpError, "lib_raw was built without libjpeg");
+#endif
+	} else if (id==rb_intern("webp")) {
+		r->format = RENDITION_WEBP;
+#ifndef HAVE_WEBP_ENCODE_H
+		rb_raise(rb_eNotImpError, "lib_raw was built without libwebp");
+#endif
+	} else if (id==rb_intern("pnm")) {
+		r->format = RENDITION_PNM;
+	} else {
+		rb_raise(rb_eArgError, "unsupported rendition format :%s", rb_id2name(id));
+	}
+}
+
+static const char *rendition_format_name(int format)
+{
+	return format==RENDITION_JPEG ? "jpeg" : format==RENDITION_WEBP ? "webp" : "pnm";
+}
+
+// dcraw_process for the largest rendition: target_size on the long edge
+// lets the plan drop to half_size when no output needs full resolution
+static void process_for_renditions(VALUE self, VALUE param, const std::vector<Rendition> &renditions)
+{
+	int largest = 0;
+	for (size_t i=0; i<renditions.size(); i++) {
+		if (!renditions[i].size) {
+			largest = 0;
+			break;
+		}
+		largest = largest<renditions[i].size ? renditions[i].size : largest;
+	}
+
+	VALUE opts = rb_hash_new();
+	if (largest) {
+		LibRaw *libraw = get_lib_raw(self);
+		libraw_image_sizes_t *sizes = &libraw->imgdata.rawdata.sizes;
+		int flip = get_output_params(param)->user_flip;
+		flip = flip>=0 ? flip : sizes->flip;
+		bool landscape = (sizes->height<=sizes->width)!=((flip & 4)!=0);
+		VALUE target = landscape ? rb_assoc_new(INT2NUM(largest), Qnil) : rb_assoc_new(Qnil, INT2NUM(largest));
+		rb_hash_aset(opts, ID2SYM(rb_intern("target_size")), target);
+	}
+	VALUE args[2] = { param, opts };
+	rb_funcallv_kw(self, rb_intern("dcraw_process"), 2, args, RB_PASS_KEYWORDS);
+}
+
+// renditions([{size:, format:, quality:}, ...], param=nil) -> [Rendition, ...]
+// size is the long edge (nil for full size), format :jpeg, :webp or :pnm.
+// With param, runs dcraw_process itself, planned for the largest output.
+// Each size is resampled from the nearest larger one and all of them are
+// encoded at once on native threads.
+VALUE rb_raw_object_renditions(int argc, VALUE *argv, VALUE self)
+{
+	VALUE specs, param = Qnil;
+	rb_scan_args(argc, argv, "11", &specs, &param);
+	Check_Type(specs, T_ARRAY);
+
+	long n = RARRAY_LEN(specs);
+	std::vector<Rendition> renditions(n);
+	for (long i=0; i<n; i++) {
+		get_rendition(rb_ary_entry(specs, i), &renditions[i]);
+	}
+	if (param!=Qnil) {
+		process_for_renditions(self, param, renditions);
+	}
+
+	LibRaw *libraw = get_processed_lib_raw(self);
+	int width, height, colors, bits;
+	libraw->get_mem_image_format(&width, &height, &colors, &bits);
+	if (colors!=1 && colors!=3) {
+		rb_raise(rb_eRuntimeError, "renditions need a 1 or 3 channel bitmap");
+	}
+
+	// largest first, so each one can start from the one before it
+	std::vector<int> order(n);
+	for (long i=0; i<n; i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		int sa = renditions[a].size ? renditions[a].size : INT_MAX;
+		int sb = renditions[b].size ? renditions[b].size : INT_MAX;
+		return sb<sa;
+	});
+
+	std::vector<PyramidLevel> levels;
+	int ret = LIBRAW_SUCCESS;
+	call_without_gvl(get_lib_raw_resource(self), [&]() {
+		try {
+			levels.reserve(n + 1);
+			levels.resize(1);
+			PyramidLevel &top = levels[0];
+			top.width = width;
+			top.height = height;
+			top.pixels.resize((size_t)width * height * colors);
+			if (bits==16) {
+				std::vector<unsigned short> wide((size_t)width * height * colors);
+				ret = libraw->copy_mem_image(&wide[0], width * colors * 2, 0);
+				for (size_t i=0; i<wide.size(); i++) {
+					top.pixels[i] = wide[i] >> 8;
+				}
+			} else {
+				ret = libraw->copy_mem_image(&top.pixels[0], width * colors, 0);
+			}
+			if (ret!=LIBRAW_SUCCESS) {
+				return;
+			}
+
+			for (long i=0; i<n; i++) {
+				Rendition &r = renditions[order[i]];
+				const PyramidLevel &from = levels.back();
+				int longest = width<height ? height : width;
+				if (!r.size || longest<=r.size) {
+					r.level = 0;
+					continue;
+				}
+				double scale = (double)r.size / longest;
+				int w = (int)(width * scale + 0.5);
+				int h = (int)(height * scale + 0.5);
+				w = w<1 ? 1 : w<from.width ? w : from.width;
+				h = h<1 ? 1 : h<from.height ? h : from.height;
+				if (w==from.width && h==from.height) {
+					r.level = levels.size() - 1;
+					continue;
+				}
+				levels.push_back(PyramidLevel());
+				PyramidLevel &to = levels.back();
+				to.width = w;
+				to.height = h;
+				resize_area(levels[levels.size() - 2], to, colors);
+				r.level = levels.size() - 1;
+			}
+		} catch (std::bad_alloc&) {
+			ret = LIBRAW_UNSUFFICIENT_MEMORY;
+		}
+	});
+	check_errors(ret);
+
+	std::atomic<bool> failed_encode(false);
+	call_without_gvl([&]() {
+		std::atomic<long> next(0);
+		int threads = native_thread_count();
+		threads = n<threads ? (int)n : threads;
+		parallel_for(threads, threads, [&](int begin, int end, int t) {
+			for (long i=next++; i<n; i=next++) {
+				Rendition &r = renditions[order[i]];
+				const PyramidLevel &level = levels[r.level];
+				bool ok = false;
+				try {
+					switch (r.format) {
+#ifdef HAVE_JPEGLIB_H
+					case RENDITION_JPEG:
+						ok = encode_jpeg(&level.pixels[0], level.width, level.height, colors, r.quality, &r.data);
+						break;
+#endif
+#ifdef HAVE_WEBP_ENCODE_H
+					case RENDITION_WEBP:
+						ok = encode_webp(&level.pixels[0], level.width, level.height, colors, r.quality, &r.data);
+						break;
+#endif
+					default:
+						ok = encode_pnm(&level.pixels[0], level.width, level.height, colors, &r.data);
+						break;
+					}
+				} catch (std::bad_alloc&) {
+					ok = false;
+				}
+				if (!ok) {
+					failed_encode = true;
+				}
+			}
+		});
+	});
+	if (failed_encode) {
+		rb_raise(rb_eRuntimeError, "failed to encode renditions");
+	}
+
+	VALUE result = rb_ary_new2(n);
+	for (long i=0; i<n; i++) {
+		Rendition &r = renditions[i];
+		const PyramidLevel &level = levels[r.level];
+		VALUE data = rb_str_new(r.data.data(), r.data.size());
+		std::string().swap(r.data);
+		rb_ary_push(result, rb_struct_new(rb_cRendition, r.size ? INT2NUM(r.size) : Qnil, ID2SYM(rb_intern(rendition_format_name(r.format))), INT2NUM(level.width), INT2NUM(level.height), data));
+	}
+	return result;
+}
+
+
+// LibRaw::RawObject#save_unpacked
+
+// Dump of the unpacked sensor data plus the imgdata state dcraw_process
+// starts from. Header, UnpackedState, the LZ4 block sizes when compressed,
+// then the samples at a page aligned offset, so an uncompressed dump can
+// be read (or mapped) straight into place. LibRaw structs are stored
+// as-is; the header pins the LibRaw version and state size.
+
+#define UNPACKED_MAGIC "LRUNPK01"
+#define UNPACKED_VERSION 1
+#define UNPACKED_ALIGN 4096
+#define UNPACKED_BLOCK_SIZE ((size_t)4 << 20)
+#define UNPACKED_LZ4 1
+
+enum UnpackedLayout {
+	UNPACKED_BAYER,
+	UNPACKED_COLOR4,
+	UNPACKED_COLOR3
+};
+
+struct UnpackedHeader {
+	char magic[8];
+	unsigned version;
+	unsigned libraw_version;
+	unsigned state_size;
+	unsigned flags;
+	unsigned long long data_offset;
+	unsigned long long data_size;
+	unsigned long long block_size;
+	unsigned long long block_count;
+	unsigned long long reserved[4];
+};
+
+struct UnpackedState {
+	unsigned layout;
+	unsigned process_warnings;
+	libraw_iparams_t idata;
+	libraw_image_sizes_t sizes;
+	libraw_colordata_t color;
+	libraw_imgother_t other;
+	libraw_lensinfo_t lens;
+	libraw_iparams_t raw_iparams;
+	libraw_image_sizes_t raw_sizes;
+	libraw_internal_output_params_t raw_ioparams;
+	libraw_colordata_t raw_color;
+};
+
+// a path is read and written natively without the GVL, anything else
+// through its read / write methods
+struct UnpackedStream {
+	int fd;
+	VALUE io;
+};
+
+static void open_unpacked_stream(VALUE target, bool write, UnpackedStream *s)
+{
+	s->fd = -1;
+	s->io = Qnil;
+	if (rb_respond_to(target, rb_intern(write ? "write" : "read"))) {
+		s->io = target;
+		return;
+	}
+	VALUE path = rb_file_expand_path(rb_obj_as_string(target), Qnil);
+	s->fd = open(RSTRING_PTR(path), write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+	if (s->fd<0) {
+		rb_sys_fail(RSTRING_PTR(path));
+	}
+}
+
+static void close_unpacked_stream(UnpackedStream *s)
+{
+	if (0<=s->fd) {
+		close(s->fd);
+		s->fd = -1;
+	}
+}
+
+static void unpacked_write(UnpackedStream *s, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size) {
+		size_t n = size<UNPACKED_BLOCK_SIZE ? size : UNPACKED_BLOCK_SIZE;
+		if (0<=s->fd) {
+			ssize_t written = 0;
+			call_without_gvl([&]() {
+				written = write(s->fd, p, n);
+			});
+			if (written<0) {
+				if (errno==EINTR) {
+					continue;
+				}
+				rb_sys_fail("save_unpacked");
+			}
+			n = written;
+		} else {
+			rb_funcall(s->io, rb_intern("write"), 1, rb_str_new(p, n));
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+static void unpacked_read(UnpackedStream *s, void *data, size_t size)
+{
+	char *p = (char *)data;
+	while (size) {
+		size_t n = size<UNPACKED_BLOCK_SIZE ? size : UNPACKED_BLOCK_SIZE;
+		if (0<=s->fd) {
+			ssize_t got = 0;
+			call_without_gvl([&]() {
+				got = read(s->fd, p, n);
+			});
+			if (got<0) {
+				if (errno==EINTR) {
+					continue;
+				}
+				rb_sys_fail("load_unpacked");
+			}
+			n = got;
+		} else {
+			VALUE chunk = rb_funcall(s->io, rb_intern("read"), 1, SIZET2NUM(n));
+			n = chunk!=Qnil ? RSTRING_LEN(StringValue(chunk)) : 0;
+			memcpy(p, n ? RSTRING_PTR(chunk) : p, n);
+		}
+		if (!n) {
+			rb_raise(rb_eRawError, "truncated unpacked dump");
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+static size_t unpacked_data_offset(const UnpackedHeader &header)
+{
+	size_t size = sizeof(UnpackedHeader) + header.state_size;
+	if (header.flags & UNPACKED_LZ4) {
+		size += header.block_count * sizeof(unsigned long long);
+	}
+	return (size + UNPACKED_ALIGN - 1) / UNPACKED_ALIGN * UNPACKED_ALIGN;
+}
+
+// everything save_unpacked and load_unpacked hold while the stream can
+// raise; unpacked_job_ensure releases it on the way out either way
+struct UnpackedJob {
+	VALUE obj;
+	LibRawNativeResource *owner;
+	VALUE target;
+	bool compress;
+	UnpackedStream stream;
+	UnpackedHeader header;
+	UnpackedState *state;
+	std::vector<unsigned long long> block_sizes;
+	char *packed;
+};
+
+static VALUE unpacked_job_ensure(VALUE arg)
+{
+	UnpackedJob *job = (UnpackedJob *)arg;
+	if (job->owner) {
+		__atomic_sub_fetch(&job->owner->busy, 1, __ATOMIC_RELEASE);
+		job->owner = NULL;
+	}
+	close_unpacked_stream(&job->stream);
+	xfree(job->state);
+	job->state = NULL;
+	free(job->packed);
+	job->packed = NULL;
+	// the job's frame is unwound by longjmp, so its destructor never runs
+	std::vector<unsigned long long>().swap(job->block_sizes);
+	return Qnil;
+}
+
+static VALUE save_unpacked_body(VALUE arg)
+{
+	UnpackedJob *job = (UnpackedJob *)arg;
+	UnpackedHeader &header = job->header;
+	LibRaw *libraw = get_lib_raw(job->obj);
+	libraw_rawdata_t *raw = &libraw->imgdata.rawdata;
+
+	UnpackedState *state = job->state = ZALLOC(UnpackedState);
+	state->layout = raw->raw_image ? UNPACKED_BAYER : raw->color4_image ? UNPACKED_COLOR4 : UNPACKED_COLOR3;
+	state->process_warnings = libraw->imgdata.process_warnings;
+	state->idata = libraw->imgdata.idata;
+	state->sizes = libraw->imgdata.sizes;
+	state->color = libraw->imgdata.color;
+	state->other = libraw->imgdata.other;
+	state->lens = libraw->imgdata.lens;
+	state->raw_iparams = raw->iparams;
+	state->raw_sizes = raw->sizes;
+	state->raw_ioparams = raw->ioparams;
+	state->raw_color = raw->color;
+	const unsigned char *data = (const unsigned char *)(raw->raw_image ? (void *)raw->raw_image : raw->color4_image ? (void *)raw->color4_image : (void *)raw->color3_image);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, UNPACKED_MAGIC, sizeof(header.magic));
+	header.version = UNPACKED_VERSION;
+	header.libraw_version = LIBRAW_VERSION;
+	header.state_size = sizeof(UnpackedState);
+	header.flags = job->compress ? UNPACKED_LZ4 : 0;
+	header.data_size = (size_t)raw->sizes.raw_pitch * raw->sizes.raw_height;
+	header.block_size = UNPACKED_BLOCK_SIZE;
+	header.block_count = (header.data_size + UNPACKED_BLOCK_SIZE - 1) / UNPACKED_BLOCK_SIZE;
+	header.data_offset = unpacked_data_offset(header);
+
+	std::vector<unsigned long long> &block_sizes = job->block_sizes;
+	size_t bound = 0;
+#ifdef HAVE_LZ4_H
+	if (job->compress) {
+		bound = LZ4_compressBound(UNPACKED_BLOCK_SIZE);
+		char *packed = job->packed = (char *)malloc(bound * header.block_count);
+		if (!packed) {
+			check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+		}
+		block_sizes.resize(header.block_count);
+		call_without_gvl([&]() {
+			parallel_for(header.block_count, native_thread_count(), [&](int begin, int end, int t) {
+				for (int i=begin; i<end; i++) {
+					size_t offset = (size_t)i * UNPACKED_BLOCK_SIZE;
+					size_t size = header.data_size - offset<UNPACKED_BLOCK_SIZE ? header.data_size - offset : UNPACKED_BLOCK_SIZE;
+					block_sizes[i] = LZ4_compress_default((const char *)data + offset, packed + (size_t)i * bound, size, bound);
+				}
+			});
+		});
+		for (size_t i=0; i<block_sizes.size(); i++) {
+			if (!block_sizes[i]) {
+				rb_raise(rb_eRawError, "LZ4 compression failed");
+			}
+		}
+	}
+#endif
+
+	UnpackedStream *stream = &job->stream;
+	open_unpacked_stream(job->target, true, stream);
+	unpacked_write(stream, &header, sizeof(header));
+	unpacked_write(stream, state, sizeof(UnpackedState));
+	size_t written = sizeof(header) + sizeof(UnpackedState);
+	if (job->compress) {
+		unpacked_write(stream, &block_sizes[0], block_sizes.size() * sizeof(unsigned long long));
+		written += block_sizes.size() * sizeof(unsigned long long);
+	}
+	static const char padding[UNPACKED_ALIGN] = { 0 };
+	unpacked_write(stream, padding, header.data_offset - written);
+	if (job->compress) {
+		for (size_t i=0; i<block_sizes.size(); i++) {
+			unpacked_write(stream, job->packed + i * bound, block_sizes[i]);
+		}
+	} else {
+		unpacked_write(stream, data, header.data_size);
+	}
+	if (0<=stream->fd) {
+		int fd = stream->fd;
+		stream->fd = -1;
+		if (close(fd)!=0) {
+			rb_sys_fail("save_unpacked");
+		}
+	}
+
+	return job->obj;
+}
+
+// save_unpacked(path_or_io, compress: false) -> self
+// compress: LZ4 in independent blocks, compressed on native threads
+VALUE rb_raw_object_save_unpacked(int argc, VALUE *argv, VALUE self)
+{
+	VALUE target, opts;
+	rb_scan_args(argc, argv, "1:", &target, &opts);
+
+	ID kwargs[1] = { rb_intern("compress") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	bool compress = vals[0]!=Qundef && RTEST(vals[0]);
+#ifndef HAVE_LZ4_H
+	if (compress) {
+		rb_raise(rb_eNotImpError, "lib_raw was built without liblz4");
+	}
+#endif
+
+	LibRaw *libraw = get_lib_raw(self);
+	libraw_rawdata_t *raw = get_unpacked_rawdata(libraw);
+	// these decoders leave state for dcraw_process outside imgdata (fuji
+	// SuperCCD layout in unpacker_data, which the dump does not carry)
+	if (libraw->is_phaseone_compressed() || libraw->is_sraw() || raw->iparams.is_foveon || raw->ph1_cblack || raw->ph1_rblack || raw->ioparams.fuji_width) {
+		rb_raise(rb_eNotImpError, "save_unpacked does not support %s %s raw data", raw->iparams.make, raw->iparams.model);
+	}
+
+	// the samples are read with the GVL released and between the calls to
+	// an IO's write, so the object stays busy until the dump is written
+	UnpackedJob job;
+	job.obj = self;
+	job.owner = get_lib_raw_resource(self);
+	job.target = target;
+	job.compress = compress;
+	job.stream.fd = -1;
+	job.stream.io = Qnil;
+	job.state = NULL;
+	job.packed = NULL;
+	__atomic_add_fetch(&job.owner->busy, 1, __ATOMIC_ACQUIRE);
+	return rb_ensure(save_unpacked_body, (VALUE)&job, unpacked_job_ensure, (VALUE)&job);
+}
+
+static VALUE load_unpacked_body(VALUE arg)
+{
+	UnpackedJob *job = (UnpackedJob *)arg;
+	UnpackedHeader &header = job->header;
+	UnpackedStream *stream = &job->stream;
+	open_unpacked_stream(job->target, false, stream);
+
+	unpacked_read(stream, &header, sizeof(header));
+	bool valid = memcmp(header.magic, UNPACKED_MAGIC, sizeof(header.magic))==0
+		&& header.version==UNPACKED_VERSION
+		&& header.libraw_version==(unsigned)LIBRAW_VERSION
+		&& header.state_size==sizeof(UnpackedState)
+		&& header.block_size==UNPACKED_BLOCK_SIZE
+		&& header.block_count==(header.data_size + UNPACKED_BLOCK_SIZE - 1) / UNPACKED_BLOCK_SIZE
+		&& header.data_offset==unpacked_data_offset(header);
+	if (!valid) {
+		rb_raise(rb_eRawError, "not an unpacked dump of this LibRaw version");
+	}
+#ifndef HAVE_LZ4_H
+	if (header.flags & UNPACKED_LZ4) {
+		rb_raise(rb_eNotImpError, "lib_raw was built without liblz4");
+	}
+#endif
+
+	VALUE obj = job->obj = rb_class_new_instance(0, NULL, rb_cRawObject);
+	LibRaw *libraw = get_lib_raw(obj);
+	libraw_rawdata_t *raw = &libraw->imgdata.rawdata;
+
+	UnpackedState *state = job->state = ALLOC(UnpackedState);
+	unpacked_read(stream, state, sizeof(UnpackedState));
+	libraw->imgdata.process_warnings = state->process_warnings;
+	libraw->imgdata.idata = state->idata;
+	libraw->imgdata.sizes = state->sizes;
+	libraw->imgdata.color = state->color;
+	libraw->imgdata.other = state->other;
+	libraw->imgdata.lens = state->lens;
+	raw->iparams = state->raw_iparams;
+	raw->sizes = state->raw_sizes;
+	raw->ioparams = state->raw_ioparams;
+	raw->color = state->raw_color;
+	int layout = state->layout;
+
+	// pointers of the saving process
+	libraw->imgdata.idata.xmpdata = NULL;
+	libraw->imgdata.idata.xmplen = 0;
+	raw->iparams.xmpdata = NULL;
+	raw->iparams.xmplen = 0;
+	libraw->imgdata.color.profile = NULL;
+	libraw->imgdata.color.profile_length = 0;
+	raw->color.profile = NULL;
+	raw->color.profile_length = 0;
+
+	size_t pitch = raw->sizes.raw_width * (layout==UNPACKED_BAYER ? 2 : layout==UNPACKED_COLOR4 ? 8 : 6);
+	if (layout<UNPACKED_BAYER || layout>UNPACKED_COLOR3 || raw->sizes.raw_pitch<pitch || header.data_size!=(size_t)raw->sizes.raw_pitch * raw->sizes.raw_height) {
+		rb_raise(rb_eRawError, "corrupt unpacked dump");
+	}
+	// save_unpacked refuses these; the layout they need is not in the dump
+	if (raw->ioparams.fuji_width) {
+		rb_raise(rb_eNotImpError, "load_unpacked does not support fuji SuperCCD raw data");
+	}
+
+	std::vector<unsigned long long> &block_sizes = job->block_sizes;
+	block_sizes.resize(header.flags & UNPACKED_LZ4 ? header.block_count : 0);
+	size_t packed_size = 0;
+	for (size_t i=0; i<block_sizes.size(); i++) {
+		unpacked_read(stream, &block_sizes[i], sizeof(unsigned long long));
+		packed_size += block_sizes[i];
+	}
+	size_t offset = sizeof(header) + header.state_size + block_sizes.size() * sizeof(unsigned long long);
+	char padding[UNPACKED_ALIGN];
+	unpacked_read(stream, padding, header.data_offset - offset);
+
+	// LibRaw::malloc throws instead of returning NULL; its memmgr frees
+	// plain malloc blocks on recycle just the same
+	raw->raw_alloc = ::malloc(header.data_size);
+	if (!raw->raw_alloc) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+	if (layout==UNPACKED_BAYER) {
+		raw->raw_image = (ushort *)raw->raw_alloc;
+	} else if (layout==UNPACKED_COLOR4) {
+		raw->color4_image = (ushort (*)[4])raw->raw_alloc;
+	} else {
+		raw->color3_image = (ushort (*)[3])raw->raw_alloc;
+	}
+
+	if (!(header.flags & UNPACKED_LZ4)) {
+		unpacked_read(stream, raw->raw_alloc, header.data_size);
+	}
+#ifdef HAVE_LZ4_H
+	else {
+		char *packed = job->packed = (char *)malloc(packed_size ? packed_size : 1);
+		if (!packed) {
+			check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+		}
+		unpacked_read(stream, packed, packed_size);
+		std::atomic<bool> failed(false);
+		call_without_gvl([&]() {
+			size_t start = 0;
+			std::vector<size_t> starts(block_sizes.size());
+			for (size_t i=0; i<starts.size(); i++) {
+				starts[i] = start;
+				start += block_sizes[i];
+			}
+			parallel_for(block_sizes.size(), native_thread_count(), [&](int begin, int end, int t) {
+				for (int i=begin; i<end; i++) {
+					size_t offset = (size_t)i * UNPACKED_BLOCK_SIZE;
+					int size = header.data_size - offset<UNPACKED_BLOCK_SIZE ? header.data_size - offset : UNPACKED_BLOCK_SIZE;
+					if (block_sizes[i]>(unsigned long long)INT_MAX || LZ4_decompress_safe(packed + starts[i], (char *)raw->raw_alloc + offset, block_sizes[i], size)!=size) {
+						failed = true;
+					}
+				}
+			});
+		});
+		if (failed) {
+			rb_raise(rb_eRawError, "corrupt unpacked dump");
+		}
+	}
+#endif
+
+	libraw->imgdata.progress_flags = LIBRAW_PROGRESS_START | LIBRAW_PROGRESS_OPEN | LIBRAW_PROGRESS_IDENTIFY | LIBRAW_PROGRESS_SIZE_ADJUST | LIBRAW_PROGRESS_LOAD_RAW;
+	LibRawInternals::restore_output_params(libraw);
+	apply_rawobject(obj);
+
+	return obj;
+}
+
+// load_unpacked(path_or_io) -> RawObject, unpacked and ready for
+// dcraw_process; there is no source file behind it
+VALUE rb_raw_object_s_load_unpacked(VALUE klass, VALUE source)
+{
+	UnpackedJob job;
+	job.obj = Qnil;
+	job.owner = NULL;
+	job.target = source;
+	job.compress = false;
+	job.stream.fd = -1;
+	job.stream.io = Qnil;
+	job.state = NULL;
+	job.packed = NULL;
+	return rb_ensure(load_unpacked_body, (VALUE)&job, unpacked_job_ensure, (VALUE)&job);
+}
+
+
+// LibRaw::Calibration
+
+void calibration_native_resource_delete(CalibrationNativeResource * p)
+{
+	xfree(p->dark);
+	xfree(p->bad_pixels);
+	xfree(p);
+}
+
+static size_t calibration_native_resource_size(const void *p)
+{
+	const CalibrationNativeResource *cal = (const CalibrationNativeResource *)p;
+	return sizeof(*cal) + (size_t)cal->width * cal->height * 2 + cal->bad_pixel_count * sizeof(int) * 3;
+}
+
+// never written after load, so a frozen Calibration is shareable across Ractors
+static const rb_data_type_t calibration_native_resource_type = {
+	"LibRaw::Calibration::NativeResource",
+	{ 0, (RUBY_DATA_FUNC)calibration_native_resource_delete, calibration_native_resource_size, },
+	0, 0,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+	RUBY_TYPED_FROZEN_SHAREABLE
+#else
+	0
+#endif
+};
+
+CalibrationNativeResource* get_calibration(VALUE self)
+{
+	if (!rb_obj_is_kind_of(self, rb_cCalibration)) {
+		rb_raise(rb_eTypeError, "expected LibRaw::Calibration");
+	}
+	VALUE resource = rb_iv_get(self, "calibration_native_resource");
+	if (resource==Qnil) {
+		return NULL;
+	}
+
+	CalibrationNativeResource *p = NULL;
+	TypedData_Get_Struct(resource, CalibrationNativeResource, &calibration_native_resource_type, p);
+	return p;
+}
+
+// next header token of a PNM file, skipping whitespace and comments
+static bool read_pnm_number(FILE *f, int *value)
+{
+	int c = fgetc(f);
+	while (c=='#' || isspace(c)) {
+		if (c=='#') {
+			while (c!=EOF && c!='\n') {
+				c = fgetc(f);
+			}
+		}
+		c = fgetc(f);
+	}
+	if (!isdigit(c)) {
+		return false;
+	}
+	*value = 0;
+	while (isdigit(c)) {
+		*value = *value * 10 + c - '0';
+		c = fgetc(f);
+	}
+	return isspace(c);
+}
+
+// binary PGM as written by dcraw -D -4 -j -t 0, one sample per visible pixel
+static void load_dark_frame(CalibrationNativeResource *cal, const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		rb_sys_fail(path);
+	}
+
+	int width = 0, height = 0, maxval = 0;
+	bool ok = fgetc(f)=='P' && fgetc(f)=='5' && read_pnm_number(f, &width) && read_pnm_number(f, &height) && read_pnm_number(f, &maxval);
+	if (!ok || width<1 || height<1 || maxval<1 || 65535<maxval) {
+		fclose(f);
+		rb_raise(rb_eArgError, "%s is not a binary PGM", path);
+	}
+
+	size_t count = (size_t)width * height;
+	size_t depth = maxval<256 ? 1 : 2;
+	std::vector<unsigned char> bytes;
+	try {
+		bytes.resize(count * depth);
+	} catch (std::bad_alloc&) {
+		fclose(f);
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+	size_t read = fread(&bytes[0], 1, bytes.size(), f);
+	fclose(f);
+	if (read!=bytes.size()) {
+		rb_raise(rb_eArgError, "%s is truncated", path);
+	}
+
+	cal->dark = ALLOC_N(unsigned short, count);
+	cal->width = width;
+	cal->height = height;
+	for (size_t i=0; i<count; i++) {
+		cal->dark[i] = depth==1 ? bytes[i] : (bytes[i * 2]<<8 | bytes[i * 2 + 1]);
+	}
+}
+
+// dcraw's format: "col row time" per line, # starts a comment
+static void load_bad_pixels(CalibrationNativeResource *cal, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		rb_sys_fail(path);
+	}
+
+	std::vector<int> entries;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		char *comment = strchr(line, '#');
+		if (comment) {
+			*comment = 0;
+		}
+		int col, row, time;
+		if (sscanf(line, "%d %d %d", &col, &row, &time)!=3 || col<0 || row<0) {
+			continue;
+		}
+		entries.push_back(col);
+		entries.push_back(row);
+		entries.push_back(time);
+	}
+	fclose(f);
+
+	cal->bad_pixel_count = entries.size() / 3;
+	cal->bad_pixels = ALLOC_N(int, entries.size() ? entries.size() : 1);
+	if (entries.size()) {
+		memcpy(cal->bad_pixels, &entries[0], entries.size() * sizeof(int));
+	}
+}
+
+VALUE rb_calibration_s_load(int argc, VALUE *argv, VALUE klass)
+{
+	VALUE opts = Qnil;
+	rb_scan_args(argc, argv, "0:", &opts);
+
+	ID kwargs[2] = { rb_intern("dark_frame"), rb_intern("bad_pixels") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
+	VALUE dark_frame = vals[0]!=Qundef && vals[0]!=Qnil ? rb_str_new_frozen(rb_get_path(vals[0])) : Qnil;
+	VALUE bad_pixels = vals[1]!=Qundef && vals[1]!=Qnil ? rb_str_new_frozen(rb_get_path(vals[1])) : Qnil;
+
+	VALUE self = rb_obj_alloc(klass);
+	CalibrationNativeResource *p = ALLOC(CalibrationNativeResource);
+	memset(p, 0, sizeof(*p));
+	VALUE resource = TypedData_Wrap_Struct(rb_cObject, &calibration_native_resource_type, p);
+	rb_iv_set(self, "calibration_native_resource", resource);
+
+	if (dark_frame!=Qnil) {
+		load_dark_frame(p, RSTRING_PTR(dark_frame));
+	}
+	if (bad_pixels!=Qnil) {
+		load_bad_pixels(p, RSTRING_PTR(bad_pixels));
+	}
+
+	rb_iv_set(self, "@dark_frame", dark_frame);
+	rb_iv_set(self, "@bad_pixels", bad_pixels);
+	rb_iv_set(self, "@width", INT2FIX(p->width));
+	rb_iv_set(self, "@height", INT2FIX(p->height));
+	rb_iv_set(self, "@bad_pixel_count", SIZET2NUM(p->bad_pixel_count));
+
+#ifdef HAVE_RUBY_RACTOR_H
+	rb_ractor_make_shareable(self);
+#else
+	rb_obj_freeze(self);
+#endif
+
+	return self;
+}
+
+// dcraw bad_pixels(): average of the same-color neighbours within radius 1, else 2
+static void calibration_fix_bad_pixels(LibRaw *libraw, CalibrationNativeResource *cal)
+{
+	libraw_rawdata_t *raw = &libraw->imgdata.rawdata;
+	int width = raw->sizes.width;
+	int height = raw->sizes.height;
+	time_t timestamp = libraw->imgdata.other.timestamp;
+	bool cfa = raw->iparams.filters!=0;
+
+	for (size_t i=0; i<cal->bad_pixel_count; i++) {
+		int col = cal->bad_pixels[i * 3];
+		int row = cal->bad_pixels[i * 3 + 1];
+		int time = cal->bad_pixels[i * 3 + 2];
+		if (width<=col || height<=row || (timestamp && timestamp<time)) {
+			continue;
+		}
+		int color = cfa ? libraw->COLOR(row, col) : 0;
+		unsigned total = 0, n = 0;
+		for (int rad=1; rad<3 && n==0; rad++) {
+			for (int r=row - rad; r<=row + rad; r++) {
+				for (int c=col - rad; c<=col + rad; c++) {
+					if ((unsigned)r<(unsigned)height && (unsigned)c<(unsigned)width && (r!=row || c!=col) && (!cfa || libraw->COLOR(r, c)==color)) {
+						total += rawdata_row(raw, r)[c];
+						n++;
+					}
+				}
+			}
+		}
+		if (n) {
+			((unsigned short *)rawdata_row(raw, row))[col] = total / n;
+		}
+	}
+}
+
+// saturating raw - dark over the visible area
+static void calibration_subtract_dark(LibRawNativeResource *owner, libraw_rawdata_t *raw, CalibrationNativeResource *cal)
+{
+	int width = cal->width;
+	const unsigned short *dark = cal->dark;
+
+	call_without_gvl(owner, [&]() {
+		parallel_for(cal->height, native_thread_count(), [&](int begin, int end, int t) {
+			for (int row=begin; row<end; row++) {
+				unsigned short *dst = (unsigned short *)rawdata_row(raw, row);
+				const unsigned short *src = dark + (size_t)row * width;
+				int col = 0;
+#if defined(__SSE2__)
+				for (; col + 8<=width; col+=8) {
+					__m128i a = _mm_loadu_si128((const __m128i *)(dst + col));
+					__m128i b = _mm_loadu_si128((const __m128i *)(src + col));
+					_mm_storeu_si128((__m128i *)(dst + col), _mm_subs_epu16(a, b));
+				}
+#elif defined(__ARM_NEON)
+				for (; col + 8<=width; col+=8) {
+					vst1q_u16(dst + col, vqsubq_u16(vld1q_u16(dst + col), vld1q_u16(src + col)));
+				}
+#endif
+				for (; col<width; col++) {
+					dst[col] = dst[col]>src[col] ? dst[col] - src[col] : 0;
+				}
+			}
+		});
+	}, true);
+}
+
+// applies the calibration to the unpacked sensor data; once per unpack
+VALUE rb_raw_object_calibrate(VALUE self, VALUE calibration)
+{
+	LibRaw *libraw = get_idle_lib_raw(self);
+	CalibrationNativeResource *cal = get_calibration(calibration);
+	libraw_rawdata_t *raw = get_unpacked_rawdata(libraw);
+
+	VALUE applied = rb_iv_get(self, "calibration");
+	if (applied==calibration) {
+		return Qfalse;
+	}
+	if (RTEST(applied)) {
+		rb_raise(rb_eRuntimeError, "another calibration was already applied; unpack again first");
+	}
+	if (!raw->raw_image) {
+		rb_raise(rb_eNotImpError, "calibration needs single-channel (bayer or monochrome) raw data");
+	}
+	if (cal->dark && (cal->width!=raw->sizes.width || cal->height!=raw->sizes.height)) {
+		rb_raise(rb_eArgError, "dark frame is %dx%d, image is %dx%d", cal->width, cal->height, raw->sizes.width, raw->sizes.height);
+	}
+
+	calibration_fix_bad_pixels(libraw, cal);
+	if (cal->dark) {
+		calibration_subtract_dark(get_lib_raw_resource(self), raw, cal);
+		// the dark frame carries the black level, as with dcraw -K
+		raw->color.black = 0;
+		memset(raw->color.cblack, 0, sizeof(raw->color.cblack));
+		libraw->imgdata.color.black = 0;
+		memset(libraw->imgdata.color.cblack, 0, sizeof(libraw->imgdata.color.cblack));
+	}
+	rb_iv_set(self, "calibration", calibration);
 
+	return Qtrue;
+}
 
-	memset(&p->params, 0, sizeof(libraw_output_params_t));
 
-	double aber[4] = {1,1,1,1};
-	double gamm[6] = { 0.45,4.5,0,0,0,0 };
-	unsigned greybox[4] =  { 0, 0, UINT_MAX, UINT_MAX };
-	unsigned cropbox[4] =  { 0, 0, UINT_MAX, UINT_MAX };
+// LibRaw::MetadataIndex
+
+#define METADATA_INDEX_MAGIC "LRAWIDX1"
+#define METADATA_INDEX_VERSION 1
+#define METADATA_INDEX_DEFAULT_CAPACITY 4096
+
+struct MetadataIndexHeader {
+	char magic[8];
+	unsigned version;
+	unsigned libraw_version;
+	unsigned record_size;
+	unsigned retired;
+	unsigned long long capacity;
+	unsigned long long count;
+	unsigned long long reserved[4];
+};
+
+// fixed-layout record, LibRaw structs are stored as-is and the header
+// pins the LibRaw version and record size they were written with
+struct MetadataRecord {
+	unsigned seq;
+	unsigned flags;
+	unsigned long long path_hash[2];
+	unsigned long long file_size;
+	long long mtime_sec;
+	long long mtime_nsec;
+	unsigned long long content_hash;
+	libraw_iparams_t idata;
+	libraw_image_sizes_t sizes;
+	libraw_imgother_t other;
+	libraw_lensinfo_t lens;
+};
+
+#define METADATA_RECORD_USED 1
+#define METADATA_RECORD_CONTENT_HASH 2
+
+struct MetadataKey {
+	unsigned long long path_hash[2];
+	unsigned long long file_size;
+	long long mtime_sec;
+	long long mtime_nsec;
+	unsigned long long content_hash;
+	bool has_content_hash;
+};
+
+void metadata_index_native_resource_delete(MetadataIndexNativeResource * p)
+{
+	if (p->map) {
+		munmap(p->map, p->map_size);
+	}
+	if (0<=p->fd) {
+		close(p->fd);
+	}
+	if (p->path) {
+		free(p->path);
+	}
+	free(p);
+}
 
-	memmove(&p->params.aber,&aber,sizeof(aber));
-	memmove(&p->params.gamm,&gamm,sizeof(gamm));
-	memmove(&p->params.greybox,&greybox,sizeof(greybox));
-	memmove(&p->params.cropbox,&cropbox,sizeof(cropbox));
+MetadataIndexNativeResource* get_metadata_index(VALUE self)
+{
+	VALUE resource = rb_iv_get(self, "metadata_index_native_resource");
+	if (resource==Qnil) {
+		rb_raise(rb_eIOError, "closed metadata index");
+	}
 
-	p->params.bright=1;
-	p->params.use_camera_matrix=1;
-	p->params.user_flip=-1;
-	p->params.user_black=-1;
-	p->params.user_cblack[0]=p->params.user_cblack[1]=p->params.user_cblack[2]=p->params.user_cblack[3]=-1000001;
-	p->params.user_sat=-1;
-	p->params.user_qual=-1;
-	p->params.output_color=1;
-	p->params.output_bps=8;
-	p->params.use_fuji_rotate=1;
-	p->params.exp_shift = 1.0; 
-	p->params.auto_bright_thr = LIBRAW_DEFAULT_AUTO_BRIGHTNESS_THRESHOLD;
-	p->params.adjust_maximum_thr= LIBRAW_DEFAULT_ADJUST_MAXIMUM_THRESHOLD;
-	p->params.use_rawspeed = 1; 
-	p->params.no_auto_scale = 0; 
-	p->params.no_interpolation = 0; 
-	p->params.sraw_ycc = 0; 
-	p->params.force_foveon_x3f = 0; 
-	p->params.x3f_flags = LIBRAW_DP2Q_INTERPOLATERG|LIBRAW_DP2Q_INTERPOLATEAF;
-	p->params.sony_arw2_options = 0; 
-	p->params.sony_arw2_posterization_thr = 0; 
-	p->params.green_matching = 0; 
-	p->params.coolscan_nef_gamma = 1.0f;
+	MetadataIndexNativeResource *p = NULL;
+	Data_Get_Struct(resource, MetadataIndexNativeResource, p);
+	if (!p || !p->map) {
+		rb_raise(rb_eIOError, "closed metadata index");
+	}
 
+	return p;
+}
 
-	VALUE resource = Data_Wrap_Struct(CLASS_OF(self), 0, output_param_native_resource_delete, p);
-	rb_iv_set(self, "output_param_native_resource", resource);
+static MetadataIndexHeader *metadata_index_header(MetadataIndexNativeResource *p)
+{
+	return (MetadataIndexHeader *)p->map;
+}
 
-	apply_output_param(self, &p->params);
+static MetadataRecord *metadata_index_records(MetadataIndexNativeResource *p)
+{
+	return (MetadataRecord *)((char *)p->map + sizeof(MetadataIndexHeader));
+}
 
-	return self;
+static size_t metadata_index_file_size(unsigned long long capacity)
+{
+	return sizeof(MetadataIndexHeader) + capacity * sizeof(MetadataRecord);
 }
 
-void apply_output_param(VALUE self, libraw_output_params_t *p)
+static void metadata_index_unmap(MetadataIndexNativeResource *p)
 {
-	if (p) {
-		// TODO: greybox
-		// TODO: cropbox
-		// TODO: aber
-		// TODO: gamm
-		// TODO: user_mul
-		rb_iv_set(self, "@shot_select", INT2FIX(p->shot_select));
-		rb_iv_set(self, "@bright", rb_float_new(p->bright));
-		rb_iv_set(self, "@threshold", rb_float_new(p->threshold));
-		rb_iv_set(self, "@half_size", INT2FIX(p->half_size));
-		rb_iv_set(self, "@four_color_rgb", INT2FIX(p->four_color_rgb));
-		rb_iv_set(self, "@highlight", INT2FIX(p->highlight));
-		rb_iv_set(self, "@use_auto_wb", p->use_auto_wb ? Qtrue : Qfalse);
-		rb_iv_set(self, "@use_camera_wb", p->use_camera_wb ? Qtrue : Qfalse);
-		rb_iv_set(self, "@use_camera_matrix", p->use_camera_matrix ? Qtrue : Qfalse);
-		rb_iv_set(self, "@output_color", INT2FIX(p->output_color));
-		// TODO: output_profile
-		// TODO: camera_profile
-		// TODO: bad_pixels
-		// TODO: dark_frame
-		rb_iv_set(self, "@output_bps", INT2FIX(p->output_bps));
-		rb_iv_set(self, "@output_tiff", INT2FIX(p->output_tiff));
-		rb_iv_set(self, "@user_flip", INT2FIX(p->user_flip));
-		rb_iv_set(self, "@user_qual", INT2FIX(p->user_qual));
-		rb_iv_set(self, "@user_black", INT2FIX(p->user_black));
-		// TODO: user_cblack
-		rb_iv_set(self, "@user_sat", INT2FIX(p->user_sat));
-		rb_iv_set(self, "@med_passes", INT2FIX(p->med_passes));
-		rb_iv_set(self, "@auto_bright_thr", rb_float_new(p->auto_bright_thr));
-		rb_iv_set(self, "@adjust_maximum_thr", rb_float_new(p->adjust_maximum_thr));
-		rb_iv_set(self, "@no_auto_bright", p->no_auto_bright ? Qtrue : Qfalse);
-		rb_iv_set(self, "@use_fuji_rotate", p->use_fuji_rotate ? Qtrue : Qfalse);
-		rb_iv_set(self, "@green_matching", INT2FIX(p->green_matching));
+	if (p->map) {
+		munmap(p->map, p->map_size);
+		p->map = NULL;
+	}
+	if (0<=p->fd) {
+		close(p->fd);
+		p->fd = -1;
+	}
+}
 
-		// DCB parameters
-		rb_iv_set(self, "@dcb_iterations", INT2FIX(p->dcb_iterations));
-		rb_iv_set(self, "@dcb_enhance_fl", INT2FIX(p->dcb_enhance_fl));
-		rb_iv_set(self, "@fbdd_noiserd", INT2FIX(p->fbdd_noiserd));
+static int metadata_index_header_valid(MetadataIndexHeader *h)
+{
+	return memcmp(h->magic, METADATA_INDEX_MAGIC, 8)==0
+		&& h->version==METADATA_INDEX_VERSION
+		&& h->libraw_version==(unsigned)LIBRAW_VERSION
+		&& h->record_size==sizeof(MetadataRecord)
+		&& 0<h->capacity;
+}
 
-		// VCD parameters
-		rb_iv_set(self, "@eeci_refine", INT2FIX(p->eeci_refine));
-		rb_iv_set(self, "@es_med_passes", INT2FIX(p->es_med_passes));
+// create an empty index file at path (written aside and renamed into place)
+static int metadata_index_create(const char *path, unsigned long long capacity)
+{
+	// unique per creator: two processes may create the same index at once
+	static std::atomic<unsigned> sequence(0);
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), sequence++);
+	std::string tmp = std::string(path) + suffix;
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd<0) {
+		return -1;
+	}
 
-		// AMaZE
-		rb_iv_set(self, "@ca_correc", INT2FIX(p->ca_correc));
-		rb_iv_set(self, "@cared", rb_float_new(p->cared));
-		rb_iv_set(self, "@cablue", rb_float_new(p->cablue));
-		rb_iv_set(self, "@cfaline", INT2FIX(p->cfaline));
-		rb_iv_set(self, "@linenoise", rb_float_new(p->linenoise));
-		rb_iv_set(self, "@cfa_clean", INT2FIX(p->cfa_clean));
-		rb_iv_set(self, "@lclean", rb_float_new(p->lclean));
-		rb_iv_set(self, "@cclean", rb_float_new(p->cclean));
-		rb_iv_set(self, "@cfa_green", INT2FIX(p->cfa_green));
-		rb_iv_set(self, "@green_thresh", rb_float_new(p->green_thresh));
-		rb_iv_set(self, "@exp_correc", INT2FIX(p->exp_correc));
-		rb_iv_set(self, "@exp_shift", rb_float_new(p->exp_shift));
-		rb_iv_set(self, "@exp_preser", rb_float_new(p->exp_preser));
+	MetadataIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, METADATA_INDEX_MAGIC, 8);
+	header.version = METADATA_INDEX_VERSION;
+	header.libraw_version = LIBRAW_VERSION;
+	header.record_size = sizeof(MetadataRecord);
+	header.capacity = capacity;
+
+	int ok = ftruncate(fd, metadata_index_file_size(capacity))==0
+		&& pwrite(fd, &header, sizeof(header), 0)==(ssize_t)sizeof(header)
+		&& rename(tmp.c_str(), path)==0;
+	close(fd);
+
+	if (!ok) {
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
 
-		// WF debanding
-		rb_iv_set(self, "@wf_debanding", INT2FIX(p->wf_debanding));
-		// TODO: wf_deband_treshold
+// map the current index file, creating or resetting it when missing or incompatible
+static void metadata_index_map(MetadataIndexNativeResource *p)
+{
+	metadata_index_unmap(p);
+
+	for (int attempt=0; attempt<2; attempt++) {
+		int fd = open(p->path, O_RDWR);
+		if (fd<0 && errno==ENOENT) {
+			if (metadata_index_create(p->path, p->initial_capacity)!=0) {
+				rb_sys_fail(p->path);
+			}
+			fd = open(p->path, O_RDWR);
+		}
+		if (fd<0) {
+			rb_sys_fail(p->path);
+		}
 
-		// Raw speed
-		rb_iv_set(self, "@use_rawspeed", p->use_rawspeed ? Qtrue : Qfalse);
+		struct stat st;
+		MetadataIndexHeader header;
+		if (fstat(fd, &st)!=0 || pread(fd, &header, sizeof(header), 0)!=(ssize_t)sizeof(header)
+			|| !metadata_index_header_valid(&header)
+			|| (size_t)st.st_size<metadata_index_file_size(header.capacity)) {
+			// written by another LibRaw build or truncated: start over
+			close(fd);
+			if (attempt || metadata_index_create(p->path, p->initial_capacity)!=0) {
+				rb_raise(rb_eIOError, "invalid metadata index: %s", p->path);
+			}
+			continue;
+		}
 
-		// Disable Auto-scale
-		rb_iv_set(self, "@no_auto_scale", p->no_auto_scale ? Qtrue : Qfalse);
+		size_t size = metadata_index_file_size(header.capacity);
+		void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map==MAP_FAILED) {
+			close(fd);
+			rb_sys_fail(p->path);
+		}
 
-		// Disable intepolation
-		rb_iv_set(self, "@no_interpolation", p->no_interpolation ? Qtrue : Qfalse);
+		p->fd = fd;
+		p->map = map;
+		p->map_size = size;
+		return;
+	}
+}
 
-		// Disable sRAW YCC to RGB conversion
-		rb_iv_set(self, "@sraw_ycc", INT2FIX(p->sraw_ycc));
+// readers only need to follow the writer when it replaced the file with a larger one
+static void metadata_index_refresh(MetadataIndexNativeResource *p)
+{
+	if (__atomic_load_n(&metadata_index_header(p)->retired, __ATOMIC_ACQUIRE)) {
+		metadata_index_map(p);
+	}
+}
 
-		// Force use x3f data decoding either if demosaic pack GPL2 enabled
-		rb_iv_set(self, "@force_foveon_x3f", INT2FIX(p->force_foveon_x3f));
-		rb_iv_set(self, "@x3f_flags", INT2FIX(p->x3f_flags));
+static MetadataRecord *metadata_index_probe(MetadataIndexNativeResource *p, const unsigned long long *path_hash, bool for_insert)
+{
+	MetadataIndexHeader *header = metadata_index_header(p);
+	MetadataRecord *records = metadata_index_records(p);
+	unsigned long long capacity = header->capacity;
+
+	for (unsigned long long i=0; i<capacity; i++) {
+		MetadataRecord *r = &records[(path_hash[0] + i) % capacity];
+		unsigned flags = __atomic_load_n(&r->flags, __ATOMIC_ACQUIRE);
+		if (!(flags & METADATA_RECORD_USED)) {
+			return for_insert ? r : NULL;
+		}
+		if (r->path_hash[0]==path_hash[0] && r->path_hash[1]==path_hash[1]) {
+			return r;
+		}
+	}
+	return NULL;
+}
 
-		// Sony ARW2 digging mode
-		rb_iv_set(self, "@sony_arw2_options", INT2FIX(p->sony_arw2_options));
-		rb_iv_set(self, "@sony_arw2_posterization_thr", INT2FIX(p->sony_arw2_posterization_thr));
+// seqlock read: retry while the single writer is updating the record
+static bool metadata_record_read(MetadataRecord *r, MetadataRecord *out)
+{
+	for (;;) {
+		unsigned seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(out, r, sizeof(MetadataRecord));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED)==seq) {
+			return (out->flags & METADATA_RECORD_USED)!=0;
+		}
+	}
+}
 
-		// Nikon Coolscan
-		rb_iv_set(self, "@coolscan_nef_gamma", rb_float_new(p->coolscan_nef_gamma));
+static void metadata_record_write(MetadataRecord *r, const MetadataRecord *in)
+{
+	unsigned seq = r->seq;
+	__atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)r + offsetof(MetadataRecord, path_hash), (const char *)in + offsetof(MetadataRecord, path_hash), sizeof(MetadataRecord) - offsetof(MetadataRecord, path_hash));
+	__atomic_store_n(&r->flags, in->flags, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static unsigned long long content_hash_value(VALUE hash)
+{
+	if (RB_TYPE_P(hash, T_STRING)) {
+		return NUM2ULL(rb_str_to_inum(hash, 16, Qtrue));
 	}
+	return NUM2ULL(hash);
 }
 
-VALUE rb_output_param_greybox(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h)
+static void metadata_key(VALUE filename, VALUE content_hash, MetadataKey *key)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE path = rb_file_expand_path(rb_obj_as_string(filename), Qnil);
 
-	params->greybox[0] = NUM2LONG(x);
-	params->greybox[1] = NUM2LONG(y);
-	params->greybox[2] = NUM2LONG(w);
-	params->greybox[3] = NUM2LONG(h);
+	struct stat st;
+	if (stat(RSTRING_PTR(path), &st)!=0) {
+		rb_sys_fail(RSTRING_PTR(path));
+	}
 
-	apply_output_param(self, params);
+	XXH64State h0(0), h1(XXH_PRIME64_3);
+	h0.update(RSTRING_PTR(path), RSTRING_LEN(path));
+	h1.update(RSTRING_PTR(path), RSTRING_LEN(path));
+	key->path_hash[0] = h0.digest();
+	key->path_hash[1] = h1.digest();
+	key->file_size = st.st_size;
+	key->mtime_sec = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+#else
+	key->mtime_nsec = 0;
+#endif
+	key->has_content_hash = content_hash!=Qnil && content_hash!=Qundef;
+	key->content_hash = key->has_content_hash ? content_hash_value(content_hash) : 0;
+}
 
-	return self;
+static bool metadata_record_matches(MetadataRecord *r, MetadataKey *key)
+{
+	if (r->path_hash[0]!=key->path_hash[0] || r->path_hash[1]!=key->path_hash[1]) {
+		return false;
+	}
+	if (r->file_size!=key->file_size || r->mtime_sec!=key->mtime_sec || r->mtime_nsec!=key->mtime_nsec) {
+		return false;
+	}
+	if (key->has_content_hash) {
+		return (r->flags & METADATA_RECORD_CONTENT_HASH) && r->content_hash==key->content_hash;
+	}
+	return true;
 }
 
-VALUE rb_output_param_cropbox(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h)
+// double the table into a fresh file; readers notice the retired flag and
+// remap. Runs under the writer lock, so it returns an errno instead of raising
+static int metadata_index_grow(MetadataIndexNativeResource *p)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	MetadataIndexHeader *old_header = metadata_index_header(p);
+	MetadataRecord *old_records = metadata_index_records(p);
+	unsigned long long capacity = old_header->capacity * 2;
+
+	std::string tmp = std::string(p->path) + ".grow";
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd<0) {
+		return errno;
+	}
+	size_t size = metadata_index_file_size(capacity);
+	void *map = ftruncate(fd, size)==0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (map==MAP_FAILED) {
+		int e = errno;
+		close(fd);
+		unlink(tmp.c_str());
+		return e;
+	}
 
-	params->cropbox[0]= NUM2LONG(x);
-	params->cropbox[1]= NUM2LONG(y);
-	params->cropbox[2]= NUM2LONG(w);
-	params->cropbox[3]= NUM2LONG(h);
+	MetadataIndexHeader *header = (MetadataIndexHeader *)map;
+	memcpy(header, old_header, sizeof(MetadataIndexHeader));
+	header->capacity = capacity;
+	header->retired = 0;
+	header->count = 0;
+
+	MetadataIndexNativeResource grown = *p;
+	grown.map = map;
+	grown.map_size = size;
+	for (unsigned long long i=0; i<old_header->capacity; i++) {
+		if (old_records[i].flags & METADATA_RECORD_USED) {
+			MetadataRecord *r = metadata_index_probe(&grown, old_records[i].path_hash, true);
+			memcpy(r, &old_records[i], sizeof(MetadataRecord));
+			r->seq = 0;
+			header->count++;
+		}
+	}
 
-	apply_output_param(self, params);
+	int ok = msync(map, size, MS_SYNC)==0 && rename(tmp.c_str(), p->path)==0;
+	int e = errno;
+	munmap(map, size);
+	close(fd);
+	if (!ok) {
+		unlink(tmp.c_str());
+		return e;
+	}
 
-	return self;
+	__atomic_store_n(&old_header->retired, 1, __ATOMIC_RELEASE);
+	return 0;
 }
 
-VALUE rb_output_param_gamma(VALUE self, VALUE pwr, VALUE ts)
+static void metadata_index_write(MetadataIndexNativeResource *p, MetadataKey *key, libraw_data_t *data)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	// single writer across processes; readers never take the lock
+	MetadataRecord *r = NULL;
+	for (;;) {
+		if (flock(p->fd, LOCK_EX)!=0) {
+			rb_sys_fail(p->path);
+		}
+		if (metadata_index_header(p)->retired) {
+			flock(p->fd, LOCK_UN);
+			metadata_index_map(p);
+			continue;
+		}
 
-	params->gamm[0] = RFLOAT_VALUE(rb_Float(pwr));
-	params->gamm[1] = RFLOAT_VALUE(rb_Float(ts));
+		MetadataIndexHeader *header = metadata_index_header(p);
+		r = metadata_index_probe(p, key->path_hash, true);
+		if (!r || (!(r->flags & METADATA_RECORD_USED) && header->capacity * 7 / 10 <= header->count + 1)) {
+			int e = metadata_index_grow(p);
+			if (e) {
+				flock(p->fd, LOCK_UN);
+				rb_syserr_fail(e, p->path);
+			}
+			// drops the lock on the old file along with its mapping
+			metadata_index_map(p);
+			continue;
+		}
+		break;
+	}
+	bool inserted = !(r->flags & METADATA_RECORD_USED);
+
+	MetadataRecord record;
+	memset(&record, 0, sizeof(record));
+	record.flags = METADATA_RECORD_USED | (key->has_content_hash ? METADATA_RECORD_CONTENT_HASH : 0);
+	record.path_hash[0] = key->path_hash[0];
+	record.path_hash[1] = key->path_hash[1];
+	record.file_size = key->file_size;
+	record.mtime_sec = key->mtime_sec;
+	record.mtime_nsec = key->mtime_nsec;
+	record.content_hash = key->content_hash;
+	record.idata = data->idata;
+	record.idata.xmplen = 0;
+	record.idata.xmpdata = NULL;
+	record.sizes = data->sizes;
+	record.other = data->other;
+	record.lens = data->lens;
+
+	metadata_record_write(r, &record);
+	if (inserted) {
+		__atomic_add_fetch(&metadata_index_header(p)->count, 1, __ATOMIC_RELEASE);
+	}
 
-	apply_output_param(self, params);
+	flock(p->fd, LOCK_UN);
+}
 
-	return self;
+static VALUE get_content_hash_option(VALUE opts)
+{
+	ID kwargs[1] = { rb_intern("content_hash") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	return vals[0]==Qundef ? Qnil : vals[0];
 }
 
-VALUE rb_output_param_whitebalance(VALUE self, VALUE r, VALUE g, VALUE b, VALUE g2)
+static VALUE metadata_index_lookup(VALUE self, VALUE filename, VALUE content_hash)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	MetadataIndexNativeResource *p = get_metadata_index(self);
+	metadata_index_refresh(p);
 
-	params->user_mul[0] = RFLOAT_VALUE(rb_Float(r));
-	params->user_mul[1] = RFLOAT_VALUE(rb_Float(g));
-	params->user_mul[2] = RFLOAT_VALUE(rb_Float(b));
-	params->user_mul[3] = RFLOAT_VALUE(rb_Float(g2));
+	MetadataKey key;
+	metadata_key(filename, content_hash, &key);
 
-	apply_output_param(self, params);
+	MetadataRecord *r = metadata_index_probe(p, key.path_hash, false);
+	MetadataRecord record;
+	if (!r || !metadata_record_read(r, &record) || !metadata_record_matches(&record, &key)) {
+		return Qnil;
+	}
 
-	return self;
+	// not opened: metadata only, open_file is still needed before unpack
+	VALUE obj = rb_class_new_instance(0, NULL, rb_cRawObject);
+	LibRaw *libraw = get_lib_raw(obj);
+	libraw->imgdata.idata = record.idata;
+	libraw->imgdata.sizes = record.sizes;
+	libraw->imgdata.other = record.other;
+	libraw->imgdata.lens = record.lens;
+	apply_rawobject(obj);
+
+	return obj;
 }
 
-VALUE rb_output_param_set_bright(VALUE self, VALUE val)
+static VALUE metadata_index_store(VALUE self, VALUE filename, VALUE raw, VALUE content_hash)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	MetadataIndexNativeResource *p = get_metadata_index(self);
+	LibRaw *libraw = get_lib_raw(raw);
+	if (!(libraw->imgdata.progress_flags & LIBRAW_PROGRESS_IDENTIFY)) {
+		check_errors(LIBRAW_OUT_OF_ORDER_CALL);
+	}
 
-	params->bright = RFLOAT_VALUE(rb_Float(val));
+	MetadataKey key;
+	metadata_key(filename, content_hash, &key);
+	metadata_index_write(p, &key, &libraw->imgdata);
 
-	apply_output_param(self, params);
+	return raw;
+}
 
-	return self;
+static VALUE metadata_index_identify(VALUE self, VALUE filename, VALUE content_hash)
+{
+	VALUE obj = metadata_index_lookup(self, filename, content_hash);
+	if (obj!=Qnil) {
+		return obj;
+	}
+
+	obj = rb_class_new_instance(0, NULL, rb_cRawObject);
+	check_errors(open_file(obj, filename));
+	metadata_index_store(self, filename, obj, content_hash);
+
+	return obj;
 }
 
-VALUE rb_output_param_set_threshold(VALUE self, VALUE val)
+VALUE rb_metadata_index_initialize(int argc, VALUE *argv, VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE path, opts;
+	rb_scan_args(argc, argv, "1:", &path, &opts);
 
-	params->threshold = RFLOAT_VALUE(rb_Float(val));
+	ID kwargs[1] = { rb_intern("capacity") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
 
-	apply_output_param(self, params);
+	path = rb_file_expand_path(rb_obj_as_string(path), Qnil);
+
+	MetadataIndexNativeResource *p = ALLOC(MetadataIndexNativeResource);
+	p->fd = -1;
+	p->map = NULL;
+	p->map_size = 0;
+	p->path = strdup(RSTRING_PTR(path));
+	p->initial_capacity = vals[0]==Qundef ? METADATA_INDEX_DEFAULT_CAPACITY : NUM2ULL(vals[0]);
+	if (p->initial_capacity<16) {
+		p->initial_capacity = 16;
+	}
+
+	VALUE resource = Data_Wrap_Struct(0, 0, metadata_index_native_resource_delete, p);
+	rb_iv_set(self, "metadata_index_native_resource", resource);
+	rb_iv_set(self, "@path", path);
+
+	metadata_index_map(p);
 
 	return self;
 }
 
-VALUE rb_output_param_set_half_size(VALUE self, VALUE val)
+VALUE rb_metadata_index_lookup(int argc, VALUE *argv, VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE filename, opts;
+	rb_scan_args(argc, argv, "1:", &filename, &opts);
 
-	params->half_size = !(val==Qnil || val==Qfalse);
+	return metadata_index_lookup(self, filename, get_content_hash_option(opts));
+}
 
-	apply_output_param(self, params);
+VALUE rb_metadata_index_store(int argc, VALUE *argv, VALUE self)
+{
+	VALUE filename, raw, opts;
+	rb_scan_args(argc, argv, "2:", &filename, &raw, &opts);
 
-	return self;
+	return metadata_index_store(self, filename, raw, get_content_hash_option(opts));
 }
 
-VALUE rb_output_param_set_four_color_rgb(VALUE self, VALUE val)
+VALUE rb_metadata_index_identify(int argc, VALUE *argv, VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE filename, opts;
+	rb_scan_args(argc, argv, "1:", &filename, &opts);
 
-	params->four_color_rgb = !(val==Qnil || val==Qfalse);
+	return metadata_index_identify(self, filename, get_content_hash_option(opts));
+}
 
-	apply_output_param(self, params);
+VALUE rb_metadata_index_count(VALUE self)
+{
+	MetadataIndexNativeResource *p = get_metadata_index(self);
+	metadata_index_refresh(p);
 
-	return self;
+	return ULL2NUM(__atomic_load_n(&metadata_index_header(p)->count, __ATOMIC_ACQUIRE));
 }
 
-VALUE rb_output_param_set_highlight(VALUE self, VALUE val)
+VALUE rb_metadata_index_close(VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	MetadataIndexNativeResource *p = get_metadata_index(self);
+	metadata_index_unmap(p);
 
-	params->highlight = NUM2LONG(val);
+	return Qnil;
+}
 
-	apply_output_param(self, params);
 
-	return self;
+// LibRaw::RenderCache
+
+#define RENDER_FILE_MAGIC "LRREND01"
+#define RENDER_CACHE_DEFAULT_BYTES ((size_t)256 << 20)
+
+enum RenderFormat {
+	RENDER_BITMAP,
+	RENDER_FLOAT32_LINEAR,
+	RENDER_FLOAT16_LINEAR
+};
+
+enum RenderState {
+	RENDER_HIT,
+	RENDER_WAIT,
+	RENDER_LEAD
+};
+
+struct RenderEntry {
+	int width;
+	int height;
+	int colors;
+	int bits;
+	int sample_format;
+	std::string data;
+};
+
+struct RenderFileHeader {
+	char magic[8];
+	unsigned long long key_size;
+	unsigned long long data_size;
+	int width;
+	int height;
+	int colors;
+	int bits;
+	int sample_format;
+	int reserved;
+};
+
+// a render in progress; identical requests wait for it to land and take
+// its result (entry, or the error in ret) from here
+struct RenderFlight {
+	bool landed;
+	int ret;
+	std::shared_ptr<RenderEntry> entry;
+
+	RenderFlight() : landed(false), ret(LIBRAW_SUCCESS) {}
+};
+
+typedef std::list<std::pair<std::string, std::shared_ptr<RenderEntry> > > RenderList;
+
+// Renders by (source, output params, format, target size). Memory entries
+// are evicted least recently used first; a render in flight is kept in
+// `flights` and identical requests wait for it instead of decoding again.
+// Failed renders are not cached, their waiters get the same error.
+class RenderCache {
+public:
+	std::mutex mutex;
+	std::condition_variable cond;
+	size_t max_bytes;
+	size_t bytes;
+	std::string dir;
+	RenderList lru;
+	std::map<std::string, RenderList::iterator> index;
+	std::map<std::string, std::shared_ptr<RenderFlight> > flights;
+	unsigned long long hits;
+	unsigned long long disk_hits;
+	unsigned long long misses;
+	unsigned long long coalesced;
+	unsigned long long evictions;
+
+	RenderCache(size_t max) : max_bytes(max), bytes(0), hits(0), disk_hits(0), misses(0), coalesced(0), evictions(0) {}
+
+	// mutex held
+	std::shared_ptr<RenderEntry> lookup(const std::string &key)
+	{
+		std::map<std::string, RenderList::iterator>::iterator it = index.find(key);
+		if (it==index.end()) {
+			return std::shared_ptr<RenderEntry>();
+		}
+		lru.splice(lru.begin(), lru, it->second);
+		return it->second->second;
+	}
+
+	// mutex held; entries larger than the whole cache are not kept
+	void insert(const std::string &key, const std::shared_ptr<RenderEntry> &entry)
+	{
+		if (index.count(key) || max_bytes<entry->data.size()) {
+			return;
+		}
+		lru.push_front(std::make_pair(key, entry));
+		index[key] = lru.begin();
+		bytes += entry->data.size();
+		shrink(max_bytes);
+	}
+
+	// mutex held
+	void shrink(size_t limit)
+	{
+		while (limit<bytes && !lru.empty()) {
+			bytes -= lru.back().second->data.size();
+			index.erase(lru.back().first);
+			lru.pop_back();
+			evictions++;
+		}
+	}
+};
+
+static void render_cache_delete(RenderCache *cache)
+{
+	delete cache;
 }
 
-VALUE rb_output_param_set_use_auto_wb(VALUE self, VALUE val)
+static RenderCache* get_render_cache(VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
-
-	params->use_auto_wb = !(val==Qnil || val==Qfalse);
+	VALUE resource = rb_iv_get(self, "render_cache_native_resource");
+	if (resource==Qnil) {
+		rb_raise(rb_eRuntimeError, "uninitialized render cache");
+	}
 
-	apply_output_param(self, params);
+	RenderCache *cache = NULL;
+	Data_Get_Struct(resource, RenderCache, cache);
 
-	return self;
+	return cache;
 }
 
-VALUE rb_output_param_set_use_camera_wb(VALUE self, VALUE val)
+static int render_format_option(VALUE format)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	if (format==Qundef || format==Qnil) {
+		return RENDER_BITMAP;
+	}
+	ID id = SYM2ID(format);
+	if (id==rb_intern("bitmap")) {
+		return RENDER_BITMAP;
+	} else if (id==rb_intern("float32_linear")) {
+		return RENDER_FLOAT32_LINEAR;
+	} else if (id==rb_intern("float16_linear")) {
+		return RENDER_FLOAT16_LINEAR;
+	}
+	rb_raise(rb_eArgError, "unknown format: %" PRIsVALUE, format);
+}
 
-	params->use_camera_wb = !(val==Qnil || val==Qfalse);
+// digest (when given) or path, size and mtime, then everything that changes the output
+static VALUE render_cache_key(VALUE path, VALUE digest, const libraw_output_params_t *params, int format, double target_width, double target_height)
+{
+	VALUE key = rb_str_buf_new(sizeof(*params) + 64);
+	if (digest!=Qundef && digest!=Qnil) {
+		digest = rb_obj_as_string(digest);
+		rb_str_buf_cat(key, "d", 1);
+		rb_str_buf_cat(key, RSTRING_PTR(digest), RSTRING_LEN(digest));
+	} else {
+		struct stat st;
+		if (stat(RSTRING_PTR(path), &st)!=0) {
+			rb_sys_fail(RSTRING_PTR(path));
+		}
+		long long stamp[3] = { (long long)st.st_size, (long long)st.st_mtime, 0 };
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+		stamp[2] = st.st_mtim.tv_nsec;
+#endif
+		rb_str_buf_cat(key, "p", 1);
+		rb_str_buf_cat(key, RSTRING_PTR(path), RSTRING_LEN(path));
+		rb_str_buf_cat(key, (const char *)stamp, sizeof(stamp));
+	}
+	rb_str_buf_cat(key, "\0", 1);
+	rb_str_buf_cat(key, (const char *)params, sizeof(*params));
+	rb_str_buf_cat(key, (const char *)&format, sizeof(format));
+	rb_str_buf_cat(key, (const char *)&target_width, sizeof(target_width));
+	rb_str_buf_cat(key, (const char *)&target_height, sizeof(target_height));
+	return key;
+}
 
-	apply_output_param(self, params);
+static std::string render_file_path(const std::string &dir, const std::string &key)
+{
+	XXH64State state;
+	state.update(key.data(), key.size());
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.render", state.digest());
+	return dir + name;
+}
 
-	return self;
+// false on any mismatch, which includes a hash collision of another key
+static bool read_render_file(const std::string &path, const std::string &key, RenderEntry *entry)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+	RenderFileHeader header;
+	bool ok = fread(&header, sizeof(header), 1, f)==1 && memcmp(header.magic, RENDER_FILE_MAGIC, sizeof(header.magic))==0 && header.key_size==key.size();
+	if (ok) {
+		std::string stored(key.size(), '\0');
+		ok = fread(&stored[0], 1, key.size(), f)==key.size() && stored==key;
+	}
+	if (ok) {
+		try {
+			entry->data.resize(header.data_size);
+		} catch (std::bad_alloc&) {
+			ok = false;
+		}
+	}
+	if (ok) {
+		ok = fread(&entry->data[0], 1, header.data_size, f)==header.data_size;
+		entry->width = header.width;
+		entry->height = header.height;
+		entry->colors = header.colors;
+		entry->bits = header.bits;
+		entry->sample_format = header.sample_format;
+	}
+	fclose(f);
+	return ok;
 }
 
-VALUE rb_output_param_set_use_camera_matrix(VALUE self, VALUE val)
+// written aside and renamed, so readers never see a partial file; errors
+// only cost the disk tier
+static void write_render_file(const std::string &path, const std::string &key, const RenderEntry *entry)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	static std::atomic<unsigned> sequence(0);
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int)getpid(), sequence++);
+	std::string tmp = path + suffix;
+
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f) {
+		return;
+	}
+	RenderFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RENDER_FILE_MAGIC, sizeof(header.magic));
+	header.key_size = key.size();
+	header.data_size = entry->data.size();
+	header.width = entry->width;
+	header.height = entry->height;
+	header.colors = entry->colors;
+	header.bits = entry->bits;
+	header.sample_format = entry->sample_format;
+	bool ok = fwrite(&header, sizeof(header), 1, f)==1;
+	ok = ok && fwrite(key.data(), 1, key.size(), f)==key.size();
+	ok = ok && fwrite(entry->data.data(), 1, entry->data.size(), f)==entry->data.size();
+	ok = fclose(f)==0 && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str())!=0) {
+		unlink(tmp.c_str());
+	}
+}
 
-	params->use_camera_matrix = !(val==Qnil || val==Qfalse);
+// open, unpack, process and copy out the requested format. No Ruby calls.
+static int render_decode(const char *path, const libraw_output_params_t &params, int format, double target_width, double target_height, double timeout, RenderEntry *entry)
+{
+	LibRaw *libraw = NULL;
+	try {
+		libraw = new LibRaw(LIBRAW_OPTIONS_NONE);
+	} catch (std::bad_alloc&) {
+		return LIBRAW_UNSUFFICIENT_MEMORY;
+	}
 
-	apply_output_param(self, params);
+	memmove(&libraw->imgdata.params, &params, sizeof(libraw_output_params_t));
+	int ret = libraw->open_file(path);
+	if (ret==LIBRAW_SUCCESS) {
+		libraw_image_sizes_t *sizes = &libraw->imgdata.sizes;
+		MemoryReservation reservation(unpack_memory_estimate(libraw) + process_memory_estimate(sizes->width, sizes->height, params.half_size), timeout);
+		ret = reservation.held ? libraw->unpack() : LIBRAW_UNSUFFICIENT_MEMORY;
+		if (ret==LIBRAW_SUCCESS) {
+			if (0<=target_width || 0<=target_height) {
+				int width, height;
+				plan_params(libraw, target_width, target_height, &width, &height);
+			}
+			apply_demosaic_threads(1);
+			ret = libraw->dcraw_process();
+		}
+		if (ret==LIBRAW_SUCCESS) {
+			try {
+				if (format==RENDER_BITMAP) {
+					libraw->get_mem_image_format(&entry->width, &entry->height, &entry->colors, &entry->bits);
+					int stride = entry->width * entry->colors * (entry->bits / 8);
+					entry->sample_format = PROCESSED_IMAGE_UNSIGNED;
+					entry->data.resize((size_t)stride * entry->height);
+					ret = libraw->copy_mem_image(&entry->data[0], stride, 0);
+				} else {
+					bool half = format==RENDER_FLOAT16_LINEAR;
+					linear_image_format(libraw, &entry->width, &entry->height, &entry->colors);
+					entry->bits = half ? 16 : 32;
+					entry->sample_format = PROCESSED_IMAGE_FLOAT;
+					entry->data.resize((size_t)entry->width * entry->height * entry->colors * (entry->bits / 8));
+					fill_linear_image(libraw, half, (unsigned char *)&entry->data[0]);
+				}
+			} catch (std::bad_alloc&) {
+				ret = LIBRAW_UNSUFFICIENT_MEMORY;
+			}
+		}
+	}
 
-	return self;
+	delete libraw;
+	return ret;
 }
 
-VALUE rb_output_param_set_output_color(VALUE self, VALUE val)
+// a fresh pooled copy: callers may modify the image (apply_color), the cache keeps its own
+static ProcessedImageNativeResource *render_entry_image(const RenderEntry *entry)
 {
-	libraw_output_params_t *params = get_output_params(self);
-
-	params->output_color = NUM2LONG(val);
+	ProcessedImageNativeResource *p = alloc_processed_image(entry->width, entry->height, entry->colors, entry->bits);
+	if (p) {
+		p->sample_format = (enum ProcessedImageSampleFormat)entry->sample_format;
+		memcpy(p->data, entry->data.data(), p->data_size<entry->data.size() ? p->data_size : entry->data.size());
+	}
+	return p;
+}
 
-	apply_output_param(self, params);
+// one fetch; the strings and the flight are released by
+// render_cache_fetch_ensure whichever way the fetch ends
+struct RenderFetch {
+	RenderCache *cache;
+	std::string key;
+	VALUE path;
+	libraw_output_params_t params;
+	int format;
+	double target_width;
+	double target_height;
+	std::shared_ptr<RenderFlight> flight;
+};
+
+// hit, wait for an identical render in flight, or lead one
+static int render_cache_begin(RenderFetch *f, ProcessedImageNativeResource **image)
+{
+	RenderCache *cache = f->cache;
+	std::shared_ptr<RenderEntry> entry;
+	{
+		std::lock_guard<std::mutex> lock(cache->mutex);
+		entry = cache->lookup(f->key);
+		if (entry) {
+			cache->hits++;
+		} else {
+			std::map<std::string, std::shared_ptr<RenderFlight> >::iterator it = cache->flights.find(f->key);
+			if (it!=cache->flights.end()) {
+				cache->coalesced++;
+				f->flight = it->second;
+				return RENDER_WAIT;
+			}
+			f->flight = std::make_shared<RenderFlight>();
+			cache->flights[f->key] = f->flight;
+			return RENDER_LEAD;
+		}
+	}
 
-	return self;
+	*image = render_entry_image(entry.get());
+	return RENDER_HIT;
 }
 
-VALUE rb_output_param_set_output_bps(VALUE self, VALUE val)
+// waits a short slice without the GVL; true once the flight has landed
+static bool render_cache_wait(RenderFetch *f)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	RenderCache *cache = f->cache;
+	RenderFlight *flight = f->flight.get();
+	bool landed = false;
+	call_without_gvl([&]() {
+		std::unique_lock<std::mutex> lock(cache->mutex);
+		landed = cache->cond.wait_for(lock, std::chrono::milliseconds(100), [&]() { return flight->landed; });
+	});
+	return landed;
+}
 
-	params->output_bps = NUM2LONG(val)==16 ? 16 : 8;
+// renders (or reads from disk) without the GVL, lands the flight and
+// wakes the waiters before the disk write
+static void render_cache_lead(RenderFetch *f)
+{
+	RenderCache *cache = f->cache;
+	RenderFlight *flight = f->flight.get();
+	const std::string &k = f->key;
+	const char *source = RSTRING_PTR(f->path);
+	double timeout = memory_budget_wait();
+	call_without_gvl([&]() {
+		std::string file = cache->dir.empty() ? std::string() : render_file_path(cache->dir, k);
+		std::shared_ptr<RenderEntry> entry;
+		int ret = LIBRAW_SUCCESS;
+		bool from_disk = false;
+		try {
+			entry = std::make_shared<RenderEntry>();
+			from_disk = !file.empty() && read_render_file(file, k, entry.get());
+			if (!from_disk) {
+				entry->data.clear();
+				ret = render_decode(source, f->params, f->format, f->target_width, f->target_height, timeout, entry.get());
+			}
+		} catch (std::bad_alloc&) {
+			ret = LIBRAW_UNSUFFICIENT_MEMORY;
+		}
 
-	apply_output_param(self, params);
+		{
+			std::lock_guard<std::mutex> lock(cache->mutex);
+			if (ret==LIBRAW_SUCCESS) {
+				cache->insert(k, entry);
+				flight->entry = entry;
+				if (from_disk) {
+					cache->disk_hits++;
+				} else {
+					cache->misses++;
+				}
+			}
+			flight->ret = ret;
+			flight->landed = true;
+			cache->flights.erase(k);
+			cache->cond.notify_all();
+		}
 
-	return self;
+		if (ret==LIBRAW_SUCCESS && !from_disk && !file.empty()) {
+			write_render_file(file, k, entry.get());
+		}
+	});
 }
 
-VALUE rb_output_param_set_output_tiff(VALUE self, VALUE val)
+VALUE rb_render_cache_initialize(int argc, VALUE *argv, VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE opts;
+	rb_scan_args(argc, argv, "0:", &opts);
 
-	params->output_tiff = !(val==Qnil || val==Qfalse);
+	ID kwargs[2] = { rb_intern("max_bytes"), rb_intern("dir") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
 
-	apply_output_param(self, params);
+	size_t max_bytes = vals[0]!=Qundef && vals[0]!=Qnil ? NUM2SIZET(vals[0]) : RENDER_CACHE_DEFAULT_BYTES;
+	VALUE dir = Qnil;
+	if (vals[1]!=Qundef && vals[1]!=Qnil) {
+		dir = rb_file_expand_path(rb_obj_as_string(vals[1]), Qnil);
+		if (mkdir(RSTRING_PTR(dir), 0755)!=0 && errno!=EEXIST) {
+			rb_sys_fail(RSTRING_PTR(dir));
+		}
+	}
+
+	RenderCache *cache = new RenderCache(max_bytes);
+	if (dir!=Qnil) {
+		cache->dir.assign(RSTRING_PTR(dir), RSTRING_LEN(dir));
+	}
+
+	VALUE resource = Data_Wrap_Struct(0, 0, render_cache_delete, cache);
+	rb_iv_set(self, "render_cache_native_resource", resource);
+	rb_iv_set(self, "@max_bytes", SIZET2NUM(max_bytes));
+	rb_iv_set(self, "@dir", dir);
 
 	return self;
 }
 
-VALUE rb_output_param_set_flip(VALUE self, VALUE val)
+static VALUE render_cache_fetch_body(VALUE arg)
 {
-	libraw_output_params_t *params = get_output_params(self);
-
-	params->user_flip = NUM2LONG(val);
+	RenderFetch *f = (RenderFetch *)arg;
+	ProcessedImageNativeResource *p = NULL;
+	int state = render_cache_begin(f, &p);
+	if (state==RENDER_LEAD) {
+		render_cache_lead(f);
+	} else if (state==RENDER_WAIT) {
+		while (!render_cache_wait(f)) {
+			rb_thread_check_ints();
+		}
+	}
 
-	apply_output_param(self, params);
+	// waiters get the leader's result, even one the memory tier did not keep
+	if (state!=RENDER_HIT) {
+		check_errors(f->flight->ret);
+		p = render_entry_image(f->flight->entry.get());
+	}
+	if (!p) {
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
 
-	return self;
+	return wrap_processed_image(p);
 }
 
-VALUE rb_output_param_set_quality(VALUE self, VALUE val)
+static VALUE render_cache_fetch_ensure(VALUE arg)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	RenderFetch *f = (RenderFetch *)arg;
+	// the fetch's frame may be unwound by longjmp, skipping the destructors
+	f->flight.reset();
+	std::string().swap(f->key);
+	return Qnil;
+}
 
-	params->user_qual = NUM2LONG(val);
+// fetch(path, param, format: :bitmap, target_size: nil, digest: nil) -> ProcessedImage
+VALUE rb_render_cache_fetch(int argc, VALUE *argv, VALUE self)
+{
+	VALUE filename, param, opts;
+	rb_scan_args(argc, argv, "2:", &filename, &param, &opts);
 
-	apply_output_param(self, params);
+	ID kwargs[3] = { rb_intern("format"), rb_intern("target_size"), rb_intern("digest") };
+	VALUE vals[3] = { Qundef, Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 3, vals);
+	}
 
-	return self;
+	libraw_output_params_t params = *get_output_params(param);
+	int format = render_format_option(vals[0]);
+	double target_width = -1, target_height = -1;
+	if (vals[1]!=Qundef && vals[1]!=Qnil) {
+		get_target_size(vals[1], &target_width, &target_height);
+	}
+	VALUE path = rb_file_expand_path(rb_obj_as_string(filename), Qnil);
+	VALUE key = render_cache_key(path, vals[2], &params, format, target_width, target_height);
+
+	RenderFetch fetch;
+	fetch.cache = get_render_cache(self);
+	fetch.path = path;
+	fetch.params = params;
+	fetch.format = format;
+	fetch.target_width = target_width;
+	fetch.target_height = target_height;
+	fetch.key.assign(RSTRING_PTR(key), RSTRING_LEN(key));
+	VALUE image = rb_ensure(render_cache_fetch_body, (VALUE)&fetch, render_cache_fetch_ensure, (VALUE)&fetch);
+	RB_GC_GUARD(path);
+
+	return image;
 }
 
-VALUE rb_output_param_set_black(VALUE self, VALUE val)
+VALUE rb_render_cache_stats(VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
-
-	params->user_black = NUM2LONG(val);
-
-	apply_output_param(self, params);
+	RenderCache *cache = get_render_cache(self);
+	unsigned long long hits, disk_hits, misses, coalesced, evictions;
+	size_t bytes, entries, in_flight;
+	{
+		std::lock_guard<std::mutex> lock(cache->mutex);
+		hits = cache->hits;
+		disk_hits = cache->disk_hits;
+		misses = cache->misses;
+		coalesced = cache->coalesced;
+		evictions = cache->evictions;
+		bytes = cache->bytes;
+		entries = cache->index.size();
+		in_flight = cache->flights.size();
+	}
 
-	return self;
+	VALUE stats = rb_hash_new();
+	rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULL2NUM(hits));
+	rb_hash_aset(stats, ID2SYM(rb_intern("disk_hits")), ULL2NUM(disk_hits));
+	rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULL2NUM(misses));
+	rb_hash_aset(stats, ID2SYM(rb_intern("coalesced")), ULL2NUM(coalesced));
+	rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), ULL2NUM(evictions));
+	rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(bytes));
+	rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(entries));
+	rb_hash_aset(stats, ID2SYM(rb_intern("in_flight")), SIZET2NUM(in_flight));
+	return stats;
 }
 
-VALUE rb_output_param_set_saturation(VALUE self, VALUE val)
+// drops the memory tier; files on disk stay
+VALUE rb_render_cache_clear(VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	RenderCache *cache = get_render_cache(self);
+	std::lock_guard<std::mutex> lock(cache->mutex);
+	cache->evictions += cache->index.size();
+	cache->lru.clear();
+	cache->index.clear();
+	cache->bytes = 0;
 
-	params->user_sat = NUM2LONG(val);
+	return Qnil;
+}
 
-	apply_output_param(self, params);
 
-	return self;
-}
+// LibRaw
 
-VALUE rb_output_param_set_median_filter_passes(VALUE self, VALUE val)
+VALUE rb_lib_raw_identify(int argc, VALUE *argv, VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE filename, opts;
+	rb_scan_args(argc, argv, "1:", &filename, &opts);
 
-	params->user_sat = NUM2LONG(val);
+	ID kwargs[2] = { rb_intern("index"), rb_intern("content_hash") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
 
-	apply_output_param(self, params);
+	if (vals[0]==Qundef || vals[0]==Qnil) {
+		VALUE obj = rb_class_new_instance(0, NULL, rb_cRawObject);
+		check_errors(open_file(obj, filename));
+		return obj;
+	}
 
-	return self;
+	return metadata_index_identify(vals[0], filename, vals[1]==Qundef ? Qnil : vals[1]);
 }
 
-VALUE rb_output_param_set_no_auto_bright(VALUE self, VALUE val)
+// LibRaw::Column
+
+enum ScanFieldType {
+	SCAN_FLOAT32,
+	SCAN_INT64,
+	SCAN_INT32,
+	SCAN_UINT32,
+	SCAN_UINT16,
+	SCAN_UTF8
+};
+
+struct ScanField {
+	const char *name;
+	ScanFieldType type;
+	size_t offset;
+};
+
+#define SCAN_FIELD(name, type, member) { name, type, offsetof(libraw_data_t, member) }
+
+static const ScanField scan_fields[] = {
+	SCAN_FIELD("make", SCAN_UTF8, idata.make),
+	SCAN_FIELD("model", SCAN_UTF8, idata.model),
+	SCAN_FIELD("software", SCAN_UTF8, idata.software),
+	SCAN_FIELD("raw_count", SCAN_UINT32, idata.raw_count),
+	SCAN_FIELD("dng_version", SCAN_UINT32, idata.dng_version),
+	SCAN_FIELD("colors", SCAN_INT32, idata.colors),
+	SCAN_FIELD("filters", SCAN_UINT32, idata.filters),
+	SCAN_FIELD("cdesc", SCAN_UTF8, idata.cdesc),
+	SCAN_FIELD("raw_height", SCAN_UINT16, sizes.raw_height),
+	SCAN_FIELD("raw_width", SCAN_UINT16, sizes.raw_width),
+	SCAN_FIELD("height", SCAN_UINT16, sizes.height),
+	SCAN_FIELD("width", SCAN_UINT16, sizes.width),
+	SCAN_FIELD("flip", SCAN_INT32, sizes.flip),
+	SCAN_FIELD("iso_speed", SCAN_FLOAT32, other.iso_speed),
+	SCAN_FIELD("shutter", SCAN_FLOAT32, other.shutter),
+	SCAN_FIELD("aperture", SCAN_FLOAT32, other.aperture),
+	SCAN_FIELD("focal_len", SCAN_FLOAT32, other.focal_len),
+	SCAN_FIELD("timestamp", SCAN_INT64, other.timestamp),
+	SCAN_FIELD("shot_order", SCAN_UINT32, other.shot_order),
+	SCAN_FIELD("desc", SCAN_UTF8, other.desc),
+	SCAN_FIELD("artist", SCAN_UTF8, other.artist),
+	SCAN_FIELD("lens", SCAN_UTF8, lens.Lens),
+	SCAN_FIELD("lens_make", SCAN_UTF8, lens.LensMake),
+	SCAN_FIELD("min_focal", SCAN_FLOAT32, lens.MinFocal),
+	SCAN_FIELD("max_focal", SCAN_FLOAT32, lens.MaxFocal),
+	SCAN_FIELD("focal_length_in_35mm_format", SCAN_UINT16, lens.FocalLengthIn35mmFormat),
+	{ NULL, SCAN_INT32, 0 }
+};
+
+static const char *scan_type_names[] = { "float32", "int64", "int32", "uint32", "uint16", "utf8" };
+static const size_t scan_type_sizes[] = { 4, 8, 4, 4, 2, 0 };
+
+static const char *scan_default_fields[] = { "iso_speed", "shutter", "aperture", "focal_len", "timestamp", "make", "model", "lens", NULL };
+
+struct ScanColumn {
+	const ScanField *field;
+	std::vector<unsigned char> data;
+	std::vector<std::string> strings;
+};
+
+static const ScanField *find_scan_field(VALUE name)
 {
-	libraw_output_params_t *params = get_output_params(self);
-
-	params->no_auto_bright = !(val==Qnil || val==Qfalse);
-
-	apply_output_param(self, params);
+	const char *s = rb_id2name(SYM2ID(rb_to_symbol(name)));
+	for (const ScanField *f=scan_fields; f->name; f++) {
+		if (strcmp(f->name, s)==0) {
+			return f;
+		}
+	}
+	rb_raise(rb_eArgError, "unknown field: %s", s);
+	return NULL;
+}
 
-	return self;
+// wrap a packed buffer as a read-only IO::Buffer when the running Ruby has one
+static VALUE column_buffer(const void *data, size_t size)
+{
+	VALUE str = rb_str_new((const char *)data, size);
+	if (rb_const_defined(rb_cIO, rb_intern("Buffer"))) {
+		rb_obj_freeze(str);
+		return rb_funcall(rb_const_get(rb_cIO, rb_intern("Buffer")), rb_intern("for"), 1, str);
+	}
+	return str;
 }
 
-VALUE rb_output_param_set_use_fuji_rotate(VALUE self, VALUE val)
+// Arrow validity bitmap: LSB first, 1 = valid
+static VALUE column_validity(std::vector<int> &errors)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	std::vector<unsigned char> bits((errors.size() + 7) / 8, 0);
+	for (size_t i=0; i<errors.size(); i++) {
+		if (errors[i]==LIBRAW_SUCCESS) {
+			bits[i / 8] |= 1 << (i % 8);
+		}
+	}
+	return column_buffer(bits.size() ? &bits[0] : NULL, bits.size());
+}
 
-	params->use_fuji_rotate = !(val==Qnil || val==Qfalse);
+static VALUE new_column(const char *name, const char *type, size_t length, VALUE data, VALUE offsets, VALUE validity)
+{
+	return rb_struct_new(rb_cColumn, ID2SYM(rb_intern(name)), ID2SYM(rb_intern(type)), SIZET2NUM(length), data, offsets, validity);
+}
 
-	apply_output_param(self, params);
 
-	return self;
-}
+// LibRaw
 
-VALUE rb_output_param_set_fbdd_noiserd(VALUE self, VALUE val)
+// every shot of a multi-shot raw, processed in parallel from one mapping of the file
+VALUE rb_lib_raw_process_frames(int argc, VALUE *argv, VALUE self)
 {
-	libraw_output_params_t *params = get_output_params(self);
+	VALUE filename = Qnil, param = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "2:", &filename, &param, &opts);
 
-	params->fbdd_noiserd = NUM2LONG(val);
+	ID kwargs[1] = { rb_intern("threads") };
+	VALUE vals[1] = { Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 1, vals);
+	}
+	int threads = vals[0]!=Qundef ? NUM2INT(vals[0]) : native_thread_count();
+	libraw_output_params_t params = *get_output_params(param);
+	VALUE path = rb_str_new_frozen(rb_get_path(filename));
 
-	apply_output_param(self, params);
+	FrameSource source;
+	map_frame_source(RSTRING_PTR(path), &source);
 
-	return self;
-}
+	LibRaw *probe = NULL;
+	try {
+		probe = new LibRaw(LIBRAW_OPTIONS_NONE);
+	} catch (std::bad_alloc&) {
+		unmap_frame_source(&source);
+		check_errors(LIBRAW_UNSUFFICIENT_MEMORY);
+	}
+	int ret = probe->open_buffer((void *)source.data, source.size);
+	int frames = probe->imgdata.idata.raw_count ? probe->imgdata.idata.raw_count : 1;
+	threads = frame_threads(threads, frames, probe);
+	delete probe;
+	if (ret!=LIBRAW_SUCCESS) {
+		unmap_frame_source(&source);
+		check_errors(ret);
+	}
 
+	VALUE result = Qnil;
+	{
+		std::vector<libraw_processed_image_t *> images(frames);
+		ret = decode_frames(source, params, 0, frames, threads, &images[0]);
+		unmap_frame_source(&source);
+		if (ret==LIBRAW_SUCCESS) {
+			result = rb_ary_new2(frames);
+			for (int i=0; i<frames; i++) {
+				rb_ary_push(result, new_processed_image(images[i]));
+			}
+		} else {
+			free_frames(&images[0], frames);
+		}
+	}
+	check_errors(ret);
 
-// LibRaw::MakerNote
+	return result;
+}
 
-void apply_makernote(VALUE self, libraw_makernotes_lens_t *p)
+// open (and optionally unpack) every path on native threads and report
+// each outcome as a LibRaw::Result, without raising for bad inputs
+VALUE rb_lib_raw_batch_open(int argc, VALUE *argv, VALUE self)
 {
-	if (p) {
-		rb_iv_set(self, "@lens_id", INT2FIX(p->LensID));
-		rb_iv_set(self, "@lens", rb_str_new2(p->Lens));
-		rb_iv_set(self, "@lens_format", INT2FIX(p->LensFormat));
-		rb_iv_set(self, "@lens_mount", INT2FIX(p->LensMount));
-		rb_iv_set(self, "@cam_id", INT2FIX(p->CamID));
-		rb_iv_set(self, "@camera_format", INT2FIX(p->CameraFormat));
-		rb_iv_set(self, "@camera_mount", INT2FIX(p->CameraMount));
-		rb_iv_set(self, "@body", rb_str_new2(p->body));
-		rb_iv_set(self, "@focal_type", INT2FIX(p->FocalType));
-		rb_iv_set(self, "@lens_features_pre", rb_str_new2(p->LensFeatures_pre));
-		rb_iv_set(self, "@lens_features_suf", rb_str_new2(p->LensFeatures_suf));
-		rb_iv_set(self, "@min_focal", rb_float_new(p->MinFocal));
-		rb_iv_set(self, "@max_focal", rb_float_new(p->MaxFocal));
-		rb_iv_set(self, "@max_ap_4_min_focal", rb_float_new(p->MaxAp4MinFocal));
-		rb_iv_set(self, "@max_ap_4_max_focal", rb_float_new(p->MaxAp4MaxFocal));
-		rb_iv_set(self, "@min_ap_4_min_focal", rb_float_new(p->MinAp4MinFocal));
-		rb_iv_set(self, "@min_ap_4_max_focal", rb_float_new(p->MinAp4MaxFocal));
-		rb_iv_set(self, "@max_ap", rb_float_new(p->MaxAp));
-		rb_iv_set(self, "@min_ap", rb_float_new(p->MinAp));
-		rb_iv_set(self, "@cur_focal", rb_float_new(p->CurFocal));
-		rb_iv_set(self, "@cur_ap", rb_float_new(p->CurAp));
-		rb_iv_set(self, "@max_ap_4_cur_focal", rb_float_new(p->MaxAp4CurFocal));
-		rb_iv_set(self, "@min_ap_4_cur_focal", rb_float_new(p->MinAp4CurFocal));
-		rb_iv_set(self, "@lens_f_stops", rb_float_new(p->LensFStops));
-		rb_iv_set(self, "@teleconverter_id", INT2FIX(p->TeleconverterID));
-		rb_iv_set(self, "@teleconverter", rb_str_new2(p->Teleconverter));
-		rb_iv_set(self, "@adapter_id", INT2FIX(p->AdapterID));
-		rb_iv_set(self, "@adapter", rb_str_new2(p->Adapter));
-		rb_iv_set(self, "@attachment_id", INT2FIX(p->AttachmentID));
-		rb_iv_set(self, "@attachment", rb_str_new2(p->Attachment));
-		rb_iv_set(self, "@canon_focal_units", INT2FIX(p->CanonFocalUnits));
-		rb_iv_set(self, "@focal_length_in_35mm_format", rb_float_new(p->FocalLengthIn35mmFormat));
+	VALUE paths = Qnil, opts = Qnil;
+	rb_scan_args(argc, argv, "1:", &paths, &opts);
+	Check_Type(paths, T_ARRAY);
+
+	ID kwargs[2] = { rb_intern("unpack"), rb_intern("threads") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
+	bool unpack = vals[0]!=Qundef && RTEST(vals[0]);
+	int threads = vals[1]!=Qundef ? NUM2INT(vals[1]) : native_thread_count();
+	if (threads<1) {
+		threads = 1;
 	}
-}
 
+	size_t count = RARRAY_LEN(paths);
+	VALUE names = rb_ary_new2(count);
+	std::vector<std::string> files(count);
+	for (size_t i=0; i<count; i++) {
+		VALUE path = rb_str_new_frozen(rb_get_path(rb_ary_entry(paths, i)));
+		rb_ary_push(names, path);
+		files[i] = RSTRING_PTR(path);
+	}
+	std::vector<int> codes(count, LIBRAW_UNSUFFICIENT_MEMORY);
+	std::vector<unsigned> warnings(count, 0);
+	double timeout = memory_budget_wait();
+
+	call_without_gvl([&]() {
+		std::atomic<size_t> next(0);
+		parallel_for(threads, threads, [&](int begin, int end, int t) {
+			LibRaw *libraw = NULL;
+			try {
+				libraw = new LibRaw(LIBRAW_OPTIONS_NONE);
+			} catch (std::bad_alloc&) {
+				return;
+			}
+
+			for (size_t i=next++; i<count; i=next++) {
+				int ret = libraw->open_file(files[i].c_str());
+				if (ret==LIBRAW_SUCCESS && unpack) {
+					MemoryReservation reservation(unpack_memory_estimate(libraw), timeout);
+					ret = reservation.held ? libraw->unpack() : LIBRAW_UNSUFFICIENT_MEMORY;
+				}
+				codes[i] = ret;
+				warnings[i] = libraw->imgdata.process_warnings;
+				libraw->recycle();
+			}
+
+			delete libraw;
+		});
+	});
+
+	VALUE result = rb_ary_new2(count);
+	for (size_t i=0; i<count; i++) {
+		rb_ary_push(result, new_result(rb_ary_entry(names, i), codes[i], warnings[i]));
+	}
+	return result;
+}
 
-// LibRaw::LensInfo
+VALUE rb_result_success_p(VALUE self)
+{
+	return rb_struct_getmember(self, rb_intern("code"))==INT2FIX(LIBRAW_SUCCESS) ? Qtrue : Qfalse;
+}
 
-void apply_lensinfo(VALUE self, libraw_lensinfo_t *p)
+VALUE rb_lib_raw_scan(int argc, VALUE *argv, VALUE self)
 {
-	if (p) {
-		rb_iv_set(self, "@min_focal", rb_float_new(p->MinFocal));
-		rb_iv_set(self, "@max_focal", rb_float_new(p->MaxFocal));
-		rb_iv_set(self, "@max_ap_4_min_focal", rb_float_new(p->MaxAp4MinFocal));
-		rb_iv_set(self, "@max_ap_4_max_focal", rb_float_new(p->MaxAp4MaxFocal));
-		rb_iv_set(self, "@exif_max_ap", rb_float_new(p->EXIF_MaxAp));
-		rb_iv_set(self, "@lens_make", rb_str_new2(p->LensMake));
-		rb_iv_set(self, "@lens", rb_str_new2(p->Lens));
-		rb_iv_set(self, "@focal_length_in_35mm_format", INT2FIX(p->FocalLengthIn35mmFormat));
-		// TODO: nikon
-		// TODO: dng
+	VALUE paths, opts;
+	rb_scan_args(argc, argv, "1:", &paths, &opts);
 
-		// makernotes
-		VALUE makernotes = rb_iv_get(self, "@makernotes");
-		if (makernotes==Qnil) {
-			makernotes = rb_class_new_instance(0, NULL, rb_cMakerNote);
-			rb_iv_set(self, "@makernotes", makernotes);
+	ID kwargs[2] = { rb_intern("fields"), rb_intern("threads") };
+	VALUE vals[2] = { Qundef, Qundef };
+	if (opts!=Qnil) {
+		rb_get_kwargs(opts, kwargs, 0, 2, vals);
+	}
+
+	paths = rb_Array(paths);
+	size_t count = RARRAY_LEN(paths);
+	std::vector<std::string> names(count);
+	for (size_t i=0; i<count; i++) {
+		VALUE path = rb_get_path(RARRAY_AREF(paths, i));
+		names[i].assign(RSTRING_PTR(path), RSTRING_LEN(path));
+	}
+
+	std::vector<ScanColumn> columns;
+	if (vals[0]==Qundef || vals[0]==Qnil) {
+		for (const char **name=scan_default_fields; *name; name++) {
+			columns.push_back(ScanColumn());
+			columns.back().field = find_scan_field(ID2SYM(rb_intern(*name)));
 		}
-		apply_makernote(makernotes, &p->makernotes);
+	} else {
+		VALUE fields = rb_Array(vals[0]);
+		for (long i=0; i<RARRAY_LEN(fields); i++) {
+			columns.push_back(ScanColumn());
+			columns.back().field = find_scan_field(RARRAY_AREF(fields, i));
+		}
+	}
+	for (size_t i=0; i<columns.size(); i++) {
+		if (columns[i].field->type==SCAN_UTF8) {
+			columns[i].strings.resize(count);
+		} else {
+			columns[i].data.assign(count * scan_type_sizes[columns[i].field->type], 0);
+		}
+	}
+
+	int threads = vals[1]==Qundef || vals[1]==Qnil ? native_thread_count() : NUM2INT(vals[1]);
+	if (threads<1) {
+		threads = 1;
+	}
+	// files a worker never reaches (it could not allocate its LibRaw) stay
+	// invalid in the validity bitmap
+	std::vector<int> errors(count, LIBRAW_UNSUFFICIENT_MEMORY);
+
+	call_without_gvl([&]() {
+		std::atomic<size_t> next(0);
+		parallel_for(threads, threads, [&](int begin, int end, int t) {
+			LibRaw *libraw = NULL;
+			try {
+				libraw = new LibRaw(LIBRAW_OPTIONS_NONE);
+			} catch (std::bad_alloc&) {
+				return;
+			}
+
+			// files differ a lot in parse cost, so hand them out one at a time
+			for (size_t i=next++; i<count; i=next++) {
+				int ret = libraw->open_file(names[i].c_str());
+				errors[i] = ret;
+				if (ret==LIBRAW_SUCCESS) {
+					const char *base = (const char *)&libraw->imgdata;
+					for (size_t c=0; c<columns.size(); c++) {
+						const ScanField *f = columns[c].field;
+						if (f->type==SCAN_UTF8) {
+							try {
+								columns[c].strings[i] = base + f->offset;
+							} catch (std::bad_alloc&) {
+								errors[i] = LIBRAW_UNSUFFICIENT_MEMORY;
+							}
+						} else if (f->type==SCAN_INT64) {
+							long long v = *(const time_t *)(base + f->offset);
+							memcpy(&columns[c].data[i * 8], &v, 8);
+						} else {
+							size_t size = scan_type_sizes[f->type];
+							memcpy(&columns[c].data[i * size], base + f->offset, size);
+						}
+					}
+				}
+				libraw->recycle();
+			}
+
+			delete libraw;
+		});
+	});
+
+	VALUE validity = column_validity(errors);
+	VALUE result = rb_hash_new();
+	for (size_t c=0; c<columns.size(); c++) {
+		const ScanField *f = columns[c].field;
+		VALUE data, offsets = Qnil;
+		if (f->type==SCAN_UTF8) {
+			// Arrow utf8 layout: int32 offsets (length + 1) into one data buffer
+			std::vector<int> offs(count + 1, 0);
+			std::string bytes;
+			for (size_t i=0; i<count; i++) {
+				bytes += columns[c].strings[i];
+				offs[i + 1] = bytes.size();
+			}
+			data = column_buffer(bytes.data(), bytes.size());
+			offsets = column_buffer(&offs[0], offs.size() * sizeof(int));
+		} else {
+			data = column_buffer(columns[c].data.size() ? &columns[c].data[0] : NULL, columns[c].data.size());
+		}
+		rb_hash_aset(result, ID2SYM(rb_intern(f->name)), new_column(f->name, scan_type_names[f->type], count, data, offsets, validity));
 	}
+
+	// error code per path, always valid
+	VALUE error_data = column_buffer(count ? &errors[0] : NULL, count * sizeof(int));
+	rb_hash_aset(result, ID2SYM(rb_intern("error")), new_column("error", "int32", count, error_data, Qnil, Qnil));
+
+	return result;
 }
 
 
@@ -858,9 +7031,40 @@ extern "C" void Init_lib_raw(void)
 {
 	rb_mLibRaw = rb_define_module("LibRaw");
 
+	rb_define_module_function(rb_mLibRaw, "identify", RUBY_METHOD_FUNC(rb_lib_raw_identify), -1);
+	rb_define_module_function(rb_mLibRaw, "scan", RUBY_METHOD_FUNC(rb_lib_raw_scan), -1);
+	rb_define_module_function(rb_mLibRaw, "batch_open", RUBY_METHOD_FUNC(rb_lib_raw_batch_open), -1);
+	rb_define_module_function(rb_mLibRaw, "process_frames", RUBY_METHOD_FUNC(rb_lib_raw_process_frames), -1);
+	rb_define_module_function(rb_mLibRaw, "threads", RUBY_METHOD_FUNC(rb_lib_raw_threads), 0);
+	rb_define_module_function(rb_mLibRaw, "threads=", RUBY_METHOD_FUNC(rb_lib_raw_set_threads), 1);
+	rb_define_module_function(rb_mLibRaw, "memory_budget", RUBY_METHOD_FUNC(rb_lib_raw_memory_budget), 0);
+	rb_define_module_function(rb_mLibRaw, "memory_budget=", RUBY_METHOD_FUNC(rb_lib_raw_set_memory_budget), 1);
+	rb_define_module_function(rb_mLibRaw, "memory_budget_timeout", RUBY_METHOD_FUNC(rb_lib_raw_memory_budget_timeout), 0);
+	rb_define_module_function(rb_mLibRaw, "memory_budget_timeout=", RUBY_METHOD_FUNC(rb_lib_raw_set_memory_budget_timeout), 1);
+	rb_define_module_function(rb_mLibRaw, "memory_reserved", RUBY_METHOD_FUNC(rb_lib_raw_memory_reserved), 0);
+	rb_define_module_function(rb_mLibRaw, "buffer_pool_limit", RUBY_METHOD_FUNC(rb_lib_raw_buffer_pool_limit), 0);
+	rb_define_module_function(rb_mLibRaw, "buffer_pool_limit=", RUBY_METHOD_FUNC(rb_lib_raw_set_buffer_pool_limit), 1);
+	rb_define_module_function(rb_mLibRaw, "huge_pages", RUBY_METHOD_FUNC(rb_lib_raw_huge_pages), 0);
+	rb_define_module_function(rb_mLibRaw, "huge_pages=", RUBY_METHOD_FUNC(rb_lib_raw_set_huge_pages), 1);
+	rb_define_module_function(rb_mLibRaw, "buffer_pool_stats", RUBY_METHOD_FUNC(rb_lib_raw_buffer_pool_stats), 0);
+	rb_define_module_function(rb_mLibRaw, "buffer_pool_trim", RUBY_METHOD_FUNC(rb_lib_raw_buffer_pool_trim), 0);
+	rb_define_module_function(rb_mLibRaw, "tune_malloc", RUBY_METHOD_FUNC(rb_lib_raw_tune_malloc), -1);
+
 
 	// const
 
+	// whether LibRaw.threads= has an effect
+#ifdef _OPENMP
+	rb_define_const(rb_mLibRaw, "OPENMP", Qtrue);
+#else
+	rb_define_const(rb_mLibRaw, "OPENMP", Qfalse);
+#endif
+
+	// LibRaw refuses raw data larger than this; fixed when LibRaw is built
+#ifdef LIBRAW_MAX_ALLOC_MB
+	rb_define_const(rb_mLibRaw, "MAX_ALLOC_MB", LONG2NUM(LIBRAW_MAX_ALLOC_MB));
+#endif
+
 	// LibRaw::ColormatrixType
 
 	rb_mColormatrixType = rb_define_module_under(rb_mLibRaw, "ColormatrixType");
@@ -1033,18 +7237,40 @@ extern "C" void Init_lib_raw(void)
 	rb_define_attr(rb_cRawObject, "idata", 1, 0);
 	rb_define_attr(rb_cRawObject, "lens", 1, 0);
 	rb_define_attr(rb_cRawObject, "other", 1, 0);
+	rb_define_attr(rb_cRawObject, "color", 1, 0);
 	rb_define_attr(rb_cRawObject, "param", 1, 0);
+	rb_define_attr(rb_cRawObject, "process_plan", 1, 0);
 
 	rb_define_method(rb_cRawObject, "initialize", RUBY_METHOD_FUNC(rb_raw_object_initialize), 0);
-	rb_define_method(rb_cRawObject, "open_file", RUBY_METHOD_FUNC(rb_raw_object_open_file), 1);
-	rb_define_method(rb_cRawObject, "open_buffer", RUBY_METHOD_FUNC(rb_raw_object_open_buffer), 1);
-	rb_define_method(rb_cRawObject, "unpack", RUBY_METHOD_FUNC(rb_raw_object_unpack), 0);
-	rb_define_method(rb_cRawObject, "unpack_thumb", RUBY_METHOD_FUNC(rb_raw_object_unpack_thumb), 0);
+	rb_define_method(rb_cRawObject, "open_file", RUBY_METHOD_FUNC(rb_raw_object_open_file), -1);
+	rb_define_method(rb_cRawObject, "open_buffer", RUBY_METHOD_FUNC(rb_raw_object_open_buffer), -1);
+	rb_define_method(rb_cRawObject, "open_range", RUBY_METHOD_FUNC(rb_raw_object_open_range), -1);
+	rb_define_method(rb_cRawObject, "range_stats", RUBY_METHOD_FUNC(rb_raw_object_range_stats), 0);
+	rb_define_method(rb_cRawObject, "unpack", RUBY_METHOD_FUNC(rb_raw_object_unpack), -1);
+	rb_define_method(rb_cRawObject, "unpack_thumb", RUBY_METHOD_FUNC(rb_raw_object_unpack_thumb), -1);
+	rb_define_method(rb_cRawObject, "warnings", RUBY_METHOD_FUNC(rb_raw_object_warnings), 0);
+	rb_define_method(rb_cRawObject, "memory_estimate", RUBY_METHOD_FUNC(rb_raw_object_memory_estimate), -1);
+	rb_define_method(rb_cRawObject, "thumbnail_location", RUBY_METHOD_FUNC(rb_raw_object_thumbnail_location), 0);
 	rb_define_method(rb_cRawObject, "recycle_datastream", RUBY_METHOD_FUNC(rb_raw_object_recycle_datastream), 0);
 	rb_define_method(rb_cRawObject, "recycle", RUBY_METHOD_FUNC(rb_raw_object_recycle), 0);
 	rb_define_method(rb_cRawObject, "dcraw_ppm_tiff_writer", RUBY_METHOD_FUNC(rb_raw_object_dcraw_ppm_tiff_writer), 1);
 	rb_define_method(rb_cRawObject, "dcraw_thumb_writer", RUBY_METHOD_FUNC(rb_raw_object_dcraw_thumb_writer), 1);
-	rb_define_method(rb_cRawObject, "dcraw_process", RUBY_METHOD_FUNC(rb_raw_object_dcraw_process), 1);
+	rb_define_method(rb_cRawObject, "dcraw_process", RUBY_METHOD_FUNC(rb_raw_object_dcraw_process), -1);
+	rb_define_method(rb_cRawObject, "calibrate", RUBY_METHOD_FUNC(rb_raw_object_calibrate), 1);
+	rb_define_method(rb_cRawObject, "raw_histogram", RUBY_METHOD_FUNC(rb_raw_object_raw_histogram), -1);
+	rb_define_method(rb_cRawObject, "image_histogram", RUBY_METHOD_FUNC(rb_raw_object_image_histogram), -1);
+	rb_define_method(rb_cRawObject, "stats", RUBY_METHOD_FUNC(rb_raw_object_stats), -1);
+	rb_define_method(rb_cRawObject, "processed_image", RUBY_METHOD_FUNC(rb_raw_object_processed_image), -1);
+	rb_define_method(rb_cRawObject, "process_region", RUBY_METHOD_FUNC(rb_raw_object_process_region), 5);
+	rb_define_method(rb_cRawObject, "each_frame", RUBY_METHOD_FUNC(rb_raw_object_each_frame), -1);
+	rb_define_method(rb_cRawObject, "render_progressive", RUBY_METHOD_FUNC(rb_raw_object_render_progressive), -1);
+	rb_define_method(rb_cRawObject, "process_variants", RUBY_METHOD_FUNC(rb_raw_object_process_variants), -1);
+	rb_define_method(rb_cRawObject, "tile_pyramid", RUBY_METHOD_FUNC(rb_raw_object_tile_pyramid), -1);
+	rb_define_method(rb_cRawObject, "renditions", RUBY_METHOD_FUNC(rb_raw_object_renditions), -1);
+	rb_define_method(rb_cRawObject, "save_unpacked", RUBY_METHOD_FUNC(rb_raw_object_save_unpacked), -1);
+	rb_define_singleton_method(rb_cRawObject, "load_unpacked", RUBY_METHOD_FUNC(rb_raw_object_s_load_unpacked), 1);
+	rb_define_method(rb_cRawObject, "content_digest", RUBY_METHOD_FUNC(rb_raw_object_content_digest), 0);
+	rb_define_method(rb_cRawObject, "perceptual_hash", RUBY_METHOD_FUNC(rb_raw_object_perceptual_hash), 0);
 
 
 	// LibRaw::IParam
@@ -1079,6 +7305,25 @@ extern "C" void Init_lib_raw(void)
 	rb_define_attr(rb_cImageSize, "flip", 1, 0);
 
 
+	// LibRaw::ColorData
+
+	rb_cColorData = rb_define_class_under(rb_mLibRaw, "ColorData", rb_cObject);
+
+	rb_define_attr(rb_cColorData, "black", 1, 0);
+	rb_define_attr(rb_cColorData, "cblack", 1, 0);
+	rb_define_attr(rb_cColorData, "data_maximum", 1, 0);
+	rb_define_attr(rb_cColorData, "maximum", 1, 0);
+	rb_define_attr(rb_cColorData, "cam_mul", 1, 0);
+	rb_define_attr(rb_cColorData, "pre_mul", 1, 0);
+	rb_define_attr(rb_cColorData, "cmatrix", 1, 0);
+	rb_define_attr(rb_cColorData, "rgb_cam", 1, 0);
+	rb_define_attr(rb_cColorData, "cam_xyz", 1, 0);
+	rb_define_attr(rb_cColorData, "flash_used", 1, 0);
+	rb_define_attr(rb_cColorData, "canon_ev", 1, 0);
+	rb_define_attr(rb_cColorData, "model2", 1, 0);
+	rb_define_attr(rb_cColorData, "baseline_exposure", 1, 0);
+
+
 	// LibRaw::ImgOther
 
 	rb_cImgOther = rb_define_class_under(rb_mLibRaw, "ImgOther", rb_cObject);
@@ -1097,6 +7342,11 @@ extern "C" void Init_lib_raw(void)
 
 	rb_cOutputParam = rb_define_class_under(rb_mLibRaw, "OutputParam", rb_cObject);
 
+#ifdef HAVE_RUBY_RACTOR_H
+	// only touch the receiver (and the shareable preset registry)
+	rb_ext_ractor_safe(true);
+#endif
+
 	rb_define_attr(rb_cOutputParam, "shot_select", 1, 0);
 	rb_define_attr(rb_cOutputParam, "bright", 1, 0);
 	rb_define_attr(rb_cOutputParam, "threshold", 1, 0);
@@ -1159,7 +7409,21 @@ extern "C" void Init_lib_raw(void)
 
 	rb_define_attr(rb_cOutputParam, "coolscan_nef_gamma", 1, 0);
 
+	rb_define_attr(rb_cOutputParam, "name", 1, 0);
+
+	rb_define_singleton_method(rb_cOutputParam, "preset", RUBY_METHOD_FUNC(rb_output_param_s_preset), -1);
+	// seeded so registering never grows the class ivar table under the lock
+	VALUE presets = rb_obj_freeze(rb_hash_new());
+#ifdef HAVE_RUBY_RACTOR_H
+	rb_ractor_make_shareable(presets);
+#endif
+	rb_ivar_set(rb_cOutputParam, rb_intern("presets"), presets);
+
 	rb_define_method(rb_cOutputParam, "initialize", RUBY_METHOD_FUNC(rb_output_param_initialize), 0);
+	rb_define_method(rb_cOutputParam, "initialize_copy", RUBY_METHOD_FUNC(rb_output_param_initialize_copy), 1);
+	rb_define_method(rb_cOutputParam, "==", RUBY_METHOD_FUNC(rb_output_param_equal), 1);
+	rb_define_method(rb_cOutputParam, "eql?", RUBY_METHOD_FUNC(rb_output_param_equal), 1);
+	rb_define_method(rb_cOutputParam, "hash", RUBY_METHOD_FUNC(rb_output_param_hash), 0);
 	rb_define_method(rb_cOutputParam, "greybox", RUBY_METHOD_FUNC(rb_output_param_greybox), 4);
 	rb_define_method(rb_cOutputParam, "cropbox", RUBY_METHOD_FUNC(rb_output_param_cropbox), 4);
 	rb_define_method(rb_cOutputParam, "gamma", RUBY_METHOD_FUNC(rb_output_param_gamma), 2);
@@ -1183,6 +7447,10 @@ extern "C" void Init_lib_raw(void)
 	rb_define_method(rb_cOutputParam, "no_auto_bright=", RUBY_METHOD_FUNC(rb_output_param_set_no_auto_bright), 1);
 	rb_define_method(rb_cOutputParam, "use_fuji_rotate=", RUBY_METHOD_FUNC(rb_output_param_set_use_fuji_rotate), 1);
 	rb_define_method(rb_cOutputParam, "fbdd_noiserd=", RUBY_METHOD_FUNC(rb_output_param_set_fbdd_noiserd), 1);
+	rb_define_method(rb_cOutputParam, "shot_select=", RUBY_METHOD_FUNC(rb_output_param_set_shot_select), 1);
+#ifdef HAVE_RUBY_RACTOR_H
+	rb_ext_ractor_safe(false);
+#endif
 
 
 	// LibRaw::MakerNote
@@ -1239,6 +7507,82 @@ extern "C" void Init_lib_raw(void)
 	rb_define_attr(rb_cLensInfo, "makernotes", 1, 0);
 
 
+	// LibRaw::ProcessedImage
+
+	rb_cProcessedImage = rb_define_class_under(rb_mLibRaw, "ProcessedImage", rb_cObject);
+	rb_undef_method(CLASS_OF(rb_cProcessedImage), "new");
+
+	rb_define_attr(rb_cProcessedImage, "type", 1, 0);
+	rb_define_attr(rb_cProcessedImage, "format", 1, 0);
+	rb_define_attr(rb_cProcessedImage, "width", 1, 0);
+	rb_define_attr(rb_cProcessedImage, "height", 1, 0);
+	rb_define_attr(rb_cProcessedImage, "colors", 1, 0);
+	rb_define_attr(rb_cProcessedImage, "bits", 1, 0);
+	rb_define_attr(rb_cProcessedImage, "data_size", 1, 0);
+
+	rb_define_singleton_method(rb_cProcessedImage, "open_shared", RUBY_METHOD_FUNC(rb_processed_image_s_open_shared), 1);
+
+	rb_define_method(rb_cProcessedImage, "data", RUBY_METHOD_FUNC(rb_processed_image_data), 0);
+	rb_define_method(rb_cProcessedImage, "descriptor", RUBY_METHOD_FUNC(rb_processed_image_descriptor), 0);
+	rb_define_method(rb_cProcessedImage, "apply_color", RUBY_METHOD_FUNC(rb_processed_image_apply_color), -1);
+
+
+	// LibRaw::Calibration
+
+	rb_cCalibration = rb_define_class_under(rb_mLibRaw, "Calibration", rb_cObject);
+	rb_undef_method(CLASS_OF(rb_cCalibration), "new");
+	rb_define_singleton_method(rb_cCalibration, "load", RUBY_METHOD_FUNC(rb_calibration_s_load), -1);
+
+	rb_define_attr(rb_cCalibration, "dark_frame", 1, 0);
+	rb_define_attr(rb_cCalibration, "bad_pixels", 1, 0);
+	rb_define_attr(rb_cCalibration, "width", 1, 0);
+	rb_define_attr(rb_cCalibration, "height", 1, 0);
+	rb_define_attr(rb_cCalibration, "bad_pixel_count", 1, 0);
+
+
+	// LibRaw::MetadataIndex
+
+	rb_cMetadataIndex = rb_define_class_under(rb_mLibRaw, "MetadataIndex", rb_cObject);
+
+	rb_define_attr(rb_cMetadataIndex, "path", 1, 0);
+
+	rb_define_method(rb_cMetadataIndex, "initialize", RUBY_METHOD_FUNC(rb_metadata_index_initialize), -1);
+	rb_define_method(rb_cMetadataIndex, "lookup", RUBY_METHOD_FUNC(rb_metadata_index_lookup), -1);
+	rb_define_method(rb_cMetadataIndex, "store", RUBY_METHOD_FUNC(rb_metadata_index_store), -1);
+	rb_define_method(rb_cMetadataIndex, "identify", RUBY_METHOD_FUNC(rb_metadata_index_identify), -1);
+	rb_define_method(rb_cMetadataIndex, "count", RUBY_METHOD_FUNC(rb_metadata_index_count), 0);
+	rb_define_method(rb_cMetadataIndex, "close", RUBY_METHOD_FUNC(rb_metadata_index_close), 0);
+
+
+	// LibRaw::RenderCache
+
+	rb_cRenderCache = rb_define_class_under(rb_mLibRaw, "RenderCache", rb_cObject);
+
+	rb_define_attr(rb_cRenderCache, "max_bytes", 1, 0);
+	rb_define_attr(rb_cRenderCache, "dir", 1, 0);
+
+	rb_define_method(rb_cRenderCache, "initialize", RUBY_METHOD_FUNC(rb_render_cache_initialize), -1);
+	rb_define_method(rb_cRenderCache, "fetch", RUBY_METHOD_FUNC(rb_render_cache_fetch), -1);
+	rb_define_method(rb_cRenderCache, "stats", RUBY_METHOD_FUNC(rb_render_cache_stats), 0);
+	rb_define_method(rb_cRenderCache, "clear", RUBY_METHOD_FUNC(rb_render_cache_clear), 0);
+
+
+	// LibRaw::Column
+
+	rb_cColumn = rb_struct_define_under(rb_mLibRaw, "Column", "name", "type", "length", "data", "offsets", "validity", NULL);
+
+
+	// LibRaw::Result
+
+	rb_cResult = rb_struct_define_under(rb_mLibRaw, "Result", "path", "code", "message", "warnings", NULL);
+	rb_define_method(rb_cResult, "success?", RUBY_METHOD_FUNC(rb_result_success_p), 0);
+
+
+	// LibRaw::Rendition
+
+	rb_cRendition = rb_struct_define_under(rb_mLibRaw, "Rendition", "size", "format", "width", "height", "data", NULL);
+
+
 	// Error
 
 	// LibRaw::RawError
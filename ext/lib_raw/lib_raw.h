@@ -8,12 +8,57 @@
 
 typedef struct {
 	LibRaw *libraw;
+	int busy;
+	int exclusive;
 } LibRawNativeResource;
 
 typedef struct {
 	libraw_output_params_t params;
 } OutputParamNativeResource;
 
+enum ProcessedImageStorage {
+	PROCESSED_IMAGE_NONE,
+	PROCESSED_IMAGE_LIBRAW,
+	PROCESSED_IMAGE_MALLOC,
+	PROCESSED_IMAGE_SHARED
+};
+
+enum ProcessedImageSampleFormat {
+	PROCESSED_IMAGE_UNSIGNED,
+	PROCESSED_IMAGE_FLOAT
+};
+
+typedef struct {
+	int type;
+	int width;
+	int height;
+	int colors;
+	int bits;
+	enum ProcessedImageSampleFormat sample_format;
+	unsigned char *data;
+	size_t data_size;
+	enum ProcessedImageStorage storage;
+	void *base;
+	size_t map_size;
+	int fd;
+} ProcessedImageNativeResource;
+
+typedef struct {
+	int width;
+	int height;
+	unsigned short *dark;
+	size_t bad_pixel_count;
+	int *bad_pixels;
+} CalibrationNativeResource;
+
+typedef struct {
+	int fd;
+	void *map;
+	size_t map_size;
+	char *path;
+	unsigned long long initial_capacity;
+} MetadataIndexNativeResource;
+
 
 extern VALUE rb_mLibRaw;
 
@@ -31,9 +76,17 @@ extern VALUE rb_cRawObject;
 
 extern VALUE rb_cIParam;
 extern VALUE rb_cImageSize;
+extern VALUE rb_cColorData;
 extern VALUE rb_cOutputParam;
 extern VALUE rb_cMakerNote;
 extern VALUE rb_cLensInfo;
+extern VALUE rb_cMetadataIndex;
+extern VALUE rb_cRenderCache;
+extern VALUE rb_cColumn;
+extern VALUE rb_cProcessedImage;
+extern VALUE rb_cCalibration;
+extern VALUE rb_cResult;
+extern VALUE rb_cRendition;
 
 extern VALUE rb_eRawError;
 extern VALUE rb_eUnspecifiedError;
@@ -53,23 +106,55 @@ extern VALUE rb_eBadCrop;
 // LibRaw Native Resource
 extern void lib_raw_native_resource_delete(LibRawNativeResource * p);
 extern void output_param_native_resource_delete(OutputParamNativeResource * p);
+extern void processed_image_native_resource_delete(ProcessedImageNativeResource * p);
+extern void calibration_native_resource_delete(CalibrationNativeResource * p);
+extern void metadata_index_native_resource_delete(MetadataIndexNativeResource * p);
 extern LibRaw* get_lib_raw(VALUE self);
+extern libraw_output_params_t* get_output_params(VALUE self);
+extern libraw_output_params_t* get_mutable_output_params(VALUE self);
 extern void copy_lib_raw(VALUE dst, VALUE src);
 extern void check_errors(int e);
 
+// Native Worker
+extern int native_thread_count(void);
+
+// Buffer Pool
+extern void *buffer_pool_alloc(size_t size);
+extern void buffer_pool_free(void *p);
+
 // LibRaw::RawObject
 extern void apply_rawobject(VALUE self);
 extern void apply_data(VALUE self, libraw_data_t *p);
 extern VALUE rb_raw_object_initialize(VALUE self);
-extern VALUE rb_raw_object_open_file(VALUE self, VALUE filename);
-extern VALUE rb_raw_object_open_buffer(VALUE self, VALUE buff);
-extern VALUE rb_raw_object_unpack(VALUE self);
-extern VALUE rb_raw_object_unpack_thumb(VALUE self);
+extern VALUE rb_raw_object_open_file(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_open_buffer(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_open_range(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_range_stats(VALUE self);
+extern VALUE rb_raw_object_unpack(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_unpack_thumb(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_warnings(VALUE self);
+extern VALUE rb_raw_object_memory_estimate(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_thumbnail_location(VALUE self);
 extern VALUE rb_raw_object_recycle_datastream(VALUE self);
 extern VALUE rb_raw_object_recycle(VALUE self);
 extern VALUE rb_raw_object_dcraw_ppm_tiff_writer(VALUE self, VALUE filename);
 extern VALUE rb_raw_object_dcraw_thumb_writer(VALUE self, VALUE filename);
-extern VALUE rb_raw_object_dcraw_process(VALUE self, VALUE param);
+extern VALUE rb_raw_object_dcraw_process(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_calibrate(VALUE self, VALUE calibration);
+extern VALUE rb_raw_object_processed_image(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_process_region(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h, VALUE param);
+extern VALUE rb_raw_object_render_progressive(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_each_frame(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_process_variants(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_tile_pyramid(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_renditions(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_save_unpacked(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_s_load_unpacked(VALUE klass, VALUE source);
+extern VALUE rb_raw_object_raw_histogram(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_image_histogram(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_stats(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_raw_object_content_digest(VALUE self);
+extern VALUE rb_raw_object_perceptual_hash(VALUE self);
 
 // LibRaw::IParam
 extern void apply_iparam(VALUE self, libraw_iparams_t *p);
@@ -85,6 +170,10 @@ extern void apply_imgother(VALUE self, libraw_imgother_t *p);
 
 // LibRaw::OutputParam
 extern void apply_output_param(VALUE self, libraw_output_params_t *p);
+extern VALUE rb_output_param_initialize_copy(VALUE self, VALUE orig);
+extern VALUE rb_output_param_equal(VALUE self, VALUE other);
+extern VALUE rb_output_param_hash(VALUE self);
+extern VALUE rb_output_param_s_preset(int argc, VALUE *argv, VALUE klass);
 extern VALUE rb_output_param_greybox(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h);
 extern VALUE rb_output_param_cropbox(VALUE self, VALUE x, VALUE y, VALUE w, VALUE h);
 extern VALUE rb_output_param_gamma(VALUE self, VALUE pwr, VALUE ts);
@@ -108,6 +197,7 @@ extern VALUE rb_output_param_set_median_filter_passes(VALUE self, VALUE val);
 extern VALUE rb_output_param_set_no_auto_bright(VALUE self, VALUE val);
 extern VALUE rb_output_param_set_use_fuji_rotate(VALUE self, VALUE val);
 extern VALUE rb_output_param_set_fbdd_noiserd(VALUE self, VALUE val);
+extern VALUE rb_output_param_set_shot_select(VALUE self, VALUE val);
 
 // LibRaw::MakerNote
 extern void apply_makernote(VALUE self, libraw_makernotes_lens_t *p);
@@ -115,5 +205,62 @@ extern void apply_makernote(VALUE self, libraw_makernotes_lens_t *p);
 // LibRaw::LensInfo
 extern void apply_lensinfo(VALUE self, libraw_lensinfo_t *p);
 
+// LibRaw::ProcessedImage
+extern void release_processed_image(ProcessedImageNativeResource *p);
+extern ProcessedImageNativeResource* get_processed_image(VALUE self);
+extern VALUE wrap_processed_image(ProcessedImageNativeResource *p);
+extern ProcessedImageNativeResource *alloc_processed_image(int width, int height, int colors, int bits);
+extern ProcessedImageNativeResource *alloc_shared_processed_image(int width, int height, int colors, int bits, enum ProcessedImageSampleFormat sample_format);
+extern VALUE rb_processed_image_s_open_shared(VALUE klass, VALUE fd);
+extern VALUE rb_processed_image_descriptor(VALUE self);
+extern VALUE new_processed_image(libraw_processed_image_t *image);
+extern void apply_processed_image(VALUE self, ProcessedImageNativeResource *p);
+extern VALUE rb_processed_image_data(VALUE self);
+extern VALUE rb_processed_image_apply_color(int argc, VALUE *argv, VALUE self);
+extern void flip_point(int flip, int width, int height, int row, int col, int *srow, int *scol);
+extern ProcessedImageNativeResource *copy_bitmap_region(const unsigned char *src, int src_width, int colors, int bits, int x, int y, int w, int h, int flip);
+extern ProcessedImageNativeResource *linear_processed_image(LibRawNativeResource *owner, bool half, bool shared);
+
+// LibRaw::Calibration
+extern CalibrationNativeResource* get_calibration(VALUE self);
+extern VALUE rb_calibration_s_load(int argc, VALUE *argv, VALUE klass);
+
+// LibRaw::MetadataIndex
+extern MetadataIndexNativeResource* get_metadata_index(VALUE self);
+extern VALUE rb_metadata_index_initialize(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_metadata_index_lookup(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_metadata_index_store(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_metadata_index_identify(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_metadata_index_count(VALUE self);
+extern VALUE rb_metadata_index_close(VALUE self);
+
+// LibRaw::RenderCache
+extern VALUE rb_render_cache_initialize(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_render_cache_fetch(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_render_cache_stats(VALUE self);
+extern VALUE rb_render_cache_clear(VALUE self);
+
+// LibRaw
+extern VALUE rb_lib_raw_identify(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_lib_raw_scan(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_lib_raw_batch_open(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_result_success_p(VALUE self);
+extern VALUE new_result(VALUE path, int code, unsigned warnings);
+extern VALUE rb_lib_raw_process_frames(int argc, VALUE *argv, VALUE self);
+extern VALUE rb_lib_raw_threads(VALUE self);
+extern VALUE rb_lib_raw_set_threads(VALUE self, VALUE threads);
+extern VALUE rb_lib_raw_memory_budget(VALUE self);
+extern VALUE rb_lib_raw_set_memory_budget(VALUE self, VALUE bytes);
+extern VALUE rb_lib_raw_memory_budget_timeout(VALUE self);
+extern VALUE rb_lib_raw_set_memory_budget_timeout(VALUE self, VALUE seconds);
+extern VALUE rb_lib_raw_memory_reserved(VALUE self);
+extern VALUE rb_lib_raw_buffer_pool_limit(VALUE self);
+extern VALUE rb_lib_raw_set_buffer_pool_limit(VALUE self, VALUE bytes);
+extern VALUE rb_lib_raw_huge_pages(VALUE self);
+extern VALUE rb_lib_raw_set_huge_pages(VALUE self, VALUE val);
+extern VALUE rb_lib_raw_buffer_pool_stats(VALUE self);
+extern VALUE rb_lib_raw_buffer_pool_trim(VALUE self);
+extern VALUE rb_lib_raw_tune_malloc(int argc, VALUE *argv, VALUE self);
+
 
 #endif /* LIB_RAW_H */